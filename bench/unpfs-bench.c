@@ -0,0 +1,700 @@
+/*
+ * unpfs-bench: end-to-end 9P load generator
+ *
+ * Starts an unpfs on a scratch directory behind a unix socket, drives it
+ * with a mix of operations from many libixp connections, one thread each,
+ * and reports throughput and latency percentiles per operation.
+ */
+#include <ixp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+enum {
+    BENCH_WALK,
+    BENCH_OPEN,
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_STAT,
+    BENCH_READDIR,
+    BENCH_OPS
+};
+
+static const char *const op_names[BENCH_OPS] = {
+    "walk", "open", "read", "write", "stat", "readdir"
+};
+
+/*
+ * Log-linear latency histogram in nanoseconds: HIST_SUB buckets for each
+ * power of two, so percentiles are within about 6% of the true value
+ */
+enum {
+    HIST_SUB_BITS = 4,
+    HIST_SUB = 1 << HIST_SUB_BITS,
+    HIST_SIZE = 64 * HIST_SUB
+};
+
+struct hist {
+    unsigned long count;
+    unsigned long errors;
+    uint64_t max_ns;
+    unsigned long buckets[HIST_SIZE];
+};
+
+struct bench_thread {
+    pthread_t thread;
+    unsigned int id;
+    IxpClient *client;
+    IxpCFid *rfid;
+    IxpCFid *wfid;
+    char *buf;
+    unsigned long bytes[BENCH_OPS];
+    struct hist hist[BENCH_OPS];
+};
+
+static struct {
+    unsigned int conns;
+    unsigned int seconds;
+    unsigned int files;
+    unsigned int dirents;
+    unsigned long iosize;
+    unsigned long filesize;
+    unsigned int mix[BENCH_OPS];
+    unsigned int mix_total;
+    int verbose;
+    char dir[PATH_MAX];
+    char address[PATH_MAX + 8];
+} opts;
+
+static volatile sig_atomic_t stopping = 0;
+static pid_t server_pid = -1;
+
+static void
+usage(const char *program)
+{
+    printf("Usage: %s [-c CONNS] [-t SECONDS] [-m MIX] [-s IOSIZE] [-f FILES]\n"
+            "       [-n ENTRIES] [-v] SERVER [SERVER_OPTION...]\n",
+            program);
+    printf("Options:\n"
+            "    -c CONNS    Open CONNS connections, one thread each (default: 8)\n"
+            "    -t SECONDS  Run for SECONDS (default: 5)\n"
+            "    -m MIX      Relative weights of the operations, a list of\n"
+            "                walk, open, read, write, stat and readdir\n"
+            "                (default: walk=1,open=1,read=4,write=2,stat=2,readdir=1)\n"
+            "    -s IOSIZE   Bytes per read and write (default: 4096)\n");
+    printf("    -f FILES    Files to read, 1 MiB each (default: 16)\n"
+            "    -n ENTRIES  Entries in the directory to list (default: 128)\n"
+            "    -v          Keep the server's log on stderr\n");
+    printf("walk looks up a missing name, open is Topen and Tclunk, read and\n"
+            "write use fids opened once per connection, stat is a walk and a\n"
+            "Tstat and readdir reads a whole directory.  SERVER_OPTIONs are\n"
+            "passed to the server.\n");
+    printf("Example: %s -c 32 -m read=1 ./unpfs -w 8\n", program);
+}
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+    if (remove(path) < 0)
+        fprintf(stderr, "remove %s: %s\n", path, strerror(errno));
+
+    return 0;
+}
+
+static void
+cleanup(void)
+{
+    int status;
+
+    if (server_pid > 0) {
+        kill(server_pid, SIGTERM);
+        waitpid(server_pid, &status, 0);
+        server_pid = -1;
+    }
+
+    if (opts.dir[0])
+        nftw(opts.dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static void
+fatal(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+
+    cleanup();
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+hist_index(uint64_t ns)
+{
+    unsigned int shift = 0;
+
+    if (ns < 2 * HIST_SUB)
+        return (unsigned int)ns;
+
+    while ((ns >> shift) >= 2 * HIST_SUB)
+        ++shift;
+
+    return (shift + 1) * HIST_SUB + (unsigned int)(ns >> shift) - HIST_SUB;
+}
+
+/* Largest latency that falls in bucket i */
+static uint64_t
+hist_value(unsigned int i)
+{
+    unsigned int shift;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+
+    shift = i / HIST_SUB - 1;
+
+    return (((uint64_t)HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+static void
+hist_record(struct hist *h, uint64_t start, int err)
+{
+    uint64_t ns = now_ns() - start;
+
+    ++h->count;
+    if (err)
+        ++h->errors;
+    if (ns > h->max_ns)
+        h->max_ns = ns;
+    ++h->buckets[hist_index(ns)];
+}
+
+static void
+hist_merge(struct hist *to, const struct hist *from)
+{
+    unsigned int i;
+
+    to->count += from->count;
+    to->errors += from->errors;
+    if (from->max_ns > to->max_ns)
+        to->max_ns = from->max_ns;
+    for (i = 0; i < HIST_SIZE; ++i)
+        to->buckets[i] += from->buckets[i];
+}
+
+static double
+hist_percentile_us(const struct hist *h, double q)
+{
+    unsigned long seen = 0, rank = (unsigned long)(h->count * q);
+    unsigned int i;
+
+    if (rank >= h->count)
+        rank = h->count - 1;
+
+    for (i = 0; i < HIST_SIZE; ++i) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            break;
+    }
+
+    if (i == HIST_SIZE || hist_value(i) > h->max_ns)
+        return h->max_ns / 1000.0;
+
+    return hist_value(i) / 1000.0;
+}
+
+
+/*
+ * Operations, each returning nonzero on failure
+ */
+
+static int
+bench_walk(struct bench_thread *t, unsigned int *seed)
+{
+    char path[64];
+    IxpStat *st;
+
+    /* The name never exists, so the reply is the Rerror of the Twalk */
+    snprintf(path, sizeof path, "/files/missing%u", rand_r(seed) % opts.files);
+    st = ixp_stat(t->client, path);
+    if (st) {
+        ixp_freestat(st);
+        free(st);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int
+bench_open(struct bench_thread *t, unsigned int *seed)
+{
+    char path[64];
+    IxpCFid *fid;
+
+    snprintf(path, sizeof path, "/files/f%u", rand_r(seed) % opts.files);
+    fid = ixp_open(t->client, path, P9_OREAD);
+    if (!fid)
+        return 1;
+
+    return ixp_close(fid) <= 0;
+}
+
+static uint64_t
+random_offset(unsigned int *seed)
+{
+    unsigned long blocks = opts.filesize / opts.iosize;
+
+    return (uint64_t)(rand_r(seed) % blocks) * opts.iosize;
+}
+
+static int
+bench_read(struct bench_thread *t, unsigned int *seed)
+{
+    long n = ixp_pread(t->rfid, t->buf, opts.iosize, random_offset(seed));
+
+    if (n != (long)opts.iosize)
+        return 1;
+    t->bytes[BENCH_READ] += n;
+
+    return 0;
+}
+
+static int
+bench_write(struct bench_thread *t, unsigned int *seed)
+{
+    long n = ixp_pwrite(t->wfid, t->buf, opts.iosize, random_offset(seed));
+
+    if (n != (long)opts.iosize)
+        return 1;
+    t->bytes[BENCH_WRITE] += n;
+
+    return 0;
+}
+
+static int
+bench_stat(struct bench_thread *t, unsigned int *seed)
+{
+    char path[64];
+    IxpStat *st;
+
+    snprintf(path, sizeof path, "/files/f%u", rand_r(seed) % opts.files);
+    st = ixp_stat(t->client, path);
+    if (!st)
+        return 1;
+
+    ixp_freestat(st);
+    free(st);
+
+    return 0;
+}
+
+static int
+bench_readdir(struct bench_thread *t, unsigned int *seed)
+{
+    IxpCFid *fid = ixp_open(t->client, "/dir", P9_OREAD);
+    long n;
+
+    if (!fid)
+        return 1;
+
+    while ((n = ixp_read(fid, t->buf, opts.iosize)) > 0)
+        t->bytes[BENCH_READDIR] += n;
+
+    return (ixp_close(fid) <= 0) | (n < 0);
+}
+
+static int (*const bench_ops[BENCH_OPS])(struct bench_thread *, unsigned int *) = {
+    bench_walk,
+    bench_open,
+    bench_read,
+    bench_write,
+    bench_stat,
+    bench_readdir
+};
+
+static unsigned int
+pick_op(unsigned int *seed)
+{
+    unsigned int r = rand_r(seed) % opts.mix_total, op;
+
+    for (op = 0; r >= opts.mix[op]; ++op)
+        r -= opts.mix[op];
+
+    return op;
+}
+
+static void *
+bench_thread_main(void *arg)
+{
+    struct bench_thread *t = arg;
+    unsigned int seed = t->id * 2654435761U + 1;
+
+    while (!stopping) {
+        unsigned int op = pick_op(&seed);
+        uint64_t start = now_ns();
+        int err = bench_ops[op](t, &seed);
+
+        hist_record(&t->hist[op], start, err);
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Scratch directory and server
+ */
+
+static void
+create_file(const char *path, const char *buf, unsigned long size)
+{
+    unsigned long done;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0)
+        fatal("open %s: %s\n", path, strerror(errno));
+
+    for (done = 0; done < size; done += opts.iosize) {
+        if (write(fd, buf, opts.iosize) != (ssize_t)opts.iosize)
+            fatal("write %s: %s\n", path, strerror(errno));
+    }
+
+    close(fd);
+}
+
+static void
+populate(const char *buf)
+{
+    char path[PATH_MAX];
+    unsigned int i;
+
+    snprintf(path, sizeof path, "%s/root", opts.dir);
+    if (mkdir(path, 0755) < 0)
+        fatal("mkdir %s: %s\n", path, strerror(errno));
+    snprintf(path, sizeof path, "%s/root/files", opts.dir);
+    if (mkdir(path, 0755) < 0)
+        fatal("mkdir %s: %s\n", path, strerror(errno));
+    snprintf(path, sizeof path, "%s/root/dir", opts.dir);
+    if (mkdir(path, 0755) < 0)
+        fatal("mkdir %s: %s\n", path, strerror(errno));
+
+    for (i = 0; i < opts.files; ++i) {
+        snprintf(path, sizeof path, "%s/root/files/f%u", opts.dir, i);
+        create_file(path, buf, opts.filesize);
+    }
+    for (i = 0; i < opts.conns; ++i) {
+        snprintf(path, sizeof path, "%s/root/files/w%u", opts.dir, i);
+        create_file(path, buf, opts.filesize);
+    }
+    for (i = 0; i < opts.dirents; ++i) {
+        snprintf(path, sizeof path, "%s/root/dir/entry%u", opts.dir, i);
+        create_file(path, buf, 0);
+    }
+}
+
+static void
+start_server(char **server_argv, int server_argc)
+{
+    char root[PATH_MAX];
+    char **argv = malloc((server_argc + 3) * sizeof *argv);
+    int i, fd;
+
+    if (!argv)
+        fatal("malloc: %s\n", strerror(ENOMEM));
+
+    snprintf(root, sizeof root, "%s/root", opts.dir);
+    for (i = 0; i < server_argc; ++i)
+        argv[i] = server_argv[i];
+    argv[i++] = opts.address;
+    argv[i++] = root;
+    argv[i] = NULL;
+
+    server_pid = fork();
+    if (server_pid < 0)
+        fatal("fork: %s\n", strerror(errno));
+
+    if (server_pid == 0) {
+        if (!opts.verbose && (fd = open("/dev/null", O_WRONLY)) >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv);
+        fprintf(stderr, "execv %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    free(argv);
+}
+
+/* Mounts the server, waiting up to 5 seconds for it to come up */
+static IxpClient *
+mount_server(void)
+{
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+    IxpClient *client;
+    int tries, status;
+
+    for (tries = 0; tries < 500; ++tries) {
+        client = ixp_mount(opts.address);
+        if (client)
+            return client;
+
+        if (waitpid(server_pid, &status, WNOHANG) == server_pid) {
+            server_pid = -1;
+            fatal("server exited with status %d\n",
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        }
+        nanosleep(&delay, NULL);
+    }
+
+    fatal("ixp_mount %s: %s\n", opts.address, ixp_errbuf());
+
+    return NULL;
+}
+
+/*
+ * Options and report
+ */
+
+static unsigned long
+parse_count(const char *program, const char *arg, unsigned long min, unsigned long max)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || n < (long)min || (unsigned long)n > max) {
+        usage(program);
+        exit(EXIT_FAILURE);
+    }
+
+    return (unsigned long)n;
+}
+
+static void
+parse_mix(const char *program, char *arg)
+{
+    char *item, *save = NULL, *eq;
+    unsigned int op;
+
+    memset(opts.mix, 0, sizeof opts.mix);
+    opts.mix_total = 0;
+
+    for (item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        eq = strchr(item, '=');
+        if (eq)
+            *eq++ = '\0';
+
+        for (op = 0; op < BENCH_OPS && strcmp(item, op_names[op]); ++op)
+            ;
+        if (op == BENCH_OPS) {
+            usage(program);
+            exit(EXIT_FAILURE);
+        }
+
+        opts.mix[op] = eq ? parse_count(program, eq, 0, 1000) : 1;
+        opts.mix_total += opts.mix[op];
+    }
+
+    if (!opts.mix_total) {
+        usage(program);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+report(struct bench_thread *threads, double elapsed)
+{
+    struct hist *total = calloc(BENCH_OPS, sizeof *total);
+    unsigned long bytes[BENCH_OPS], ops = 0, errors = 0;
+    unsigned int i, op;
+
+    if (!total)
+        fatal("calloc: %s\n", strerror(ENOMEM));
+
+    memset(bytes, 0, sizeof bytes);
+    for (i = 0; i < opts.conns; ++i) {
+        for (op = 0; op < BENCH_OPS; ++op) {
+            hist_merge(&total[op], &threads[i].hist[op]);
+            bytes[op] += threads[i].bytes[op];
+        }
+    }
+
+    printf("%-8s %10s %8s %12s %10s %10s %10s %10s %10s\n",
+        "op", "count", "errors", "ops/s", "MiB/s",
+        "p50us", "p90us", "p99us", "maxus");
+
+    for (op = 0; op < BENCH_OPS; ++op) {
+        const struct hist *h = &total[op];
+
+        if (!h->count)
+            continue;
+
+        printf("%-8s %10lu %8lu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            op_names[op], h->count, h->errors, h->count / elapsed,
+            bytes[op] / elapsed / (1024 * 1024),
+            hist_percentile_us(h, 0.5), hist_percentile_us(h, 0.9),
+            hist_percentile_us(h, 0.99), h->max_ns / 1000.0);
+
+        ops += h->count;
+        errors += h->errors;
+    }
+
+    printf("%-8s %10lu %8lu %12.0f\n", "total", ops, errors, ops / elapsed);
+
+    free(total);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench_thread *threads;
+    struct timespec duration;
+    IxpClient *probe;
+    uint64_t start;
+    char path[PATH_MAX], default_mix[64];
+    unsigned int i;
+    int opt;
+
+    opts.conns = 8;
+    opts.seconds = 5;
+    opts.files = 16;
+    opts.dirents = 128;
+    opts.iosize = 4096;
+    opts.filesize = 1024 * 1024;
+    strcpy(default_mix, "walk=1,open=1,read=4,write=2,stat=2,readdir=1");
+    parse_mix(argv[0], default_mix);
+
+    /* '+' stops at SERVER, leaving its options alone */
+    while ((opt = getopt(argc, argv, "+c:t:m:s:f:n:v")) != -1) {
+        switch (opt) {
+        case 'c':
+            opts.conns = parse_count(argv[0], optarg, 1, 4096);
+            break;
+        case 't':
+            opts.seconds = parse_count(argv[0], optarg, 1, 3600);
+            break;
+        case 'm':
+            parse_mix(argv[0], optarg);
+            break;
+        case 's':
+            opts.iosize = parse_count(argv[0], optarg, 1, opts.filesize);
+            break;
+        case 'f':
+            opts.files = parse_count(argv[0], optarg, 1, 65536);
+            break;
+        case 'n':
+            opts.dirents = parse_count(argv[0], optarg, 0, 1000000);
+            break;
+        case 'v':
+            opts.verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 1) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Whole I/Os per file */
+    opts.filesize -= opts.filesize % opts.iosize;
+
+    threads = calloc(opts.conns, sizeof *threads);
+    if (!threads)
+        fatal("calloc: %s\n", strerror(ENOMEM));
+    threads[0].buf = malloc(opts.iosize);
+    if (!threads[0].buf)
+        fatal("malloc: %s\n", strerror(ENOMEM));
+    memset(threads[0].buf, 'u', opts.iosize);
+
+    strcpy(opts.dir, "/tmp/unpfs-bench.XXXXXX");
+    if (!mkdtemp(opts.dir))
+        fatal("mkdtemp: %s\n", strerror(errno));
+    snprintf(opts.address, sizeof opts.address, "unix!%s/sock", opts.dir);
+
+    populate(threads[0].buf);
+
+    ixp_pthread_init();
+    signal(SIGPIPE, SIG_IGN);
+    start_server(argv + optind, argc - optind);
+    probe = mount_server();
+    ixp_unmount(probe);
+
+    for (i = 0; i < opts.conns; ++i) {
+        struct bench_thread *t = &threads[i];
+
+        t->id = i;
+        if (i && !(t->buf = malloc(opts.iosize)))
+            fatal("malloc: %s\n", strerror(ENOMEM));
+        if (!(t->client = ixp_mount(opts.address)))
+            fatal("ixp_mount: %s\n", ixp_errbuf());
+
+        snprintf(path, sizeof path, "/files/f%u", i % opts.files);
+        if (!(t->rfid = ixp_open(t->client, path, P9_OREAD)))
+            fatal("open %s: %s\n", path, ixp_errbuf());
+        snprintf(path, sizeof path, "/files/w%u", i);
+        if (!(t->wfid = ixp_open(t->client, path, P9_OWRITE)))
+            fatal("open %s: %s\n", path, ixp_errbuf());
+    }
+
+    printf("unpfs-bench: %u connections, %u s, %lu byte I/O, %u files, %u entries\n",
+        opts.conns, opts.seconds, opts.iosize, opts.files, opts.dirents);
+
+    start = now_ns();
+    for (i = 0; i < opts.conns; ++i) {
+        if (pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]))
+            fatal("pthread_create: %s\n", strerror(errno));
+    }
+
+    duration.tv_sec = opts.seconds;
+    duration.tv_nsec = 0;
+    while (nanosleep(&duration, &duration) < 0 && errno == EINTR)
+        ;
+    stopping = 1;
+
+    for (i = 0; i < opts.conns; ++i)
+        pthread_join(threads[i].thread, NULL);
+
+    report(threads, (now_ns() - start) / 1e9);
+
+    for (i = 0; i < opts.conns; ++i) {
+        ixp_close(threads[i].rfid);
+        ixp_close(threads[i].wfid);
+        ixp_unmount(threads[i].client);
+        free(threads[i].buf);
+    }
+    free(threads);
+
+    cleanup();
+
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef UNPFS_ARENA_H
+#define UNPFS_ARENA_H
+
+#include <unpfs/common.h>
+
+/*
+ * Per-thread scratch memory for the request a thread is serving, such
+ * as path buffers.  Nothing is freed individually: all of it is released
+ * by unpfs_arena_reset() once the request has been answered.
+ */
+struct unpfs_arena_stats {
+    unsigned long allocs;
+    unsigned long bytes;
+    unsigned long overflows;    /* Allocations that did not fit the arena */
+    unsigned long arenas;
+};
+
+/* NULL with errno ENOMEM if out of memory */
+extern void *unpfs_arena_alloc(size_t size);
+extern void unpfs_arena_reset(void);
+extern void unpfs_arena_stats(struct unpfs_arena_stats *stats);
+
+#endif  /* UNPFS_ARENA_H */
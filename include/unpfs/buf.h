@@ -0,0 +1,28 @@
+#ifndef UNPFS_BUF_H
+#define UNPFS_BUF_H
+
+#include <unpfs/common.h>
+
+/*
+ * Size-classed pool of reply payload buffers.  Buffers are not zeroed
+ * and must be released with unpfs_buf_free(), never free(3), which
+ * also releases payloads pointing into file mappings.
+ */
+struct unpfs_buf_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long cached;
+    unsigned long cached_bytes;
+};
+
+extern char *unpfs_buf_alloc(size_t size);
+extern void unpfs_buf_free(char *buf);
+
+/*
+ * Takes a buffer out of the pool for code that will free(3) it, such as
+ * ixp_respond(); 0 if buf is not a pool buffer but a mapping or a pipe
+ */
+extern int unpfs_buf_detach(char *buf);
+extern void unpfs_buf_stats(struct unpfs_buf_stats *stats);
+
+#endif  /* UNPFS_BUF_H */
@@ -0,0 +1,47 @@
+#ifndef UNPFS_CCACHE_H
+#define UNPFS_CCACHE_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Whole contents of small regular files, keyed by inode and checked
+ * against its size, mtime and ctime each time a read-only handle is
+ * opened, which is then read from memory.  Files unpfs has open for
+ * writing are not cached, and truncating or removing a file invalidates
+ * its contents; handles holding them fall back to reading the file.
+ * Least recently used contents go first once over the budget.
+ */
+struct unpfs_ccache;
+
+struct unpfs_ccache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long bytes;
+};
+
+/* Keep up to budget bytes of files no bigger than max_size, 0 disables */
+extern void unpfs_ccache_init(size_t budget, size_t max_size);
+extern int unpfs_ccache_enabled(void);
+
+/* The contents of the file open at fd, which stbuf describes, or NULL */
+extern struct unpfs_ccache *unpfs_ccache_get(int fd, const struct stat *stbuf);
+extern void unpfs_ccache_put(struct unpfs_ccache *c);
+
+/* A fresh buffer in *buf; -1 with errno ENODEV if c is no longer valid */
+extern ssize_t unpfs_ccache_read(struct unpfs_ccache *c, char **buf,
+                                 size_t count, uint64_t offset);
+
+/* Brackets a descriptor open for writing to the file stbuf describes */
+extern void unpfs_ccache_write_begin(const struct stat *stbuf);
+extern void unpfs_ccache_write_end(const struct stat *stbuf);
+
+/* Drops the contents of the file at dirfd/name, or of dirfd for "" */
+extern void unpfs_ccache_invalidate(int dirfd, const char *name);
+
+extern void unpfs_ccache_stats(struct unpfs_ccache_stats *stats);
+
+#endif  /* UNPFS_CCACHE_H */
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <limits.h>
 
+/* Zeroed memory, exiting if there is none */
 extern void *zalloc(size_t size);
 extern void zfree(char **m);
 
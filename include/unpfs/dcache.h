@@ -0,0 +1,32 @@
+#ifndef UNPFS_DCACHE_H
+#define UNPFS_DCACHE_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * Walk cache of qids for 9P paths under the served root, including paths
+ * known not to exist.  Entries are only kept for directories watched with
+ * inotify(7); unpfs_dcache_sync() applies the pending events and is called
+ * before a walk consults the cache.
+ */
+struct unpfs_dcache_stats {
+    unsigned long hits;
+    unsigned long negative_hits;
+    unsigned long misses;
+    unsigned long entries;
+};
+
+extern int unpfs_dcache_init(const char *root, unsigned long max_entries);
+extern void unpfs_dcache_sync(void);
+
+/* 0 and *qid for a known path, ENOENT for a missing one, -1 if not cached */
+extern int unpfs_dcache_lookup(const char *path, IxpQid *qid);
+extern void unpfs_dcache_insert(const char *path, const IxpQid *qid, int err);
+
+/* Forget path and everything below it */
+extern void unpfs_dcache_invalidate(const char *path);
+
+extern void unpfs_dcache_stats(struct unpfs_dcache_stats *stats);
+
+#endif  /* UNPFS_DCACHE_H */
@@ -0,0 +1,72 @@
+#ifndef UNPFS_DOTL_H
+#define UNPFS_DOTL_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * 9P2000.L, the dialect of the Linux v9fs client.  libixp only speaks
+ * 9P2000, so connections whose Tversion asks for 9P2000.L are taken
+ * over and served by unpfs itself; the rest stay with libixp.
+ */
+#define DOTL_VERSION "9P2000.L"
+
+enum {
+    DOTL_TLERROR = 6,       DOTL_RLERROR,
+    DOTL_TSTATFS = 8,       DOTL_RSTATFS,
+    DOTL_TLOPEN = 12,       DOTL_RLOPEN,
+    DOTL_TLCREATE = 14,     DOTL_RLCREATE,
+    DOTL_TSYMLINK = 16,     DOTL_RSYMLINK,
+    DOTL_TMKNOD = 18,       DOTL_RMKNOD,
+    DOTL_TRENAME = 20,      DOTL_RRENAME,
+    DOTL_TREADLINK = 22,    DOTL_RREADLINK,
+    DOTL_TGETATTR = 24,     DOTL_RGETATTR,
+    DOTL_TSETATTR = 26,     DOTL_RSETATTR,
+    DOTL_TXATTRWALK = 30,   DOTL_RXATTRWALK,
+    DOTL_TXATTRCREATE = 32, DOTL_RXATTRCREATE,
+    DOTL_TREADDIR = 40,     DOTL_RREADDIR,
+    DOTL_TFSYNC = 50,       DOTL_RFSYNC,
+    DOTL_TLOCK = 52,        DOTL_RLOCK,
+    DOTL_TGETLOCK = 54,     DOTL_RGETLOCK,
+    DOTL_TLINK = 70,        DOTL_RLINK,
+    DOTL_TMKDIR = 72,       DOTL_RMKDIR,
+    DOTL_TRENAMEAT = 74,    DOTL_RRENAMEAT,
+    DOTL_TUNLINKAT = 76,    DOTL_RUNLINKAT
+};
+
+/* Tlopen and Tlcreate flags */
+enum {
+    DOTL_O_WRONLY    = 00000001,
+    DOTL_O_RDWR      = 00000002,
+    DOTL_O_CREAT     = 00000100,
+    DOTL_O_EXCL      = 00000200,
+    DOTL_O_TRUNC     = 00001000,
+    DOTL_O_APPEND    = 00002000,
+    DOTL_O_DSYNC     = 00010000,
+    DOTL_O_DIRECTORY = 00200000,
+    DOTL_O_NOFOLLOW  = 00400000,
+    DOTL_O_SYNC      = 04000000
+};
+
+/* Tsetattr valid bits */
+enum {
+    DOTL_SETATTR_MODE      = 0x001,
+    DOTL_SETATTR_UID       = 0x002,
+    DOTL_SETATTR_GID       = 0x004,
+    DOTL_SETATTR_SIZE      = 0x008,
+    DOTL_SETATTR_ATIME     = 0x010,
+    DOTL_SETATTR_MTIME     = 0x020,
+    DOTL_SETATTR_ATIME_SET = 0x080,
+    DOTL_SETATTR_MTIME_SET = 0x100
+};
+
+/* Every Rgetattr field up to blocks */
+#define DOTL_GETATTR_BASIC  0x7ff
+
+/* Tunlinkat flag */
+#define DOTL_AT_REMOVEDIR   0x200
+
+/* Listener callback to pass to ixp_listen() in place of ixp_serve9conn() */
+extern void unpfs_serve9conn(IxpConn *c);
+
+#endif  /* UNPFS_DOTL_H */
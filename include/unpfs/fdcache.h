@@ -0,0 +1,39 @@
+#ifndef UNPFS_FDCACHE_H
+#define UNPFS_FDCACHE_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+
+/*
+ * Open descriptors of regular files, keyed by inode and access mode, that
+ * fids opening the same file the same way share.  Descriptors no fid holds
+ * stay open for the next open up to a budget, least recently used first
+ * out.  Opens with flags beyond O_ACCMODE and O_NOFOLLOW are not cached.
+ */
+struct unpfs_fdcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long entries;
+    unsigned long idle;         /* Entries no fid holds */
+};
+
+/* Keep up to budget descriptors, 0 disables the cache */
+extern void unpfs_fdcache_init(unsigned long budget);
+
+/* openat(2) of dirfd/name, whose O_PATH descriptor is pathfd */
+extern int unpfs_fdcache_open(int dirfd, const char *name, int pathfd,
+                              int flags, mode_t mode);
+/* Releases a descriptor unpfs_fdcache_open() returned */
+extern int unpfs_fdcache_close(int fd);
+
+/*
+ * Drops the descriptors of the file at dirfd/name, or of dirfd itself
+ * for "", before it is unlinked, replaced or has its permissions changed.
+ * Descriptors still in use are closed by their last release.
+ */
+extern void unpfs_fdcache_invalidate(int dirfd, const char *name);
+
+extern void unpfs_fdcache_stats(struct unpfs_fdcache_stats *stats);
+
+#endif  /* UNPFS_FDCACHE_H */
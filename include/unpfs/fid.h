@@ -2,30 +2,80 @@
 #define UNPFS_FID_H
 
 #include <unpfs/common.h>
+#include <unpfs/uring.h>
+#include <sys/stat.h>
 
 struct unpfs_fid;
 
 struct fid_handler {
-    int (*open)(struct unpfs_fid *, const char *, int, mode_t);
+    /* With O_CREAT, creates the fid's name in its parent directory */
+    int (*open)(struct unpfs_fid *, int, mode_t);
     ssize_t (*read)(struct unpfs_fid *, char **buf, size_t, uint64_t);
     ssize_t (*write)(struct unpfs_fid *, const void *buf, size_t, uint64_t);
     int (*close)(struct unpfs_fid *);
     int (*remove)(struct unpfs_fid *);
+    /* Optional: start the I/O and report it through done; -1 if not started */
+    int (*aread)(struct unpfs_fid *, char **buf, size_t, uint64_t,
+                 unpfs_io_done done, void *arg);
+    int (*awrite)(struct unpfs_fid *, const void *buf, size_t, uint64_t,
+                  unpfs_io_done done, void *arg);
+    /* Optional: attributes of a fid with no descriptor behind it */
+    int (*stat)(struct unpfs_fid *, struct stat *);
+    /* Optional: write out buffered data, -1 if that or an earlier write failed */
+    int (*flush)(struct unpfs_fid *);
 };
 
 extern const struct fid_handler file_handler;
+extern const struct fid_handler uring_file_handler;
 extern const struct fid_handler dir_handler;
 
+/* Handler given to regular files */
+extern const struct fid_handler *file_backend;
+
 struct unpfs_fid {
     char *path;
     char *real_path;
+    int dirfd;      /* O_PATH parent directory, AT_FDCWD for the root */
+    int pathfd;     /* O_PATH descriptor of the file itself */
     uint8_t type;
     const struct fid_handler *handler;
     void *priv;
 };
 
+struct unpfs_fid_stats {
+    unsigned long live;
+    unsigned long slabs;
+    unsigned long allocs;
+};
+
 extern struct unpfs_fid *unpfs_fid_new(const char *path, uint8_t type);
 extern struct unpfs_fid *unpfs_fid_clone(struct unpfs_fid *fid);
 extern void unpfs_fid_destroy(struct unpfs_fid *fid);
+extern void unpfs_fid_stats(struct unpfs_fid_stats *stats);
+
+/* The name to pass with fid->dirfd to the *at() calls */
+extern const char *unpfs_fid_name(const struct unpfs_fid *fid);
+
+/* fstat(2) of the fid, through its handler if it has no descriptor */
+extern int unpfs_fid_stat(struct unpfs_fid *fid, struct stat *stbuf);
+
+/* Writes out data the fid's handler has buffered; -1 with the write's errno */
+extern int unpfs_fid_flush(struct unpfs_fid *fid);
+
+/* openat(2) of name with O_PATH added to flags */
+extern int unpfs_open_path(int dirfd, const char *name, int flags);
+
+/* 9P2000.L Treaddir records of an open directory fid, resuming at cookie offset */
+extern ssize_t unpfs_dir_readdir(struct unpfs_fid *fid, char *buf, size_t count,
+                                 uint64_t offset);
+
+/* The descriptor of an open regular file fid, -1 otherwise */
+extern int unpfs_fid_fd(struct unpfs_fid *fid);
+
+/* Accounts a read of a regular file fid made without its handler, for readahead */
+extern void unpfs_fid_readahead(struct unpfs_fid *fid, size_t count, uint64_t offset);
+
+/* Schedules buffered writes to be written out; server loop only */
+extern void unpfs_fid_writeback_poll(void);
 
 #endif  /* UNPFS_FID_H */
@@ -0,0 +1,43 @@
+#ifndef UNPFS_FMAP_H
+#define UNPFS_FMAP_H
+
+#include <unpfs/common.h>
+
+/*
+ * Read-only shared mappings of whole files, one per inode, which reads
+ * are served from without copying.  The payload a read returns points
+ * into the mapping and keeps it alive until unpfs_buf_free() releases it.
+ * A mapping whose file has changed size is retired: reads of it fail with
+ * ESTALE and it is unmapped once nothing refers to it any more.
+ */
+struct unpfs_fmap;
+
+struct unpfs_fmap_stats {
+    unsigned long maps;
+    unsigned long bytes;
+    unsigned long reads;
+    unsigned long retired;
+};
+
+/* The mapping of the file open at fd, NULL with errno on failure */
+extern struct unpfs_fmap *unpfs_fmap_get(int fd);
+extern void unpfs_fmap_put(struct unpfs_fmap *map);
+
+/*
+ * Points *data at up to count bytes at offset of the file open at fd,
+ * faulted in.  -1 with ESTALE if the file changed size, and with ENODEV
+ * if the pages could not be faulted in, which is then to be read instead.
+ */
+extern ssize_t unpfs_fmap_read(struct unpfs_fmap *map, int fd, char **data,
+                               size_t count, uint64_t offset);
+
+/* posix_madvise(3) of a range of the mapping, all of it if length is 0 */
+extern void unpfs_fmap_advise(struct unpfs_fmap *map, uint64_t offset,
+                              uint64_t length, int advice);
+
+/* Releases a payload if it points into a mapping, 0 if it does not */
+extern int unpfs_fmap_release(const char *data);
+
+extern void unpfs_fmap_stats(struct unpfs_fmap_stats *stats);
+
+#endif  /* UNPFS_FMAP_H */
@@ -0,0 +1,30 @@
+#ifndef UNPFS_INFLIGHT_H
+#define UNPFS_INFLIGHT_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * 9P2000 requests still in progress once their handler has returned:
+ * handed to a worker or waiting for asynchronous I/O.  They are kept by
+ * connection and tag, on the server loop only.  A Tflush of one asks its
+ * owner to cancel it; if that is too late, the Tflush is held and then
+ * answered, after any held before it, once the request has ended.
+ */
+
+/* 0 if r was cancelled and will never end, 1 if it will still end */
+typedef int (*unpfs_cancel_fn)(Ixp9Req *r, void *arg);
+
+extern void unpfs_inflight_begin(Ixp9Req *r, uint64_t start,
+                                 unpfs_cancel_fn cancel, void *arg);
+
+/*
+ * Ends r, setting *start if not NULL.  Returns the Tflushes held for it,
+ * chained by aux, to be answered in that order instead of r, or NULL.
+ */
+extern Ixp9Req *unpfs_inflight_end(Ixp9Req *r, uint64_t *start);
+
+/* 1 if the Tflush is held, 0 if it is to be answered now */
+extern int unpfs_inflight_flush(Ixp9Req *flush);
+
+#endif  /* UNPFS_INFLIGHT_H */
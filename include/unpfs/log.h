@@ -6,13 +6,29 @@
 
 extern int unpfs_log_level(int level);
 
+/*
+ * After unpfs_log_start() messages are queued and written to stderr by a
+ * logger thread, dropped and counted if it falls behind.  Messages are
+ * cut to a line of about 190 bytes; unpfs_log_text() writes long ones
+ * directly.
+ */
+extern int unpfs_log_start(void);
+extern void unpfs_log_stop(void);
+extern void unpfs_log_text(int pri, const char *text);
+
 #ifdef NDEBUG
 #   define unpfs_syslog unpfs_log_dummy
 #   define unpfs_log unpfs_log_dummy
+#   define unpfs_log_request unpfs_log_request_dummy
     extern void unpfs_log_dummy(int pri, const char *fmt, ...);
+    extern void unpfs_log_request_dummy(uint8_t type, uint16_t tag,
+        uint32_t fid, uint32_t size, int err, uint64_t start);
 #else
 #   define unpfs_syslog syslog
     extern void unpfs_log(int pri, const char *fmt, ...);
+    /* A LOG_NOTICE record of a request answered, start from unpfs_stats_now() */
+    extern void unpfs_log_request(uint8_t type, uint16_t tag, uint32_t fid,
+        uint32_t size, int err, uint64_t start);
 #endif  /* NDEBUG */
 
 
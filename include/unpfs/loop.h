@@ -0,0 +1,15 @@
+#ifndef UNPFS_LOOP_H
+#define UNPFS_LOOP_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * epoll(7) replacement for ixp_serverloop().  Serves every IxpConn
+ * registered on server through ixp_listen(), honours server->preselect
+ * and server->running, and fires libixp timers.  9P connections whose
+ * client is over its allowance (see qos.h) are not read until it is back.
+ */
+extern int unpfs_serverloop(IxpServer *server);
+
+#endif  /* UNPFS_LOOP_H */
@@ -2,11 +2,26 @@
 #define UNPFS_OPS_H
 
 #include <unpfs/common.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <ixp.h>
 
+struct unpfs_fid;
+
+enum {
+    /* Room a Tread/Twrite leaves around its data, as in Plan 9's IOHDRSZ */
+    UNPFS_IOHDRSZ = 24,
+    /* libixp negotiates no more than IXP_MAX_MSG for 9P2000 */
+    UNPFS_IOUNIT = IXP_MAX_MSG - UNPFS_IOHDRSZ
+};
+
 struct ixp_context {
     int fd;
     const char *root;
+    int zerocopy;           /* Splice regular file reads into connections */
+    uint32_t msize;         /* Largest 9P2000.L message accepted */
+    size_t wbsize;          /* Coalesce smaller writes into buffers this big */
+    uint64_t mapsize;       /* Map read-only files this big to serve reads */
     struct IxpServer server;
     struct IxpConn *conn;
 };
@@ -14,6 +29,21 @@ struct ixp_context {
 extern struct ixp_context ctx;
 
 extern char *get_real_path(const char *path);
+/* dir/name, allocated to fit */
+extern char *unpfs_path_join(const char *dir, const char *name);
+extern void unpfs_respond(Ixp9Req *r, int err);
+extern void unpfs_discard_reply(Ixp9Req *r);
+
+/*
+ * Fid operations for both dialects; -1 or NULL with errno on failure.
+ * unpfs_fid_walk() returns how many names it walked and sets *newfid
+ * only if it walked them all.
+ */
+extern struct unpfs_fid *unpfs_fid_root(struct stat *stbuf);
+extern int unpfs_fid_walk(struct unpfs_fid *fid, unsigned int nwname, char **wname,
+                          IxpQid *wqid, struct unpfs_fid **newfid);
+extern int unpfs_fid_create(struct unpfs_fid *fid, const char *name, uint8_t type,
+                            int flags, mode_t mode, struct stat *stbuf);
 
 extern void unpfs_attach(Ixp9Req *r);
 extern void unpfs_clunk(Ixp9Req *r);
@@ -6,8 +6,10 @@
 #include <sys/stat.h>
 #include <ixp.h>
 
+extern void qid_posix_to_9p(IxpQid *qid, const struct stat *buf);
 extern void stat_posix_to_9p(IxpStat *stat, char *name, struct stat *buf);
 extern mode_t perm_9p_to_posix(uint32_t perm);
 extern int open_mode_9p_to_posix(uint8_t mode_9p);
+extern int open_flags_dotl_to_posix(uint32_t flags);
 
 #endif  /* UNPFS_POSIX_H */
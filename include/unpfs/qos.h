@@ -0,0 +1,42 @@
+#ifndef UNPFS_QOS_H
+#define UNPFS_QOS_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * Per-client request scheduling.  Both dialects decode one message per
+ * read of a connection on the server loop, so the loop asks before each
+ * read whether the client may send another, and holds the connection
+ * until its token buckets allow it.  Buckets refill at a rate per second
+ * and hold one second's worth.  Data requests (Tread, Twrite, Treaddir)
+ * take an op and their count in bytes; metadata requests take an op of
+ * their own class, so they keep flowing while a client's data is held.
+ * A client is a connection, or with by_user every connection last
+ * attached under one user name.
+ */
+struct unpfs_qos_config {
+    unsigned long ops;          /* Data requests per second, 0 for no limit */
+    unsigned long bytes;        /* Bytes read or written per second */
+    unsigned long meta_ops;     /* Metadata requests per second */
+    int by_user;
+};
+
+struct unpfs_qos_stats {
+    unsigned long clients;
+    unsigned long admitted;
+    unsigned long held;
+};
+
+extern void unpfs_qos_init(const struct unpfs_qos_config *config);
+
+/* Whether any limit is set; nothing else needs calling if not */
+extern int unpfs_qos_enabled(void);
+
+/* 0 to read the next message of c now, else milliseconds to hold c for */
+extern long unpfs_qos_admit(IxpConn *c);
+extern void unpfs_qos_close(IxpConn *c);
+
+extern void unpfs_qos_stats(struct unpfs_qos_stats *stats);
+
+#endif  /* UNPFS_QOS_H */
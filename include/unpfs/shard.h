@@ -0,0 +1,24 @@
+#ifndef UNPFS_SHARD_H
+#define UNPFS_SHARD_H
+
+#include <unpfs/common.h>
+
+/*
+ * Multi-process serving: every shard binds the same TCP address with
+ * SO_REUSEPORT, so the kernel spreads incoming connections over them.
+ */
+
+/* Listening socket for a tcp!host!port address, -1 with errno on failure */
+extern int unpfs_shard_announce(const char *address);
+
+/*
+ * Forks nshards processes running serve(shard, arg), each pinned to a CPU
+ * of its own if pin is set, and restarts any that exits until SIGHUP,
+ * SIGINT or SIGTERM, which is passed on to them.  SIGUSR1 logs their
+ * combined statistics.  Returns in the supervisor only, -1 with errno if
+ * it could not start.
+ */
+extern int unpfs_shard_run(unsigned int nshards, int pin,
+                           int (*serve)(unsigned int shard, void *arg), void *arg);
+
+#endif  /* UNPFS_SHARD_H */
@@ -0,0 +1,27 @@
+#ifndef UNPFS_SPLICE_H
+#define UNPFS_SPLICE_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+
+/*
+ * Zero-copy replies through pipes.  unpfs_splice_fill() moves up to count
+ * bytes of fd into a pipe of its own, on whichever thread reads the file,
+ * and points *data at a token standing for the pipe in place of a Rread
+ * payload.  It returns how many bytes it moved, 0 at end of file, or -1 if
+ * fd cannot be spliced or every pipe is taken.  unpfs_splice_send() then
+ * writes header and the contents of the pipe to sock; -1 means the
+ * connection is unusable.  unpfs_buf_free() gives the pipe back, and
+ * drops whatever was not sent.
+ */
+extern ssize_t unpfs_splice_fill(int fd, uint64_t offset, size_t count, char **data);
+extern int unpfs_splice_is_pipe(const char *data);
+extern int unpfs_splice_send(int sock, const void *header, size_t length, char *data);
+
+/* Reads the contents of the pipe into buf, for replies that cannot splice */
+extern ssize_t unpfs_splice_copy(char *data, char *buf);
+
+/* Gives a pipe back if data is its token, 0 if it is not */
+extern int unpfs_splice_release(char *data);
+
+#endif  /* UNPFS_SPLICE_H */
@@ -0,0 +1,24 @@
+#ifndef UNPFS_STATPOOL_H
+#define UNPFS_STATPOOL_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Threads sharing the stat(2) calls of a directory listing.  Only the
+ * fields a 9P stat needs are guaranteed to be filled in.
+ */
+struct unpfs_stat_req {
+    const char *name;   /* Relative to the batch's directory */
+    struct stat st;
+    int err;            /* errno of a failed stat, 0 otherwise */
+};
+
+extern int unpfs_statpool_start(unsigned int nthreads);
+extern void unpfs_statpool_stop(void);
+
+/* lstat each name relative to dirfd; returns once all are done */
+extern void unpfs_statpool_run(int dirfd, struct unpfs_stat_req *reqs, size_t n);
+
+#endif  /* UNPFS_STATPOOL_H */
@@ -0,0 +1,48 @@
+#ifndef UNPFS_STATS_H
+#define UNPFS_STATS_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/*
+ * Request metrics of both dialects, kept by 9P message type: counts,
+ * errors, payload bytes and how long handlers took to reply, in
+ * power-of-two microsecond buckets.  The report can be read from the
+ * synthetic file UNPFS_STATS_PATH in the export.
+ */
+#define UNPFS_STATS_DIR     "/.unpfs"
+#define UNPFS_STATS_PATH    "/.unpfs/stats"
+
+struct unpfs_fid;
+
+/* Monotonic nanoseconds, the start to pass to unpfs_stats_record() */
+extern uint64_t unpfs_stats_now(void);
+extern void unpfs_stats_record(uint8_t type, int err, uint64_t start);
+extern void unpfs_stats_bytes(uint8_t type, size_t bytes);
+
+/*
+ * Sharded servers keep their counters in n slots of shared memory, set
+ * up before forking, and each shard records into its own slot.  Reports
+ * then sum the request metrics of all of them; the cache lines that
+ * follow are still those of the reporting shard, and the supervisor's
+ * report, which has none, leaves them out.
+ */
+extern int unpfs_stats_share(unsigned int n);
+extern void unpfs_stats_use_slot(unsigned int slot);
+
+/* "read", "getattr" and so on, NULL for unknown message types */
+extern const char *unpfs_stats_op_name(uint8_t type);
+
+/* The report as text, NULL if out of memory; free(3) it */
+extern char *unpfs_stats_report(size_t *length);
+extern void unpfs_stats_log(void);
+
+/*
+ * 0 and its attributes if path names a synthetic file, ENOENT if it
+ * would be one but does not exist, -1 for any other path
+ */
+extern int unpfs_stats_lookup(const char *path, struct stat *stbuf);
+extern struct unpfs_fid *unpfs_stats_fid(const char *path);
+
+#endif  /* UNPFS_STATS_H */
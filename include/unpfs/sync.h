@@ -0,0 +1,16 @@
+#ifndef UNPFS_SYNC_H
+#define UNPFS_SYNC_H
+
+#include <unpfs/common.h>
+
+struct unpfs_fid;
+
+/*
+ * Commits the fid's file to stable storage.  A sync that finds another
+ * one running on the same filesystem waits for it, and all syncs that
+ * queued up meanwhile share a single syncfs(2), whose result each of
+ * them gets.  -1 with errno on failure.
+ */
+extern int unpfs_sync_fid(struct unpfs_fid *fid, int datasync);
+
+#endif  /* UNPFS_SYNC_H */
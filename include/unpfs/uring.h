@@ -0,0 +1,24 @@
+#ifndef UNPFS_URING_H
+#define UNPFS_URING_H
+
+#include <unpfs/common.h>
+#include <sys/types.h>
+#include <ixp.h>
+
+/* Completion callback: res is the byte count or -errno */
+typedef void (*unpfs_io_done)(void *arg, ssize_t res);
+
+/*
+ * io_uring(7) ring serving file reads and writes.  Completions are reaped
+ * on the server loop through an eventfd registered on server.
+ */
+extern int unpfs_uring_init(IxpServer *server, unsigned int entries);
+extern int unpfs_uring_read(int fd, void *buf, size_t count, uint64_t offset,
+                            unpfs_io_done done, void *arg);
+extern int unpfs_uring_write(int fd, const void *buf, size_t count, uint64_t offset,
+                             unpfs_io_done done, void *arg);
+
+/* Asks for the I/O started with arg to end early, with -ECANCELED if it can */
+extern void unpfs_uring_cancel(void *arg);
+
+#endif  /* UNPFS_URING_H */
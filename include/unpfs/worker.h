@@ -0,0 +1,28 @@
+#ifndef UNPFS_WORKER_H
+#define UNPFS_WORKER_H
+
+#include <unpfs/common.h>
+#include <ixp.h>
+
+/*
+ * Worker pool: requests decoded by the server loop are executed by
+ * nthreads worker threads and answered back on the server loop.
+ * unpfs_worker_start() reroutes the handlers of srv through the pool.
+ */
+extern int unpfs_worker_start(IxpServer *server, Ixp9Srv *srv, unsigned int nthreads);
+extern void unpfs_worker_stop(void);
+
+/*
+ * Work for the pool that is not a 9P2000 request: run(arg) is called by
+ * a worker, then done(arg), if not NULL, by the server loop.  Returns a
+ * handle for unpfs_worker_cancel(), NULL if there is no pool to run it.
+ */
+extern void *unpfs_worker_submit(void (*run)(void *), void (*done)(void *), void *arg);
+
+/* 0 if the work was dropped before a worker took it, 1 if it will be done */
+extern int unpfs_worker_cancel(void *work);
+
+/* Called by a worker in place of ixp_respond() */
+extern void unpfs_worker_done(Ixp9Req *r, int err);
+
+#endif  /* UNPFS_WORKER_H */
@@ -0,0 +1,135 @@
+#include <unpfs/arena.h>
+#include <pthread.h>
+
+enum {
+    ARENA_SIZE = 16 * 1024,
+    ARENA_ALIGN = sizeof (union { void *p; uint64_t u; long double d; })
+};
+
+/* Allocations that did not fit, chained until the next reset */
+struct overflow {
+    struct overflow *next;
+};
+
+struct arena {
+    size_t used;
+    struct overflow *overflows;
+    union {
+        char data[ARENA_SIZE];
+        long double align;
+    } mem;
+};
+
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static struct {
+    unsigned long allocs;
+    unsigned long bytes;
+    unsigned long overflows;
+    unsigned long arenas;
+} counters;
+
+static void
+arena_destroy(void *p)
+{
+    struct arena *a = p;
+    struct overflow *o, *next;
+
+    for (o = a->overflows; o; o = next) {
+        next = o->next;
+        free(o);
+    }
+    free(a);
+    __atomic_fetch_sub(&counters.arenas, 1, __ATOMIC_RELAXED);
+}
+
+static void
+arena_init(void)
+{
+    pthread_key_create(&arena_key, arena_destroy);
+}
+
+static struct arena *
+arena_get(void)
+{
+    struct arena *a;
+
+    pthread_once(&arena_once, arena_init);
+
+    a = pthread_getspecific(arena_key);
+    if (!a && (a = malloc(sizeof *a))) {
+        a->used = 0;
+        a->overflows = NULL;
+        if (pthread_setspecific(arena_key, a)) {
+            free(a);
+            return NULL;
+        }
+        __atomic_fetch_add(&counters.arenas, 1, __ATOMIC_RELAXED);
+    }
+
+    return a;
+}
+
+void *
+unpfs_arena_alloc(size_t size)
+{
+    struct arena *a = arena_get();
+    struct overflow *o;
+    void *p;
+
+    if (!a) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    __atomic_fetch_add(&counters.allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&counters.bytes, size, __ATOMIC_RELAXED);
+
+    if (size <= ARENA_SIZE - a->used) {
+        p = a->mem.data + a->used;
+        a->used += size;
+        return p;
+    }
+
+    o = malloc(ARENA_ALIGN + size);
+    if (!o) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    o->next = a->overflows;
+    a->overflows = o;
+    __atomic_fetch_add(&counters.overflows, 1, __ATOMIC_RELAXED);
+
+    return (char *)o + ARENA_ALIGN;
+}
+
+void
+unpfs_arena_reset(void)
+{
+    struct arena *a;
+    struct overflow *o, *next;
+
+    pthread_once(&arena_once, arena_init);
+
+    a = pthread_getspecific(arena_key);
+    if (!a)
+        return;
+
+    for (o = a->overflows; o; o = next) {
+        next = o->next;
+        free(o);
+    }
+    a->overflows = NULL;
+    a->used = 0;
+}
+
+void
+unpfs_arena_stats(struct unpfs_arena_stats *stats)
+{
+    stats->allocs = __atomic_load_n(&counters.allocs, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&counters.bytes, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&counters.overflows, __ATOMIC_RELAXED);
+    stats->arenas = __atomic_load_n(&counters.arenas, __ATOMIC_RELAXED);
+}
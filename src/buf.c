@@ -0,0 +1,171 @@
+#include <unpfs/buf.h>
+#include <unpfs/fmap.h>
+#include <unpfs/splice.h>
+#include <pthread.h>
+
+enum {
+    BUF_MIN_SHIFT = 12,     /* 4 KiB */
+    BUF_MAX_SHIFT = 24,     /* 16 MiB */
+    BUF_NCLASSES = BUF_MAX_SHIFT - BUF_MIN_SHIFT + 1,
+    BUF_CACHED_PER_CLASS = 32,
+    BUF_BUCKETS = 1024
+};
+
+/*
+ * Buffers are plain malloc(3) blocks, so that one can be handed over to
+ * libixp, which free(3)s the payloads it sends.  Each is known by its
+ * address instead; cls is -1 for sizes beyond the largest class.
+ */
+struct pbuf {
+    char *data;
+    int cls;
+    struct pbuf *next;          /* In its bucket while out, cached otherwise */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct pbuf *out[BUF_BUCKETS];
+    struct pbuf *cached[BUF_NCLASSES];
+    unsigned int ncached[BUF_NCLASSES];
+    struct unpfs_buf_stats stats;
+} pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { NULL }, { 0 }, { 0, 0, 0, 0 } };
+
+static int
+buf_class(size_t size)
+{
+    int cls = 0;
+
+    while (((size_t)1 << (cls + BUF_MIN_SHIFT)) < size) {
+        if (++cls == BUF_NCLASSES)
+            return -1;
+    }
+
+    return cls;
+}
+
+static struct pbuf **
+bucket(const char *data)
+{
+    uintptr_t p = (uintptr_t)data;
+
+    return &pool.out[((p >> 4) ^ (p >> 16)) % BUF_BUCKETS];
+}
+
+/* pool.lock held */
+static void
+hash(struct pbuf *b)
+{
+    struct pbuf **p = bucket(b->data);
+
+    b->next = *p;
+    *p = b;
+}
+
+/* pool.lock held; takes the buffer at data out of the table, NULL if none is */
+static struct pbuf *
+unhash(const char *data)
+{
+    struct pbuf **p = bucket(data), *b;
+
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->data == data) {
+            b = *p;
+            *p = b->next;
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+char *
+unpfs_buf_alloc(size_t size)
+{
+    int cls = buf_class(size);
+    struct pbuf *b = NULL;
+
+    if (cls >= 0) {
+        size = (size_t)1 << (cls + BUF_MIN_SHIFT);
+
+        pthread_mutex_lock(&pool.lock);
+        b = pool.cached[cls];
+        if (b) {
+            pool.cached[cls] = b->next;
+            --pool.ncached[cls];
+            ++pool.stats.hits;
+            --pool.stats.cached;
+            pool.stats.cached_bytes -= size;
+            hash(b);
+        } else {
+            ++pool.stats.misses;
+        }
+        pthread_mutex_unlock(&pool.lock);
+
+        if (b)
+            return b->data;
+    }
+
+    b = malloc(sizeof *b);
+    if (!b)
+        return NULL;
+    b->data = malloc(size);
+    if (!b->data) {
+        free(b);
+        return NULL;
+    }
+    b->cls = cls;
+
+    pthread_mutex_lock(&pool.lock);
+    hash(b);
+    pthread_mutex_unlock(&pool.lock);
+
+    return b->data;
+}
+
+void
+unpfs_buf_free(char *buf)
+{
+    struct pbuf *b;
+
+    if (!buf || unpfs_fmap_release(buf) || unpfs_splice_release(buf))
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    b = unhash(buf);
+    if (b && b->cls >= 0 && pool.ncached[b->cls] < BUF_CACHED_PER_CLASS) {
+        b->next = pool.cached[b->cls];
+        pool.cached[b->cls] = b;
+        ++pool.ncached[b->cls];
+        ++pool.stats.cached;
+        pool.stats.cached_bytes += (size_t)1 << (b->cls + BUF_MIN_SHIFT);
+        b = NULL;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (b) {
+        free(b->data);
+        free(b);
+    }
+}
+
+int
+unpfs_buf_detach(char *buf)
+{
+    struct pbuf *b;
+
+    pthread_mutex_lock(&pool.lock);
+    b = unhash(buf);
+    pthread_mutex_unlock(&pool.lock);
+
+    free(b);
+
+    return b != NULL;
+}
+
+void
+unpfs_buf_stats(struct unpfs_buf_stats *stats)
+{
+    pthread_mutex_lock(&pool.lock);
+    *stats = pool.stats;
+    pthread_mutex_unlock(&pool.lock);
+}
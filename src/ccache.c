@@ -0,0 +1,390 @@
+#define _GNU_SOURCE     /* For AT_EMPTY_PATH */
+#include <unpfs/ccache.h>
+#include <unpfs/buf.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+enum {
+    CCACHE_BUCKETS = 1024
+};
+
+/* refs counts the handles reading the contents, plus one while cached */
+struct unpfs_ccache {
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char *data;
+    unsigned int refs;
+    int stale;                  /* Out of the table, not to be read any more */
+    struct unpfs_ccache *hnext;
+    struct unpfs_ccache *prev, *next; /* Most recently used first */
+};
+
+/* Files with descriptors open for writing, which are not cached */
+struct writer {
+    dev_t dev;
+    ino_t ino;
+    unsigned int count;
+    struct writer *hnext;
+};
+
+/*
+ * generation moves on with every write or invalidation, so that contents
+ * read while it did are not cached.
+ */
+static struct {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t max_size;
+    unsigned long generation;
+    struct unpfs_ccache *buckets[CCACHE_BUCKETS];
+    struct writer *writers[CCACHE_BUCKETS];
+    struct unpfs_ccache *head, *tail;
+    struct unpfs_ccache_stats stats;
+} cc = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, { NULL }, { NULL }, NULL, NULL,
+         { 0, 0, 0, 0, 0 } };
+
+static unsigned long
+hash_key(dev_t dev, ino_t ino)
+{
+    unsigned long h = (unsigned long)ino * 2654435761UL;
+
+    return (h ^ (unsigned long)dev * 40503UL) % CCACHE_BUCKETS;
+}
+
+/* cc.lock held */
+static struct unpfs_ccache *
+lookup(dev_t dev, ino_t ino)
+{
+    struct unpfs_ccache *c = cc.buckets[hash_key(dev, ino)];
+
+    for (; c; c = c->hnext) {
+        if (c->ino == ino && c->dev == dev)
+            break;
+    }
+
+    return c;
+}
+
+/* cc.lock held; where the writer of the file is, or would be linked in */
+static struct writer **
+writer_lookup(dev_t dev, ino_t ino)
+{
+    struct writer **p = &cc.writers[hash_key(dev, ino)];
+
+    for (; *p; p = &(*p)->hnext) {
+        if ((*p)->ino == ino && (*p)->dev == dev)
+            break;
+    }
+
+    return p;
+}
+
+static int
+is_fresh(const struct unpfs_ccache *c, const struct stat *stbuf)
+{
+    return c->size == (size_t)stbuf->st_size
+        && c->mtime.tv_sec == stbuf->st_mtim.tv_sec
+        && c->mtime.tv_nsec == stbuf->st_mtim.tv_nsec
+        && c->ctime.tv_sec == stbuf->st_ctim.tv_sec
+        && c->ctime.tv_nsec == stbuf->st_ctim.tv_nsec;
+}
+
+static void
+destroy(struct unpfs_ccache *c)
+{
+    free(c->data);
+    free(c);
+}
+
+static void
+lru_unlink(struct unpfs_ccache *c)
+{
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        cc.head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        cc.tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+static void
+lru_push(struct unpfs_ccache *c)
+{
+    c->prev = NULL;
+    c->next = cc.head;
+    if (cc.head)
+        cc.head->prev = c;
+    else
+        cc.tail = c;
+    cc.head = c;
+}
+
+/* cc.lock held; takes c out of the table, freed by its last release */
+static void
+retire(struct unpfs_ccache *c)
+{
+    struct unpfs_ccache **p = &cc.buckets[hash_key(c->dev, c->ino)];
+
+    while (*p != c)
+        p = &(*p)->hnext;
+    *p = c->hnext;
+    lru_unlink(c);
+
+    __atomic_store_n(&c->stale, 1, __ATOMIC_RELEASE);
+    --cc.stats.entries;
+    cc.stats.bytes -= c->size;
+    if (!--c->refs)
+        destroy(c);
+}
+
+/* cc.lock held; caches c with a reference for the caller */
+static void
+insert(struct unpfs_ccache *c)
+{
+    unsigned long h = hash_key(c->dev, c->ino);
+
+    c->refs = 2;
+    c->stale = 0;
+    c->hnext = cc.buckets[h];
+    cc.buckets[h] = c;
+    lru_push(c);
+    ++cc.stats.entries;
+    cc.stats.bytes += c->size;
+
+    while (cc.stats.bytes > cc.budget && cc.tail != c) {
+        retire(cc.tail);
+        ++cc.stats.evictions;
+    }
+}
+
+/* The whole file as stbuf describes it, NULL if it is not that any more */
+static struct unpfs_ccache *
+load(int fd, const struct stat *stbuf)
+{
+    struct unpfs_ccache *c = malloc(sizeof *c);
+    size_t done = 0;
+    ssize_t n;
+
+    if (!c)
+        return NULL;
+    c->data = malloc(stbuf->st_size ? stbuf->st_size : 1);
+    if (!c->data) {
+        free(c);
+        return NULL;
+    }
+
+    while (done < (size_t)stbuf->st_size) {
+        n = pread(fd, c->data + done, stbuf->st_size - done, done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done != (size_t)stbuf->st_size) {
+        destroy(c);
+        return NULL;
+    }
+
+    c->dev = stbuf->st_dev;
+    c->ino = stbuf->st_ino;
+    c->size = done;
+    c->mtime = stbuf->st_mtim;
+    c->ctime = stbuf->st_ctim;
+    c->prev = c->next = NULL;
+
+    return c;
+}
+
+void
+unpfs_ccache_init(size_t budget, size_t max_size)
+{
+    cc.budget = budget;
+    cc.max_size = max_size;
+}
+
+int
+unpfs_ccache_enabled(void)
+{
+    return cc.budget != 0;
+}
+
+struct unpfs_ccache *
+unpfs_ccache_get(int fd, const struct stat *stbuf)
+{
+    struct unpfs_ccache *c, *loaded;
+    unsigned long generation;
+
+    if (!cc.budget || !S_ISREG(stbuf->st_mode) ||
+            (size_t)stbuf->st_size > cc.max_size ||
+            (size_t)stbuf->st_size > cc.budget)
+        return NULL;
+
+    pthread_mutex_lock(&cc.lock);
+    if (*writer_lookup(stbuf->st_dev, stbuf->st_ino)) {
+        pthread_mutex_unlock(&cc.lock);
+        return NULL;
+    }
+
+    c = lookup(stbuf->st_dev, stbuf->st_ino);
+    if (c && is_fresh(c, stbuf)) {
+        ++c->refs;
+        lru_unlink(c);
+        lru_push(c);
+        ++cc.stats.hits;
+        pthread_mutex_unlock(&cc.lock);
+        return c;
+    }
+
+    if (c)
+        retire(c);
+    ++cc.stats.misses;
+    generation = cc.generation;
+    pthread_mutex_unlock(&cc.lock);
+
+    loaded = load(fd, stbuf);
+    if (!loaded)
+        return NULL;
+
+    pthread_mutex_lock(&cc.lock);
+    c = lookup(stbuf->st_dev, stbuf->st_ino);
+    if (cc.generation != generation) {
+        /* Written meanwhile: what was read may be neither old nor new */
+        c = NULL;
+    } else if (c && is_fresh(c, stbuf)) {
+        /* Another handle loaded it meanwhile */
+        ++c->refs;
+    } else {
+        if (c)
+            retire(c);
+        insert(loaded);
+        c = loaded;
+        loaded = NULL;
+    }
+    pthread_mutex_unlock(&cc.lock);
+
+    if (loaded)
+        destroy(loaded);
+
+    return c;
+}
+
+void
+unpfs_ccache_put(struct unpfs_ccache *c)
+{
+    pthread_mutex_lock(&cc.lock);
+    if (--c->refs)
+        c = NULL;
+    pthread_mutex_unlock(&cc.lock);
+
+    if (c)
+        destroy(c);
+}
+
+ssize_t
+unpfs_ccache_read(struct unpfs_ccache *c, char **buf, size_t count, uint64_t offset)
+{
+    if (__atomic_load_n(&c->stale, __ATOMIC_ACQUIRE)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    *buf = unpfs_buf_alloc(count);
+    if (!*buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (offset >= c->size)
+        return 0;
+    if (count > c->size - offset)
+        count = c->size - offset;
+    memcpy(*buf, c->data + offset, count);
+
+    return count;
+}
+
+void
+unpfs_ccache_write_begin(const struct stat *stbuf)
+{
+    struct writer **w, *writer;
+    struct unpfs_ccache *c;
+
+    if (!cc.budget || !S_ISREG(stbuf->st_mode))
+        return;
+
+    pthread_mutex_lock(&cc.lock);
+    ++cc.generation;
+    w = writer_lookup(stbuf->st_dev, stbuf->st_ino);
+    if (*w) {
+        ++(*w)->count;
+    } else if ((writer = malloc(sizeof *writer))) {
+        writer->dev = stbuf->st_dev;
+        writer->ino = stbuf->st_ino;
+        writer->count = 1;
+        writer->hnext = NULL;
+        *w = writer;
+    } else {
+        unpfs_log(LOG_WARNING, "%s: out of memory\n", __func__);
+    }
+
+    c = lookup(stbuf->st_dev, stbuf->st_ino);
+    if (c)
+        retire(c);
+    pthread_mutex_unlock(&cc.lock);
+}
+
+void
+unpfs_ccache_write_end(const struct stat *stbuf)
+{
+    struct writer **w, *writer = NULL;
+
+    if (!cc.budget || !S_ISREG(stbuf->st_mode))
+        return;
+
+    pthread_mutex_lock(&cc.lock);
+    w = writer_lookup(stbuf->st_dev, stbuf->st_ino);
+    if (*w && !--(*w)->count) {
+        writer = *w;
+        *w = writer->hnext;
+    }
+    pthread_mutex_unlock(&cc.lock);
+
+    free(writer);
+}
+
+void
+unpfs_ccache_invalidate(int dirfd, const char *name)
+{
+    struct unpfs_ccache *c;
+    struct stat stbuf;
+
+    if (!cc.budget ||
+            fstatat(dirfd, name, &stbuf,
+                AT_SYMLINK_NOFOLLOW | (*name ? 0 : AT_EMPTY_PATH)) < 0 ||
+            !S_ISREG(stbuf.st_mode))
+        return;
+
+    pthread_mutex_lock(&cc.lock);
+    ++cc.generation;
+    c = lookup(stbuf.st_dev, stbuf.st_ino);
+    if (c)
+        retire(c);
+    pthread_mutex_unlock(&cc.lock);
+}
+
+void
+unpfs_ccache_stats(struct unpfs_ccache_stats *stats)
+{
+    pthread_mutex_lock(&cc.lock);
+    *stats = cc.stats;
+    pthread_mutex_unlock(&cc.lock);
+}
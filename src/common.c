@@ -5,7 +5,7 @@
 void *
 zalloc(size_t size)
 {
-    void *m = malloc(PATH_MAX);
+    void *m = calloc(1, size);
     if (!m) {
         perror("Fatal error: malloc");
         exit(EXIT_FAILURE);
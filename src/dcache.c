@@ -0,0 +1,539 @@
+#include <unpfs/dcache.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+enum {
+    DCACHE_BUCKETS = 16384,
+    DCACHE_WATCH_BUCKETS = 1024,
+    DCACHE_MAX_WATCHES = 8192,
+    DCACHE_EVENT_BUFFER_SIZE = 16 * 1024,
+    /* err of an entry only there to hold the entries below it */
+    DENTRY_PLACEHOLDER = -1
+};
+
+#define DCACHE_WATCH_MASK \
+    (IN_ATTRIB | IN_MODIFY | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+     IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/*
+ * Every entry below the root hangs off the entry of its parent directory,
+ * so that a subtree is found without scanning the cache, and a parent is
+ * never less recently used than its children, so that the least recently
+ * used entry has none.
+ */
+struct dentry {
+    char *path;
+    unsigned long hash;
+    IxpQid qid;
+    int err;                    /* ENOENT for a negative entry */
+    int wd;                     /* Watch on this directory, -1 if unknown */
+    struct dentry *hnext;
+    struct dentry *prev, *next; /* Most recently used first */
+    struct dentry *parent;      /* NULL in the root */
+    struct dentry *children;
+    struct dentry *sibling, **psibling;
+};
+
+/* Watched directory; path goes stale if it is moved, until watched again */
+struct dwatch {
+    int wd;
+    char *path;
+    struct dwatch *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int fd;                     /* inotify instance, -1 if disabled */
+    int root_wd;
+    const char *root;
+    unsigned long max_entries;
+    struct dentry *buckets[DCACHE_BUCKETS];
+    struct dentry *head, *tail;
+    struct dwatch *watches[DCACHE_WATCH_BUCKETS];
+    unsigned int nwatches;
+    struct unpfs_dcache_stats stats;
+} dc;
+
+static unsigned long
+hash_path(const char *path)
+{
+    unsigned long h = 2166136261UL;
+
+    for (; *path; ++path)
+        h = (h ^ (unsigned char)*path) * 16777619UL;
+
+    return h;
+}
+
+static struct dentry *
+dentry_find(const char *path, unsigned long hash)
+{
+    struct dentry *e = dc.buckets[hash % DCACHE_BUCKETS];
+
+    for (; e; e = e->hnext) {
+        if (e->hash == hash && !strcmp(e->path, path))
+            return e;
+    }
+
+    return NULL;
+}
+
+static void
+lru_unlink(struct dentry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        dc.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        dc.tail = e->prev;
+}
+
+static void
+lru_push(struct dentry *e)
+{
+    e->prev = NULL;
+    e->next = dc.head;
+    if (dc.head)
+        dc.head->prev = e;
+    else
+        dc.tail = e;
+    dc.head = e;
+}
+
+/* Marks e and its parents as just used */
+static void
+dentry_touch(struct dentry *e)
+{
+    for (; e; e = e->parent) {
+        lru_unlink(e);
+        lru_push(e);
+    }
+}
+
+/* Frees e and everything below it */
+static void
+dentry_free(struct dentry *e)
+{
+    struct dentry **p = &dc.buckets[e->hash % DCACHE_BUCKETS];
+
+    while (e->children)
+        dentry_free(e->children);
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+
+    if (e->psibling) {
+        *e->psibling = e->sibling;
+        if (e->sibling)
+            e->sibling->psibling = e->psibling;
+    }
+
+    lru_unlink(e);
+    --dc.stats.entries;
+    free(e->path);
+    free(e);
+}
+
+/*
+ * The entry for path, which a placeholder stands for along with its
+ * parents if they are not cached; NULL if out of memory.  path is
+ * modified meanwhile.
+ */
+static struct dentry *
+dentry_get(char *path)
+{
+    unsigned long hash = hash_path(path);
+    struct dentry *parent = NULL, *e = dentry_find(path, hash);
+    char *slash = strrchr(path, '/');
+
+    if (e)
+        return e;
+
+    if (slash != path) {
+        *slash = '\0';
+        parent = dentry_get(path);
+        *slash = '/';
+        if (!parent)
+            return NULL;
+    }
+
+    e = malloc(sizeof *e);
+    if (!e)
+        return NULL;
+    e->path = strdup(path);
+    if (!e->path) {
+        free(e);
+        return NULL;
+    }
+
+    e->hash = hash;
+    e->err = DENTRY_PLACEHOLDER;
+    e->wd = -1;
+    e->hnext = dc.buckets[hash % DCACHE_BUCKETS];
+    dc.buckets[hash % DCACHE_BUCKETS] = e;
+    lru_push(e);
+    ++dc.stats.entries;
+
+    e->parent = parent;
+    e->children = NULL;
+    e->sibling = NULL;
+    e->psibling = NULL;
+    if (parent) {
+        e->sibling = parent->children;
+        if (e->sibling)
+            e->sibling->psibling = &e->sibling;
+        e->psibling = &parent->children;
+        parent->children = e;
+    }
+
+    return e;
+}
+
+static struct dwatch *
+watch_find(int wd)
+{
+    struct dwatch *w = dc.watches[wd % DCACHE_WATCH_BUCKETS];
+
+    while (w && w->wd != wd)
+        w = w->next;
+
+    return w;
+}
+
+static void
+watch_remove(int wd)
+{
+    struct dwatch *w, **p = &dc.watches[wd % DCACHE_WATCH_BUCKETS];
+
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->wd == wd) {
+            w = *p;
+            *p = w->next;
+            --dc.nwatches;
+            free(w->path);
+            free(w);
+            return;
+        }
+    }
+}
+
+/*
+ * Watch the directory at 9P path.  Returns 1 if it already was watched
+ * under that path, 0 if the watch is new, so that nothing looked up
+ * before it existed is trusted, and -1 if it cannot be watched.
+ */
+static int
+watch_add(const char *path, int *wdp)
+{
+    char real_path[PATH_MAX];
+    struct dwatch *w;
+    char *copy;
+    int wd, n;
+
+    n = snprintf(real_path, sizeof real_path, "%s%s",
+        (!strcmp(dc.root, "/") ? "" : dc.root), path);
+    if (n < 0 || (size_t)n >= sizeof real_path)
+        return -1;
+
+    wd = inotify_add_watch(dc.fd, real_path, DCACHE_WATCH_MASK);
+    if (wd < 0)
+        return -1;
+    *wdp = wd;
+
+    w = watch_find(wd);
+    if (w && !strcmp(w->path, path))
+        return 1;
+
+    copy = strdup(path);
+    if (!copy)
+        return -1;
+
+    if (w) {
+        /* The directory was moved since it was first watched */
+        free(w->path);
+        w->path = copy;
+        return 0;
+    }
+
+    if (dc.nwatches >= DCACHE_MAX_WATCHES || !(w = malloc(sizeof *w))) {
+        inotify_rm_watch(dc.fd, wd);
+        free(copy);
+        return -1;
+    }
+
+    w->wd = wd;
+    w->path = copy;
+    w->next = dc.watches[wd % DCACHE_WATCH_BUCKETS];
+    dc.watches[wd % DCACHE_WATCH_BUCKETS] = w;
+    ++dc.nwatches;
+
+    return 0;
+}
+
+static void
+invalidate(const char *path, int subtree)
+{
+    struct dentry *e;
+
+    if (!strcmp(path, "/")) {
+        if (subtree) {
+            while (dc.head)
+                dentry_free(dc.head);
+        }
+        return;
+    }
+
+    e = dentry_find(path, hash_path(path));
+    if (!e)
+        return;
+
+    /* Whatever is below a directory still is when only it changed */
+    if (!subtree && e->children)
+        e->err = DENTRY_PLACEHOLDER;
+    else
+        dentry_free(e);
+}
+
+/* Drop every entry and watch and start over with a fresh instance */
+static void
+reset(void)
+{
+    unsigned int i;
+
+    while (dc.head)
+        dentry_free(dc.head);
+
+    for (i = 0; i < DCACHE_WATCH_BUCKETS; ++i) {
+        while (dc.watches[i])
+            watch_remove(dc.watches[i]->wd);
+    }
+
+    if (dc.fd >= 0)
+        close(dc.fd);
+
+    dc.root_wd = -1;
+    dc.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dc.fd < 0 || watch_add("/", &dc.root_wd) < 0) {
+        unpfs_log(LOG_WARNING, "%s: dentry cache disabled: %s\n",
+            __func__, strerror(errno));
+        if (dc.fd >= 0)
+            close(dc.fd);
+        dc.fd = -1;
+    }
+}
+
+static void
+handle_event(const struct inotify_event *ev)
+{
+    char path[PATH_MAX];
+    struct dwatch *w = watch_find(ev->wd);
+    int n;
+
+    if (!w)
+        return;
+
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        invalidate(w->path, 1);
+        if (ev->mask & IN_IGNORED) {
+            if (ev->wd == dc.root_wd)
+                dc.root_wd = -1;
+            watch_remove(ev->wd);
+        }
+        return;
+    }
+
+    if (!ev->len) {
+        invalidate(w->path, 0);
+        return;
+    }
+
+    n = snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(w->path, "/") ? "" : w->path), ev->name);
+    if (n < 0 || (size_t)n >= sizeof path)
+        return;
+
+    /* Only a directory that existed before can have entries below it */
+    invalidate(path, (ev->mask & IN_ISDIR)
+        && !(ev->mask & (IN_CREATE | IN_ATTRIB | IN_MODIFY)));
+
+    /* Its qid version goes with its mtime, which names change */
+    if (!(ev->mask & (IN_ATTRIB | IN_MODIFY)))
+        invalidate(w->path, 0);
+}
+
+int
+unpfs_dcache_init(const char *root, unsigned long max_entries)
+{
+    if (!max_entries)
+        return 0;
+
+    pthread_mutex_init(&dc.lock, NULL);
+    dc.root = root;
+    dc.fd = -1;
+    reset();
+    if (dc.fd < 0)
+        return -1;
+
+    dc.max_entries = max_entries;
+
+    return 0;
+}
+
+void
+unpfs_dcache_sync(void)
+{
+    union {
+        struct inotify_event ev;
+        char buf[DCACHE_EVENT_BUFFER_SIZE];
+    } u;
+    const struct inotify_event *ev;
+    ssize_t n, i;
+    int overflow = 0;
+
+    if (!dc.max_entries)
+        return;
+
+    pthread_mutex_lock(&dc.lock);
+
+    while (dc.fd >= 0 && (n = read(dc.fd, u.buf, sizeof u.buf)) > 0) {
+        for (i = 0; i < n; i += sizeof *ev + ev->len) {
+            ev = (const struct inotify_event *)(u.buf + i);
+            if (ev->mask & IN_Q_OVERFLOW)
+                overflow = 1;
+            else
+                handle_event(ev);
+        }
+    }
+
+    if (dc.fd >= 0 && (overflow || dc.nwatches >= DCACHE_MAX_WATCHES)) {
+        unpfs_log(LOG_INFO, "%s: dropping the dentry cache (%s)\n",
+            __func__, overflow ? "event queue overflow" : "too many watches");
+        reset();
+    }
+
+    pthread_mutex_unlock(&dc.lock);
+}
+
+int
+unpfs_dcache_lookup(const char *path, IxpQid *qid)
+{
+    struct dentry *e;
+    int ret = -1;
+
+    if (!dc.max_entries)
+        return -1;
+
+    pthread_mutex_lock(&dc.lock);
+
+    e = dentry_find(path, hash_path(path));
+    if (e && e->err == DENTRY_PLACEHOLDER) {
+        ++dc.stats.misses;
+    } else if (e) {
+        dentry_touch(e);
+        if (e->err) {
+            ++dc.stats.negative_hits;
+        } else {
+            ++dc.stats.hits;
+            *qid = e->qid;
+        }
+        ret = e->err;
+    } else {
+        ++dc.stats.misses;
+    }
+
+    pthread_mutex_unlock(&dc.lock);
+
+    return ret;
+}
+
+void
+unpfs_dcache_insert(const char *path, const IxpQid *qid, int err)
+{
+    char parent[PATH_MAX];
+    struct dentry *e;
+    const char *slash = strrchr(path, '/');
+    size_t length;
+    int wd = -1, watched;
+
+    if (!dc.max_entries || (err && err != ENOENT) || !slash
+            || strlen(path) >= sizeof parent)
+        return;
+
+    length = slash - path;
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+
+    pthread_mutex_lock(&dc.lock);
+
+    if (dc.fd < 0)
+        goto out;
+
+    /* Nothing below a directory is cached unless it is being watched */
+    if (!length) {
+        if (dc.root_wd < 0)
+            goto out;
+    } else {
+        e = dentry_find(parent, hash_path(parent));
+        if (!e || e->wd < 0) {
+            watched = watch_add(parent, &wd);
+            if (e && e->err <= 0 && watched >= 0)
+                e->wd = wd;
+            if (watched <= 0)
+                goto out;
+        }
+    }
+
+    /* The buffer is only reused for the copy of path */
+    memcpy(parent, path, strlen(path) + 1);
+    e = dentry_get(parent);
+    if (!e)
+        goto out;
+
+    dentry_touch(e);
+    if (err || e->err == ENOENT || (!e->err && e->qid.path != qid->path)) {
+        /* Not the directory that had whatever is below it */
+        while (e->children)
+            dentry_free(e->children);
+        e->wd = -1;
+    }
+    e->err = err;
+    if (!err)
+        e->qid = *qid;
+
+    while (dc.stats.entries > dc.max_entries)
+        dentry_free(dc.tail);
+
+out:
+    pthread_mutex_unlock(&dc.lock);
+}
+
+void
+unpfs_dcache_invalidate(const char *path)
+{
+    if (!dc.max_entries)
+        return;
+
+    pthread_mutex_lock(&dc.lock);
+    invalidate(path, 1);
+    pthread_mutex_unlock(&dc.lock);
+}
+
+void
+unpfs_dcache_stats(struct unpfs_dcache_stats *stats)
+{
+    if (!dc.max_entries) {
+        memset(stats, 0, sizeof *stats);
+        return;
+    }
+
+    pthread_mutex_lock(&dc.lock);
+    *stats = dc.stats;
+    pthread_mutex_unlock(&dc.lock);
+}
@@ -0,0 +1,1701 @@
+#define _GNU_SOURCE         /* For major(3) and friends */
+
+#include <unpfs/dotl.h>
+#include <unpfs/ops.h>
+#include <unpfs/fid.h>
+#include <unpfs/posix.h>
+#include <unpfs/buf.h>
+#include <unpfs/dcache.h>
+#include <unpfs/stats.h>
+#include <unpfs/log.h>
+#include <unpfs/sync.h>
+#include <unpfs/arena.h>
+#include <unpfs/fdcache.h>
+#include <unpfs/ccache.h>
+#include <unpfs/splice.h>
+#include <unpfs/worker.h>
+#include <unpfs/uring.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+/*
+ * A 9P2000.L connection is read on the server loop, one message at a
+ * time, into a request of its own.  Like 9P2000 ones, requests are
+ * executed by the worker pool if there is one, in arrival order except
+ * that one waits for earlier ones using the same fids to be answered
+ * first if either changes them, and answered from the server loop.
+ * Without a pool they are executed on the loop, where reads and writes
+ * of files may go through io_uring.  Replies are encoded into a small
+ * buffer, with Rread and Rreaddir data sent from a pool buffer or a
+ * zero-copy pipe after it.
+ */
+
+enum {
+    DOTL_HEADER_SIZE = 7,               /* size[4] type[1] tag[2] */
+    DOTL_IO_HEADER_SIZE = 11,           /* ... count[4] */
+    DOTL_FID_BUCKETS = 1024,
+    V9FS_MAGIC = 0x01021997,
+    /* Returned by requests that end later, through asynchronous I/O */
+    DOTL_PENDING = -1
+};
+
+enum {
+    DOTL_PARKED,
+    DOTL_STARTED
+};
+
+#define DOTL_NOFID  0xffffffffUL
+
+struct dotl_fid {
+    uint32_t fid;
+    struct unpfs_fid *f;
+    struct dotl_fid *next;
+};
+
+/* The connection stays around after it is hung up until no request runs */
+struct dotl_conn {
+    IxpConn *conn;                      /* NULL once hung up */
+    uint32_t msize;
+    pthread_mutex_t lock;               /* Of fids, which workers look up */
+    struct dotl_fid *fids[DOTL_FID_BUCKETS];
+    struct dotl_req *head, *tail;       /* Unanswered requests, oldest first */
+    int broken;                         /* A reply could not be sent */
+};
+
+struct dotl_req {
+    struct dotl_conn *dc;
+    uint8_t type;
+    uint16_t tag;
+    uint32_t fids[2];                   /* The fids it uses, DOTL_NOFID if fewer */
+    int exclusive[2];                   /* Whether it changes them */
+    int barrier;                        /* Waits for every other request */
+    int state;
+    int loop;                           /* Executed on the server loop */
+    void *work;                         /* Worker pool handle once started */
+    int err;
+    uint64_t start;
+    char *msg;                          /* The request from type[1] on */
+    IxpMsg in, out;
+    char *reply;
+    char *payload;                      /* Reply data from the buffer pool */
+    size_t payload_len;
+    struct dotl_req *flushes;           /* Tflushes waiting for it to end */
+    struct dotl_req *prev, *next;
+};
+
+typedef int (*dotl_op_fn)(struct dotl_req *, IxpMsg *, IxpMsg *);
+
+static void req_done(void *arg);
+
+/* Connections served here, by descriptor */
+static struct dotl_conn **conns;
+static int nconns;
+
+/* What ixp_serve9conn() gives every connection */
+static void (*ixp_conn_read)(IxpConn *);
+static void (*ixp_conn_close)(IxpConn *);
+
+/*
+ * Fid table.  Requests using the same fid are ordered, so a fid looked
+ * up stays bound until the request is answered; the lock only protects
+ * the table itself.
+ */
+static struct unpfs_fid *
+fid_lookup(struct dotl_conn *dc, uint32_t fid)
+{
+    struct dotl_fid *e = dc->fids[fid % DOTL_FID_BUCKETS];
+
+    while (e && e->fid != fid)
+        e = e->next;
+
+    return e ? e->f : NULL;
+}
+
+static struct unpfs_fid *
+fid_get(struct dotl_conn *dc, uint32_t fid)
+{
+    struct unpfs_fid *f;
+
+    pthread_mutex_lock(&dc->lock);
+    f = fid_lookup(dc, fid);
+    pthread_mutex_unlock(&dc->lock);
+
+    return f;
+}
+
+static int
+fid_put(struct dotl_conn *dc, uint32_t fid, struct unpfs_fid *f)
+{
+    struct dotl_fid *e;
+
+    if (fid == DOTL_NOFID)
+        return EBADF;
+
+    pthread_mutex_lock(&dc->lock);
+    if (fid_lookup(dc, fid)) {
+        pthread_mutex_unlock(&dc->lock);
+        return EBADF;
+    }
+
+    e = ixp_emalloc(sizeof *e);
+    e->fid = fid;
+    e->f = f;
+    e->next = dc->fids[fid % DOTL_FID_BUCKETS];
+    dc->fids[fid % DOTL_FID_BUCKETS] = e;
+    pthread_mutex_unlock(&dc->lock);
+
+    return 0;
+}
+
+static struct unpfs_fid *
+fid_take(struct dotl_conn *dc, uint32_t fid)
+{
+    struct dotl_fid *e = NULL, **p = &dc->fids[fid % DOTL_FID_BUCKETS];
+    struct unpfs_fid *f = NULL;
+
+    pthread_mutex_lock(&dc->lock);
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->fid == fid) {
+            e = *p;
+            *p = e->next;
+            f = e->f;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&dc->lock);
+
+    free(e);
+
+    return f;
+}
+
+/* Clunks f; -1 if closing it failed, which leaves it clunked anyway */
+static int
+fid_release(struct unpfs_fid *f)
+{
+    int ret = f->priv ? f->handler->close(f) : 0;
+
+    unpfs_fid_destroy(f);
+
+    return ret;
+}
+
+/* With no other request of dc running */
+static void
+fid_release_all(struct dotl_conn *dc)
+{
+    struct dotl_fid *e;
+    unsigned int i;
+
+    for (i = 0; i < DOTL_FID_BUCKETS; ++i) {
+        while ((e = dc->fids[i])) {
+            dc->fids[i] = e->next;
+            fid_release(e->f);
+            free(e);
+        }
+    }
+}
+
+/*
+ * Message encoding on top of libixp's, which leaves pos past end when a
+ * message is short
+ */
+
+/* Unpack a string in place, NUL-terminated over its own length field */
+static char *
+msg_string(IxpMsg *m)
+{
+    uint16_t length = 0;
+    char *s;
+
+    ixp_pu16(m, &length);
+    if (m->pos + length > m->end) {
+        m->pos = m->end + 1;
+        return NULL;
+    }
+
+    s = m->pos - 2;
+    memmove(s, m->pos, length);
+    s[length] = '\0';
+    m->pos += length;
+
+    return s;
+}
+
+/* A single name in a directory */
+static int
+is_bad_name(const char *name)
+{
+    return !name || !*name || strchr(name, '/')
+        || !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+static void
+msg_stat(IxpMsg *m, const struct stat *stbuf)
+{
+    IxpQid qid;
+    uint64_t valid = DOTL_GETATTR_BASIC, zero = 0;
+    uint64_t nlink = stbuf->st_nlink, rdev = stbuf->st_rdev;
+    uint64_t size = stbuf->st_size, blksize = stbuf->st_blksize;
+    uint64_t blocks = stbuf->st_blocks;
+    uint64_t atime = stbuf->st_atim.tv_sec, atime_ns = stbuf->st_atim.tv_nsec;
+    uint64_t mtime = stbuf->st_mtim.tv_sec, mtime_ns = stbuf->st_mtim.tv_nsec;
+    uint64_t ctime = stbuf->st_ctim.tv_sec, ctime_ns = stbuf->st_ctim.tv_nsec;
+    uint32_t mode = stbuf->st_mode, uid = stbuf->st_uid, gid = stbuf->st_gid;
+
+    qid_posix_to_9p(&qid, stbuf);
+
+    ixp_pu64(m, &valid);
+    ixp_pqid(m, &qid);
+    ixp_pu32(m, &mode);
+    ixp_pu32(m, &uid);
+    ixp_pu32(m, &gid);
+    ixp_pu64(m, &nlink);
+    ixp_pu64(m, &rdev);
+    ixp_pu64(m, &size);
+    ixp_pu64(m, &blksize);
+    ixp_pu64(m, &blocks);
+    ixp_pu64(m, &atime);
+    ixp_pu64(m, &atime_ns);
+    ixp_pu64(m, &mtime);
+    ixp_pu64(m, &mtime_ns);
+    ixp_pu64(m, &ctime);
+    ixp_pu64(m, &ctime_ns);
+    /* btime, gen and data_version are not reported */
+    ixp_pu64(m, &zero);
+    ixp_pu64(m, &zero);
+    ixp_pu64(m, &zero);
+    ixp_pu64(m, &zero);
+}
+
+/* The qid of name in the directory fid, after creating it */
+static int
+msg_child_qid(IxpMsg *m, struct unpfs_fid *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct stat stbuf;
+    IxpQid qid;
+
+    snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(dir->path, "/") ? "" : dir->path), name);
+    unpfs_dcache_invalidate(path);
+
+    if (fstatat(dir->pathfd, name, &stbuf, AT_SYMLINK_NOFOLLOW) < 0)
+        return errno;
+
+    qid_posix_to_9p(&qid, &stbuf);
+    ixp_pqid(m, &qid);
+
+    return 0;
+}
+
+/*
+ * Requests: each unpacks its message from in, packs the reply body into
+ * out and returns 0, or returns the errno for an Rlerror
+ */
+
+static int
+dotl_version(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t msize = 0;
+    char *version, *reply;
+
+    ixp_pu32(in, &msize);
+    version = msg_string(in);
+    if (!version || msize < 4096)
+        return EPROTO;
+    reply = strcmp(version, DOTL_VERSION) ? "unknown" : DOTL_VERSION;
+
+    /* A new session; nothing of the old one survives */
+    fid_release_all(rq->dc);
+
+    if (msize > ctx.msize)
+        msize = ctx.msize;
+    __atomic_store_n(&rq->dc->msize, msize, __ATOMIC_RELAXED);
+
+    ixp_pu32(out, &msize);
+    ixp_pstring(out, &reply);
+
+    return 0;
+}
+
+static int
+dotl_attach(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, afid = 0, n_uname = 0;
+    struct unpfs_fid *f;
+    struct stat stbuf;
+    IxpQid qid;
+    int err;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &afid);
+    if (!msg_string(in) || !msg_string(in))
+        return EPROTO;
+    ixp_pu32(in, &n_uname);
+
+    f = unpfs_fid_root(&stbuf);
+    if (!f)
+        return errno;
+
+    err = fid_put(rq->dc, fid, f);
+    if (err) {
+        unpfs_fid_destroy(f);
+        return err;
+    }
+
+    qid_posix_to_9p(&qid, &stbuf);
+    ixp_pqid(out, &qid);
+
+    return 0;
+}
+
+static int
+dotl_walk(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, newfid = 0;
+    uint16_t nwname = 0, nwqid, i;
+    char *wname[IXP_MAX_WELEM];
+    IxpQid wqid[IXP_MAX_WELEM];
+    struct unpfs_fid *f, *nf;
+    int n, err;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &newfid);
+    ixp_pu16(in, &nwname);
+    if (nwname > IXP_MAX_WELEM)
+        return E2BIG;
+
+    for (i = 0; i < nwname; ++i) {
+        wname[i] = msg_string(in);
+        if (!wname[i])
+            return EPROTO;
+        if (!*wname[i] || strchr(wname[i], '/'))
+            return EINVAL;
+    }
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+    if (newfid != fid && fid_get(rq->dc, newfid))
+        return EBADF;
+
+    n = unpfs_fid_walk(f, nwname, wname, wqid, &nf);
+    if (n == 0 && nwname)
+        return errno;
+
+    /* A partial walk replies with the qids it got and binds nothing */
+    if (nf) {
+        if (newfid == fid)
+            fid_release(fid_take(rq->dc, fid));
+        err = fid_put(rq->dc, newfid, nf);
+        if (err) {
+            unpfs_fid_destroy(nf);
+            return err;
+        }
+    } else if (n == nwname) {
+        return errno;
+    }
+
+    nwqid = n;
+    ixp_pu16(out, &nwqid);
+    for (i = 0; i < n; ++i)
+        ixp_pqid(out, &wqid[i]);
+
+    return 0;
+}
+
+static int
+dotl_clunk(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0;
+    struct unpfs_fid *f;
+
+    ixp_pu32(in, &fid);
+
+    f = fid_take(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    return fid_release(f) < 0 ? errno : 0;
+}
+
+static int
+dotl_remove(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0;
+    struct unpfs_fid *f;
+    int err = 0;
+
+    ixp_pu32(in, &fid);
+
+    /* The fid is clunked even if the remove fails */
+    f = fid_take(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (f->handler->remove(f) < 0)
+        err = errno;
+    else
+        unpfs_dcache_invalidate(f->path);
+    fid_release(f);
+
+    return err;
+}
+
+static int
+dotl_lopen(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, flags = 0, iounit = rq->dc->msize - UNPFS_IOHDRSZ;
+    struct unpfs_fid *f;
+    struct stat stbuf;
+    IxpQid qid;
+    int err;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &flags);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+    if (f->priv)
+        return EBUSY;
+
+    if (f->handler->open(f, open_flags_dotl_to_posix(flags) & ~O_CREAT, 0) < 0
+        || unpfs_fid_stat(f, &stbuf) < 0) {
+        err = errno;
+        if (f->priv)
+            f->handler->close(f);
+        return err;
+    }
+
+    qid_posix_to_9p(&qid, &stbuf);
+    ixp_pqid(out, &qid);
+    ixp_pu32(out, &iounit);
+
+    return 0;
+}
+
+static int
+dotl_lcreate(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, flags = 0, mode = 0, gid = 0;
+    uint32_t iounit = rq->dc->msize - UNPFS_IOHDRSZ;
+    struct unpfs_fid *f;
+    struct stat stbuf;
+    IxpQid qid;
+    char *name;
+
+    ixp_pu32(in, &fid);
+    name = msg_string(in);
+    ixp_pu32(in, &flags);
+    ixp_pu32(in, &mode);
+    ixp_pu32(in, &gid);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+    if (f->priv)
+        return EBUSY;
+    if (!(f->type & P9_QTDIR))
+        return ENOTDIR;
+
+    if (unpfs_fid_create(f, name, P9_QTFILE,
+            open_flags_dotl_to_posix(flags) | O_CREAT, mode & 07777, &stbuf) < 0)
+        return errno;
+
+    qid_posix_to_9p(&qid, &stbuf);
+    ixp_pqid(out, &qid);
+    ixp_pu32(out, &iounit);
+
+    return 0;
+}
+
+static void
+read_done(void *arg, ssize_t count)
+{
+    struct dotl_req *rq = arg;
+    uint32_t n = count;
+
+    rq->err = count < 0 ? -count : 0;
+    if (!rq->err) {
+        ixp_pu32(&rq->out, &n);
+        rq->payload_len = n;
+        unpfs_stats_bytes(P9_TRead, n);
+    }
+
+    req_done(rq);
+}
+
+static int
+dotl_read(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, count = 0, n;
+    uint64_t offset = 0;
+    struct unpfs_fid *f;
+    char *data = NULL;
+    ssize_t ret = -1;
+    int fd;
+
+    ixp_pu32(in, &fid);
+    ixp_pu64(in, &offset);
+    ixp_pu32(in, &count);
+
+    f = fid_get(rq->dc, fid);
+    if (!f || !f->priv)
+        return EBADF;
+    if (f->handler == &dir_handler)
+        return EISDIR;
+
+    if (count > rq->dc->msize - DOTL_IO_HEADER_SIZE)
+        count = rq->dc->msize - DOTL_IO_HEADER_SIZE;
+
+    /* Asynchronous I/O is only started from the server loop */
+    if (rq->loop && f->handler->aread &&
+            f->handler->aread(f, &rq->payload, count, offset, read_done, rq) == 0)
+        return DOTL_PENDING;
+
+    /* Spliced into a pipe here, and from it into the connection */
+    if (ctx.zerocopy && (fd = unpfs_fid_fd(f)) >= 0) {
+        if (unpfs_fid_flush(f) < 0)
+            return errno;
+        ret = unpfs_splice_fill(fd, offset, count, &data);
+        if (ret >= 0)
+            unpfs_fid_readahead(f, count, offset);
+    }
+
+    if (ret < 0)
+        ret = f->handler->read(f, &data, count, offset);
+    if (ret < 0) {
+        unpfs_buf_free(data);
+        return errno;
+    }
+
+    n = ret;
+    ixp_pu32(out, &n);
+    rq->payload = data;
+    rq->payload_len = n;
+    unpfs_stats_bytes(P9_TRead, n);
+
+    return 0;
+}
+
+static void
+write_done(void *arg, ssize_t count)
+{
+    struct dotl_req *rq = arg;
+    uint32_t n = count;
+
+    rq->err = count < 0 ? -count : 0;
+    if (!rq->err) {
+        ixp_pu32(&rq->out, &n);
+        unpfs_stats_bytes(P9_TWrite, n);
+    }
+
+    req_done(rq);
+}
+
+static int
+dotl_write(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, count = 0, n;
+    uint64_t offset = 0;
+    struct unpfs_fid *f;
+    ssize_t ret;
+
+    ixp_pu32(in, &fid);
+    ixp_pu64(in, &offset);
+    ixp_pu32(in, &count);
+    if (in->pos + count > in->end)
+        return EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    if (!f || !f->priv)
+        return EBADF;
+
+    if (rq->loop && f->handler->awrite &&
+            f->handler->awrite(f, in->pos, count, offset, write_done, rq) == 0)
+        return DOTL_PENDING;
+
+    ret = f->handler->write(f, in->pos, count, offset);
+    if (ret < 0)
+        return errno;
+
+    n = ret;
+    ixp_pu32(out, &n);
+    unpfs_stats_bytes(P9_TWrite, n);
+
+    return 0;
+}
+
+static int
+dotl_readdir(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, count = 0, n;
+    uint64_t offset = 0;
+    struct unpfs_fid *f;
+    char *data;
+    ssize_t ret;
+
+    ixp_pu32(in, &fid);
+    ixp_pu64(in, &offset);
+    ixp_pu32(in, &count);
+
+    f = fid_get(rq->dc, fid);
+    if (!f || !f->priv)
+        return EBADF;
+
+    if (count > rq->dc->msize - DOTL_IO_HEADER_SIZE)
+        count = rq->dc->msize - DOTL_IO_HEADER_SIZE;
+
+    data = unpfs_buf_alloc(count);
+    if (!data)
+        return ENOMEM;
+
+    ret = unpfs_dir_readdir(f, data, count, offset);
+    if (ret < 0) {
+        unpfs_buf_free(data);
+        return errno;
+    }
+
+    n = ret;
+    ixp_pu32(out, &n);
+    rq->payload = data;
+    rq->payload_len = n;
+
+    return 0;
+}
+
+static int
+dotl_fsync(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, datasync = 0;
+    struct unpfs_fid *f;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &datasync);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (unpfs_fid_flush(f) < 0 || unpfs_sync_fid(f, datasync) < 0)
+        return errno;
+
+    return 0;
+}
+
+static int
+dotl_getattr(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0;
+    uint64_t mask = 0;
+    struct unpfs_fid *f;
+    struct stat stbuf;
+
+    ixp_pu32(in, &fid);
+    ixp_pu64(in, &mask);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (unpfs_fid_stat(f, &stbuf) < 0)
+        return errno;
+
+    msg_stat(out, &stbuf);
+
+    return 0;
+}
+
+static int
+setattr_size(struct unpfs_fid *f, uint64_t size)
+{
+    int ret, fd = unpfs_fid_fd(f);
+
+    /* ftruncate(2) of an open file works whatever its mode is now */
+    if (fd >= 0 && (fcntl(fd, F_GETFL) & O_ACCMODE) != O_RDONLY)
+        return ftruncate(fd, size);
+
+    fd = openat(f->dirfd, unpfs_fid_name(f), O_WRONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return -1;
+    ret = ftruncate(fd, size);
+    close(fd);
+    unpfs_ccache_invalidate(f->dirfd, unpfs_fid_name(f));
+
+    return ret;
+}
+
+static int
+dotl_setattr(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, valid = 0, mode = 0, uid = 0, gid = 0;
+    uint64_t size = 0, atime = 0, atime_ns = 0, mtime = 0, mtime_ns = 0;
+    struct timespec ts[2];
+    struct unpfs_fid *f;
+    const char *name;
+    int ret = 0;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &valid);
+    ixp_pu32(in, &mode);
+    ixp_pu32(in, &uid);
+    ixp_pu32(in, &gid);
+    ixp_pu64(in, &size);
+    ixp_pu64(in, &atime);
+    ixp_pu64(in, &atime_ns);
+    ixp_pu64(in, &mtime);
+    ixp_pu64(in, &mtime_ns);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+    if (unpfs_fid_flush(f) < 0)
+        return errno;
+    name = unpfs_fid_name(f);
+
+    /* Descriptors opened under the old permissions must not be reused */
+    if (valid & (DOTL_SETATTR_MODE | DOTL_SETATTR_UID | DOTL_SETATTR_GID))
+        unpfs_fdcache_invalidate(f->dirfd, name);
+
+    if (valid & DOTL_SETATTR_MODE)
+        ret = fchmodat(f->dirfd, name, mode & 07777, 0);
+
+    if (!ret && (valid & (DOTL_SETATTR_UID | DOTL_SETATTR_GID)))
+        ret = fchownat(f->dirfd, name,
+            (valid & DOTL_SETATTR_UID) ? (uid_t)uid : (uid_t)-1,
+            (valid & DOTL_SETATTR_GID) ? (gid_t)gid : (gid_t)-1,
+            AT_SYMLINK_NOFOLLOW);
+
+    if (!ret && (valid & DOTL_SETATTR_SIZE))
+        ret = setattr_size(f, size);
+
+    if (!ret && (valid & (DOTL_SETATTR_ATIME | DOTL_SETATTR_MTIME))) {
+        ts[0].tv_sec = atime;
+        ts[0].tv_nsec =
+            !(valid & DOTL_SETATTR_ATIME) ? UTIME_OMIT :
+            !(valid & DOTL_SETATTR_ATIME_SET) ? UTIME_NOW : (long)atime_ns;
+        ts[1].tv_sec = mtime;
+        ts[1].tv_nsec =
+            !(valid & DOTL_SETATTR_MTIME) ? UTIME_OMIT :
+            !(valid & DOTL_SETATTR_MTIME_SET) ? UTIME_NOW : (long)mtime_ns;
+        ret = utimensat(f->dirfd, name, ts, AT_SYMLINK_NOFOLLOW);
+    }
+
+    unpfs_dcache_invalidate(f->path);
+
+    return ret < 0 ? errno : 0;
+}
+
+static int
+dotl_statfs(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, type = V9FS_MAGIC, bsize, namelen;
+    uint64_t blocks, bfree, bavail, files, ffree, fsid;
+    struct unpfs_fid *f;
+    struct statvfs st;
+
+    ixp_pu32(in, &fid);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (fstatvfs(f->pathfd, &st) < 0)
+        return errno;
+
+    bsize = st.f_bsize;
+    blocks = st.f_blocks;
+    bfree = st.f_bfree;
+    bavail = st.f_bavail;
+    files = st.f_files;
+    ffree = st.f_ffree;
+    fsid = st.f_fsid;
+    namelen = st.f_namemax;
+
+    ixp_pu32(out, &type);
+    ixp_pu32(out, &bsize);
+    ixp_pu64(out, &blocks);
+    ixp_pu64(out, &bfree);
+    ixp_pu64(out, &bavail);
+    ixp_pu64(out, &files);
+    ixp_pu64(out, &ffree);
+    ixp_pu64(out, &fsid);
+    ixp_pu32(out, &namelen);
+
+    return 0;
+}
+
+static int
+dotl_mkdir(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, mode = 0, gid = 0;
+    struct unpfs_fid *f;
+    char *name;
+
+    ixp_pu32(in, &fid);
+    name = msg_string(in);
+    ixp_pu32(in, &mode);
+    ixp_pu32(in, &gid);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (mkdirat(f->pathfd, name, mode & 07777) < 0)
+        return errno;
+
+    return msg_child_qid(out, f, name);
+}
+
+static int
+dotl_symlink(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, gid = 0;
+    struct unpfs_fid *f;
+    char *name, *target;
+
+    ixp_pu32(in, &fid);
+    name = msg_string(in);
+    target = msg_string(in);
+    ixp_pu32(in, &gid);
+    if (!target || is_bad_name(name))
+        return name && target ? EINVAL : EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (symlinkat(target, f->pathfd, name) < 0)
+        return errno;
+
+    return msg_child_qid(out, f, name);
+}
+
+static int
+dotl_mknod(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, mode = 0, dev_major = 0, dev_minor = 0, gid = 0;
+    struct unpfs_fid *f;
+    char *name;
+
+    ixp_pu32(in, &fid);
+    name = msg_string(in);
+    ixp_pu32(in, &mode);
+    ixp_pu32(in, &dev_major);
+    ixp_pu32(in, &dev_minor);
+    ixp_pu32(in, &gid);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    if (mknodat(f->pathfd, name, mode, makedev(dev_major, dev_minor)) < 0)
+        return errno;
+
+    return msg_child_qid(out, f, name);
+}
+
+static int
+dotl_readlink(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0;
+    struct unpfs_fid *f;
+    char target[PATH_MAX], *p = target;
+    ssize_t n;
+
+    ixp_pu32(in, &fid);
+
+    f = fid_get(rq->dc, fid);
+    if (!f)
+        return EBADF;
+
+    n = readlinkat(f->dirfd, unpfs_fid_name(f), target, sizeof target - 1);
+    if (n < 0)
+        return errno;
+    target[n] = '\0';
+
+    ixp_pstring(out, &p);
+
+    return 0;
+}
+
+static int
+dotl_link(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t dfid = 0, fid = 0;
+    struct unpfs_fid *d, *f;
+    char *name, path[PATH_MAX];
+
+    ixp_pu32(in, &dfid);
+    ixp_pu32(in, &fid);
+    name = msg_string(in);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    d = fid_get(rq->dc, dfid);
+    f = fid_get(rq->dc, fid);
+    if (!d || !f)
+        return EBADF;
+
+    if (linkat(f->dirfd, unpfs_fid_name(f), d->pathfd, name, 0) < 0)
+        return errno;
+
+    snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(d->path, "/") ? "" : d->path), name);
+    unpfs_dcache_invalidate(path);
+
+    return 0;
+}
+
+/* Move fid to name in the directory d and rebind it there */
+static int
+rename_fid(struct unpfs_fid *f, struct unpfs_fid *d, const char *name)
+{
+    char *path = unpfs_path_join(d->path, name);
+    int dirfd, pathfd;
+
+    unpfs_fdcache_invalidate(d->pathfd, name);
+    if (renameat(f->dirfd, unpfs_fid_name(f), d->pathfd, name) < 0) {
+        zfree(&path);
+        return -1;
+    }
+
+    unpfs_dcache_invalidate(f->path);
+    unpfs_dcache_invalidate(path);
+
+    dirfd = fcntl(d->pathfd, F_DUPFD_CLOEXEC, 0);
+    pathfd = dirfd < 0 ? -1 : unpfs_open_path(dirfd, name, O_NOFOLLOW);
+    if (pathfd < 0) {
+        /* Renamed all the same; the fid keeps what it had open */
+        if (dirfd >= 0)
+            close(dirfd);
+        unpfs_log(LOG_WARNING, "%s: %s: %s\n", __func__, path, strerror(errno));
+        zfree(&path);
+        return 0;
+    }
+
+    if (f->dirfd >= 0)
+        close(f->dirfd);
+    close(f->pathfd);
+    f->dirfd = dirfd;
+    f->pathfd = pathfd;
+
+    zfree(&f->path);
+    zfree(&f->real_path);
+    f->path = path;
+    f->real_path = get_real_path(path);
+
+    return 0;
+}
+
+static int
+dotl_rename(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t fid = 0, dfid = 0;
+    struct unpfs_fid *f, *d;
+    char *name;
+
+    ixp_pu32(in, &fid);
+    ixp_pu32(in, &dfid);
+    name = msg_string(in);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    f = fid_get(rq->dc, fid);
+    d = fid_get(rq->dc, dfid);
+    if (!f || !d)
+        return EBADF;
+    if (f->dirfd == AT_FDCWD)
+        return EBUSY;
+
+    return rename_fid(f, d, name) < 0 ? errno : 0;
+}
+
+static int
+dotl_renameat(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t olddirfid = 0, newdirfid = 0;
+    struct unpfs_fid *od, *nd;
+    char *oldname, *newname, path[PATH_MAX];
+
+    ixp_pu32(in, &olddirfid);
+    oldname = msg_string(in);
+    ixp_pu32(in, &newdirfid);
+    newname = msg_string(in);
+    if (is_bad_name(oldname) || is_bad_name(newname))
+        return oldname && newname ? EINVAL : EPROTO;
+
+    od = fid_get(rq->dc, olddirfid);
+    nd = fid_get(rq->dc, newdirfid);
+    if (!od || !nd)
+        return EBADF;
+
+    unpfs_fdcache_invalidate(nd->pathfd, newname);
+    if (renameat(od->pathfd, oldname, nd->pathfd, newname) < 0)
+        return errno;
+
+    snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(od->path, "/") ? "" : od->path), oldname);
+    unpfs_dcache_invalidate(path);
+    snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(nd->path, "/") ? "" : nd->path), newname);
+    unpfs_dcache_invalidate(path);
+
+    return 0;
+}
+
+static int
+dotl_unlinkat(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    uint32_t dfid = 0, flags = 0;
+    struct unpfs_fid *d;
+    char *name, path[PATH_MAX];
+
+    ixp_pu32(in, &dfid);
+    name = msg_string(in);
+    ixp_pu32(in, &flags);
+    if (is_bad_name(name))
+        return name ? EINVAL : EPROTO;
+
+    d = fid_get(rq->dc, dfid);
+    if (!d)
+        return EBADF;
+
+    unpfs_fdcache_invalidate(d->pathfd, name);
+    unpfs_ccache_invalidate(d->pathfd, name);
+    if (unlinkat(d->pathfd, name,
+            (flags & DOTL_AT_REMOVEDIR) ? AT_REMOVEDIR : 0) < 0)
+        return errno;
+
+    snprintf(path, sizeof path, "%s/%s",
+        (!strcmp(d->path, "/") ? "" : d->path), name);
+    unpfs_dcache_invalidate(path);
+
+    return 0;
+}
+
+static int
+dotl_unsupported(struct dotl_req *rq, IxpMsg *in, IxpMsg *out)
+{
+    return EOPNOTSUPP;
+}
+
+static dotl_op_fn
+dotl_op(uint8_t type)
+{
+    switch (type) {
+    case P9_TVersion:       return dotl_version;
+    case P9_TAttach:        return dotl_attach;
+    case P9_TWalk:          return dotl_walk;
+    case P9_TClunk:         return dotl_clunk;
+    case P9_TRemove:        return dotl_remove;
+    case P9_TRead:          return dotl_read;
+    case P9_TWrite:         return dotl_write;
+    case DOTL_TLOPEN:       return dotl_lopen;
+    case DOTL_TLCREATE:     return dotl_lcreate;
+    case DOTL_TREADDIR:     return dotl_readdir;
+    case DOTL_TFSYNC:       return dotl_fsync;
+    case DOTL_TGETATTR:     return dotl_getattr;
+    case DOTL_TSETATTR:     return dotl_setattr;
+    case DOTL_TSTATFS:      return dotl_statfs;
+    case DOTL_TMKDIR:       return dotl_mkdir;
+    case DOTL_TSYMLINK:     return dotl_symlink;
+    case DOTL_TMKNOD:       return dotl_mknod;
+    case DOTL_TREADLINK:    return dotl_readlink;
+    case DOTL_TLINK:        return dotl_link;
+    case DOTL_TRENAME:      return dotl_rename;
+    case DOTL_TRENAMEAT:    return dotl_renameat;
+    case DOTL_TUNLINKAT:    return dotl_unlinkat;
+    default:                return dotl_unsupported;
+    }
+}
+
+/*
+ * Connection I/O
+ */
+static int
+read_full(int fd, char *buf, size_t count)
+{
+    ssize_t n;
+
+    while (count) {
+        n = read(fd, buf, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+static int
+write_full(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        for (; iovcnt && (size_t)n >= iov->iov_len; ++iov, --iovcnt)
+            n -= iov->iov_len;
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/* The data a successful Rread, Rreaddir or Rwrite moved */
+static uint32_t
+reply_bytes(const struct dotl_req *rq)
+{
+    IxpMsg m;
+    uint32_t count = 0;
+
+    switch (rq->type) {
+    case P9_TRead:
+    case DOTL_TREADDIR:
+        return rq->payload_len;
+    case P9_TWrite:
+        m = ixp_message(rq->reply + DOTL_HEADER_SIZE, 4, MsgUnpack);
+        ixp_pu32(&m, &count);
+        return count;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Requests in flight
+ */
+static struct dotl_req *
+req_new(struct dotl_conn *dc, uint32_t size)
+{
+    struct dotl_req *rq = ixp_emallocz(sizeof *rq);
+
+    rq->dc = dc;
+    rq->fids[0] = rq->fids[1] = DOTL_NOFID;
+    rq->msg = ixp_emalloc(size);
+    rq->in = ixp_message(rq->msg, size, MsgUnpack);
+    rq->reply = ixp_emalloc(IXP_MAX_MSG);
+    rq->out = ixp_message(rq->reply + DOTL_HEADER_SIZE,
+        IXP_MAX_MSG - DOTL_HEADER_SIZE, MsgPack);
+
+    return rq;
+}
+
+/* Along with the Tflushes waiting for it */
+static void
+req_free(struct dotl_req *rq)
+{
+    struct dotl_req *next;
+
+    for (; rq; rq = next) {
+        next = rq->flushes;
+        unpfs_buf_free(rq->payload);
+        free(rq->msg);
+        free(rq->reply);
+        free(rq);
+    }
+}
+
+static void
+req_link(struct dotl_req *rq)
+{
+    struct dotl_conn *dc = rq->dc;
+
+    rq->next = NULL;
+    rq->prev = dc->tail;
+    if (dc->tail)
+        dc->tail->next = rq;
+    else
+        dc->head = rq;
+    dc->tail = rq;
+}
+
+static void
+req_unlink(struct dotl_req *rq)
+{
+    struct dotl_conn *dc = rq->dc;
+
+    if (rq->prev)
+        rq->prev->next = rq->next;
+    else
+        dc->head = rq->next;
+
+    if (rq->next)
+        rq->next->prev = rq->prev;
+    else
+        dc->tail = rq->prev;
+}
+
+/*
+ * Unpacks type and tag, and the fids the request uses: most take one as
+ * their first field and may change what it refers to.  Those that only
+ * read through it, or create names in the directory it is, share it.
+ */
+static void
+req_classify(struct dotl_req *rq)
+{
+    struct unpfs_fid *f;
+    IxpMsg m;
+    uint16_t length = 0;
+
+    ixp_pu8(&rq->in, &rq->type);
+    ixp_pu16(&rq->in, &rq->tag);
+
+    m = rq->in;
+    switch (rq->type) {
+    case P9_TVersion:
+        rq->barrier = 1;
+        return;
+    case P9_TFlush:
+        return;
+    case P9_TWalk:
+        ixp_pu32(&m, &rq->fids[0]);
+        ixp_pu32(&m, &rq->fids[1]);
+        rq->exclusive[1] = 1;
+        rq->exclusive[0] = rq->fids[0] == rq->fids[1];
+        break;
+    case P9_TRead:
+    case P9_TWrite:
+    case DOTL_TGETATTR:
+    case DOTL_TFSYNC:
+    case DOTL_TSTATFS:
+    case DOTL_TREADLINK:
+    case DOTL_TMKDIR:
+    case DOTL_TSYMLINK:
+    case DOTL_TMKNOD:
+    case DOTL_TUNLINKAT:
+        ixp_pu32(&m, &rq->fids[0]);
+        break;
+    case DOTL_TLINK:
+        ixp_pu32(&m, &rq->fids[0]);
+        ixp_pu32(&m, &rq->fids[1]);
+        break;
+    case DOTL_TRENAME:
+        ixp_pu32(&m, &rq->fids[0]);
+        ixp_pu32(&m, &rq->fids[1]);
+        rq->exclusive[0] = 1;
+        break;
+    case DOTL_TRENAMEAT:
+        /* olddirfid[4] oldname[s] newdirfid[4]; the names stay packed */
+        ixp_pu32(&m, &rq->fids[0]);
+        ixp_pu16(&m, &length);
+        m.pos += length;
+        ixp_pu32(&m, &rq->fids[1]);
+        break;
+    default:
+        ixp_pu32(&m, &rq->fids[0]);
+        rq->exclusive[0] = 1;
+        break;
+    }
+
+    /* What a short message names does not matter, it fails anyway */
+    if (m.pos > m.end) {
+        rq->fids[0] = rq->fids[1] = DOTL_NOFID;
+        return;
+    }
+
+    /* A directory fid shares one DIR stream; a worker may be clunking it */
+    if (rq->type == P9_TRead) {
+        pthread_mutex_lock(&rq->dc->lock);
+        f = fid_lookup(rq->dc, rq->fids[0]);
+        rq->exclusive[0] = f && f->type & P9_QTDIR;
+        pthread_mutex_unlock(&rq->dc->lock);
+    }
+}
+
+static int
+reqs_conflict(const struct dotl_req *a, const struct dotl_req *b)
+{
+    int i, j;
+
+    if (a->barrier || b->barrier)
+        return 1;
+
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < 2; ++j) {
+            if (a->fids[i] != DOTL_NOFID && a->fids[i] == b->fids[j] &&
+                    (a->exclusive[i] || b->exclusive[j]))
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+req_can_start(const struct dotl_req *rq)
+{
+    const struct dotl_req *p = rq->dc->head;
+
+    for (; p && p != rq; p = p->next) {
+        if (reqs_conflict(p, rq))
+            return 0;
+    }
+
+    return 1;
+}
+
+/* On a worker, or on the server loop without a pool */
+static void
+req_run(void *arg)
+{
+    struct dotl_req *rq = arg;
+    dotl_op_fn op = dotl_op(rq->type);
+
+    rq->err = op(rq, &rq->in, &rq->out);
+    if (!rq->err && (rq->in.pos > rq->in.end || rq->out.pos > rq->out.end))
+        rq->err = rq->in.pos > rq->in.end ? EPROTO : EMSGSIZE;
+    if (op == dotl_unsupported)
+        unpfs_log(LOG_DEBUG, "%s: unsupported message type %u\n",
+            __func__, rq->type);
+    unpfs_arena_reset();
+}
+
+static int
+req_send(struct dotl_req *rq)
+{
+    struct iovec iov[2];
+    uint32_t size, ecode = rq->err;
+    uint8_t type = rq->type + 1;
+    int fd = rq->dc->conn->fd;
+    IxpMsg hdr;
+
+    if (rq->err) {
+        unpfs_buf_free(rq->payload);
+        rq->payload = NULL;
+        rq->payload_len = 0;
+
+        type = DOTL_RLERROR;
+        rq->out = ixp_message(rq->reply + DOTL_HEADER_SIZE,
+            IXP_MAX_MSG - DOTL_HEADER_SIZE, MsgPack);
+        ixp_pu32(&rq->out, &ecode);
+    }
+
+    size = (rq->out.pos - rq->reply) + rq->payload_len;
+    hdr = ixp_message(rq->reply, DOTL_HEADER_SIZE, MsgPack);
+    ixp_pu32(&hdr, &size);
+    ixp_pu8(&hdr, &type);
+    ixp_pu16(&hdr, &rq->tag);
+
+    if (rq->payload && unpfs_splice_is_pipe(rq->payload))
+        return unpfs_splice_send(fd, rq->reply, rq->out.pos - rq->reply, rq->payload);
+
+    iov[0].iov_base = rq->reply;
+    iov[0].iov_len = rq->out.pos - rq->reply;
+    iov[1].iov_base = rq->payload;
+    iov[1].iov_len = rq->payload_len;
+
+    return write_full(fd, iov, rq->payload_len ? 2 : 1);
+}
+
+/* Accounts for rq, and answers it unless send is 0 or nobody listens */
+static void
+req_answer(struct dotl_req *rq, int send)
+{
+    struct dotl_conn *dc = rq->dc;
+
+    unpfs_stats_record(rq->type, rq->err, rq->start);
+    unpfs_log_request(rq->type, rq->tag, rq->fids[0],
+        rq->err ? 0 : reply_bytes(rq), rq->err, rq->start);
+
+    if (send && dc->conn && !dc->broken && req_send(rq) < 0)
+        dc->broken = 1;
+}
+
+/* Answers rq, then the Tflushes for it, on the server loop */
+static void
+req_finish(struct dotl_req *rq)
+{
+    struct dotl_req *flush;
+
+    /* Cut short by a Tflush, it is answered by the Rflush alone */
+    req_answer(rq, !(rq->flushes && rq->err == ECANCELED));
+    for (flush = rq->flushes; flush; flush = flush->flushes)
+        req_answer(flush, 1);
+
+    req_unlink(rq);
+    req_free(rq);
+}
+
+static void
+req_start(struct dotl_req *rq)
+{
+    rq->state = DOTL_STARTED;
+    rq->work = unpfs_worker_submit(req_run, req_done, rq);
+    if (rq->work)
+        return;
+
+    rq->loop = 1;
+    req_run(rq);
+    if (rq->err != DOTL_PENDING)
+        req_finish(rq);
+}
+
+/* Starts the requests nothing before them holds back any more */
+static void
+conn_kick(struct dotl_conn *dc)
+{
+    struct dotl_req *rq, *next;
+
+    for (rq = dc->head; rq; rq = next) {
+        next = rq->next;
+        if (rq->state == DOTL_PARKED && req_can_start(rq))
+            req_start(rq);
+    }
+}
+
+static void
+conn_destroy(struct dotl_conn *dc)
+{
+    fid_release_all(dc);
+    pthread_mutex_destroy(&dc->lock);
+    free(dc);
+}
+
+/* Hangs up if a reply failed, frees dc once it is hung up and idle */
+static void
+conn_settle(struct dotl_conn *dc)
+{
+    if (dc->conn && dc->broken)
+        ixp_hangup(dc->conn);
+    else if (!dc->conn && !dc->head)
+        conn_destroy(dc);
+}
+
+/* On the server loop, once a worker or the I/O is done with rq */
+static void
+req_done(void *arg)
+{
+    struct dotl_req *rq = arg;
+    struct dotl_conn *dc = rq->dc;
+
+    req_finish(rq);
+    conn_kick(dc);
+    conn_settle(dc);
+}
+
+/*
+ * A Tflush answers right away for a request that has not started, which
+ * is then dropped, and after the request otherwise: it is asked to end
+ * early only if its I/O goes through the ring.
+ */
+static void
+req_flush(struct dotl_req *flush)
+{
+    struct dotl_conn *dc = flush->dc;
+    struct dotl_req *rq, **p;
+    uint16_t oldtag = 0;
+
+    ixp_pu16(&flush->in, &oldtag);
+    if (flush->in.pos > flush->in.end) {
+        flush->err = EPROTO;
+        req_answer(flush, 1);
+        req_free(flush);
+        return;
+    }
+
+    for (rq = dc->head; rq && rq->tag != oldtag; rq = rq->next)
+        ;
+
+    if (rq && rq->state == DOTL_STARTED &&
+            !(rq->work && !unpfs_worker_cancel(rq->work))) {
+        if (rq->loop)
+            unpfs_uring_cancel(rq);
+        for (p = &rq->flushes; *p; p = &(*p)->flushes)
+            ;
+        *p = flush;
+        return;
+    }
+
+    if (rq) {
+        req_unlink(rq);
+        req_free(rq);
+    }
+    req_answer(flush, 1);
+    req_free(flush);
+}
+
+/*
+ * Connections
+ */
+static void
+dotl_close(IxpConn *c)
+{
+    struct dotl_conn *dc = c->fd < nconns ? conns[c->fd] : NULL;
+    struct dotl_req *rq, *next;
+
+    if (dc && dc->conn == c) {
+        dc->conn = NULL;
+        conns[c->fd] = NULL;
+
+        /* What no worker has taken is dropped, the rest ends unanswered */
+        for (rq = dc->head; rq; rq = next) {
+            next = rq->next;
+            if (rq->state == DOTL_PARKED ||
+                    (rq->work && !unpfs_worker_cancel(rq->work))) {
+                req_unlink(rq);
+                req_free(rq);
+            }
+        }
+
+        if (!dc->head)
+            conn_destroy(dc);
+    }
+
+    ixp_conn_close(c);
+}
+
+static void
+dotl_serve(IxpConn *c)
+{
+    struct dotl_conn *dc = conns[c->fd];
+    struct dotl_req *rq;
+    char buf[4];
+    IxpMsg m;
+    uint32_t size = 0;
+
+    m = ixp_message(buf, sizeof buf, MsgUnpack);
+    if (read_full(c->fd, buf, sizeof buf) < 0)
+        goto hangup;
+    ixp_pu32(&m, &size);
+    if (size < DOTL_HEADER_SIZE ||
+            size > __atomic_load_n(&dc->msize, __ATOMIC_RELAXED))
+        goto hangup;
+
+    rq = req_new(dc, size - 4);
+    if (read_full(c->fd, rq->msg, size - 4) < 0) {
+        req_free(rq);
+        goto hangup;
+    }
+
+    req_classify(rq);
+    rq->start = unpfs_stats_now();
+    if (rq->type == P9_TFlush) {
+        req_flush(rq);
+        conn_kick(dc);
+    } else {
+        req_link(rq);
+        if (req_can_start(rq))
+            req_start(rq);
+    }
+
+    conn_settle(dc);
+
+    return;
+
+hangup:
+    ixp_hangup(c);
+}
+
+static void
+dotl_adopt(IxpConn *c)
+{
+    struct dotl_conn *dc;
+
+    if (c->fd >= nconns) {
+        int i, n = nconns ? nconns : 64;
+
+        while (n <= c->fd)
+            n *= 2;
+        conns = ixp_erealloc(conns, n * sizeof *conns);
+        for (i = nconns; i < n; ++i)
+            conns[i] = NULL;
+        nconns = n;
+    }
+
+    dc = ixp_emallocz(sizeof *dc);
+    dc->conn = c;
+    dc->msize = IXP_MAX_MSG;
+    pthread_mutex_init(&dc->lock, NULL);
+    conns[c->fd] = dc;
+
+    c->read = dotl_serve;
+}
+
+/*
+ * Look at the first message of a connection without consuming it: a
+ * Tversion for 9P2000.L keeps the connection here, anything else goes
+ * back to libixp.
+ */
+static void
+sniff_read(IxpConn *c)
+{
+    char buf[64];
+    uint32_t size = 0;
+    uint16_t length = 0;
+    uint8_t type = 0;
+    IxpMsg m;
+    ssize_t n;
+
+    n = recv(c->fd, buf, 4, MSG_PEEK | MSG_WAITALL);
+    if (n == 4) {
+        m = ixp_message(buf, 4, MsgUnpack);
+        ixp_pu32(&m, &size);
+        if (size > sizeof buf)
+            size = sizeof buf;
+        n = recv(c->fd, buf, size, MSG_PEEK | MSG_WAITALL);
+    }
+
+    /* size[4] type[1] tag[2] msize[4] version[s] */
+    if (n >= 13) {
+        m = ixp_message(buf + 4, n - 4, MsgUnpack);
+        ixp_pu8(&m, &type);
+        m.pos += 2 + 4;
+        ixp_pu16(&m, &length);
+        if (type == P9_TVersion && m.pos + length <= m.end
+            && length == strlen(DOTL_VERSION)
+            && !memcmp(m.pos, DOTL_VERSION, length)) {
+            dotl_adopt(c);
+            c->read(c);
+            return;
+        }
+    }
+
+    c->read = ixp_conn_read;
+    c->read(c);
+}
+
+void
+unpfs_serve9conn(IxpConn *c)
+{
+    IxpConn *head = c->srv->conn;
+
+    ixp_serve9conn(c);
+
+    /* Accepted connections are pushed on the head of the list */
+    if (c->srv->conn == head)
+        return;
+
+    c = c->srv->conn;
+    ixp_conn_read = c->read;
+    ixp_conn_close = c->close;
+    c->read = sniff_read;
+    c->close = dotl_close;
+}
@@ -0,0 +1,298 @@
+#define _GNU_SOURCE     /* For AT_EMPTY_PATH */
+#include <unpfs/fdcache.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+enum {
+    FDCACHE_BUCKETS = 4096,
+    FDCACHE_CACHEABLE = O_ACCMODE | O_NOFOLLOW
+};
+
+struct fdentry {
+    dev_t dev;
+    ino_t ino;
+    int accmode;
+    int fd;
+    unsigned int refs;
+    int stale;                  /* Out of the table, closed by its last release */
+    struct fdentry *hnext;
+    struct fdentry *prev, *next; /* Idle entries, most recently used first */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    unsigned long budget;
+    struct fdentry *buckets[FDCACHE_BUCKETS];
+    struct fdentry *head, *tail;
+    struct fdentry **byfd;      /* Entry of each cached descriptor */
+    size_t nbyfd;
+    struct unpfs_fdcache_stats stats;
+} fc = { PTHREAD_MUTEX_INITIALIZER, 0, { NULL }, NULL, NULL, NULL, 0,
+         { 0, 0, 0, 0, 0 } };
+
+static unsigned long
+hash_key(dev_t dev, ino_t ino, int accmode)
+{
+    unsigned long h = (unsigned long)ino * 2654435761UL;
+
+    h ^= (unsigned long)dev * 40503UL;
+    return (h ^ (unsigned long)accmode) % FDCACHE_BUCKETS;
+}
+
+static struct fdentry *
+lookup(dev_t dev, ino_t ino, int accmode)
+{
+    struct fdentry *e = fc.buckets[hash_key(dev, ino, accmode)];
+
+    for (; e; e = e->hnext) {
+        if (e->ino == ino && e->dev == dev && e->accmode == accmode)
+            return e;
+    }
+
+    return NULL;
+}
+
+static void
+lru_unlink(struct fdentry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        fc.head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        fc.tail = e->prev;
+    e->prev = e->next = NULL;
+    --fc.stats.idle;
+}
+
+static void
+lru_push(struct fdentry *e)
+{
+    e->prev = NULL;
+    e->next = fc.head;
+    if (fc.head)
+        fc.head->prev = e;
+    else
+        fc.tail = e;
+    fc.head = e;
+    ++fc.stats.idle;
+}
+
+static void
+unhash(struct fdentry *e)
+{
+    struct fdentry **p = &fc.buckets[hash_key(e->dev, e->ino, e->accmode)];
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    --fc.stats.entries;
+}
+
+/* Takes an idle entry out for its descriptor to be closed */
+static void
+drop(struct fdentry *e)
+{
+    lru_unlink(e);
+    unhash(e);
+    fc.byfd[e->fd] = NULL;
+}
+
+static int
+track_fd(struct fdentry *e)
+{
+    struct fdentry **byfd;
+    size_t n;
+
+    if ((size_t)e->fd >= fc.nbyfd) {
+        n = fc.nbyfd ? fc.nbyfd : 256;
+        while (n <= (size_t)e->fd)
+            n *= 2;
+        byfd = realloc(fc.byfd, n * sizeof *byfd);
+        if (!byfd)
+            return -1;
+        memset(byfd + fc.nbyfd, 0, (n - fc.nbyfd) * sizeof *byfd);
+        fc.byfd = byfd;
+        fc.nbyfd = n;
+    }
+
+    fc.byfd[e->fd] = e;
+    return 0;
+}
+
+void
+unpfs_fdcache_init(unsigned long budget)
+{
+    fc.budget = budget;
+}
+
+/* fc.lock held; a descriptor shared with other fids or -1 */
+static int
+get(dev_t dev, ino_t ino, int accmode)
+{
+    struct fdentry *e = lookup(dev, ino, accmode);
+
+    if (!e)
+        return -1;
+
+    if (!e->refs++)
+        lru_unlink(e);
+    return e->fd;
+}
+
+/*
+ * fc.lock held: caches fd if there is room or an idle entry to evict,
+ * whose descriptor *victim is then set to for closing.
+ */
+static void
+insert(dev_t dev, ino_t ino, int accmode, int fd, int *victim)
+{
+    unsigned long h = hash_key(dev, ino, accmode);
+    struct fdentry *e;
+
+    *victim = -1;
+    if (fc.stats.entries >= fc.budget) {
+        if (!fc.tail)
+            return;
+        e = fc.tail;
+        drop(e);
+        *victim = e->fd;
+        ++fc.stats.evictions;
+    } else if (!(e = malloc(sizeof *e))) {
+        return;
+    }
+
+    e->dev = dev;
+    e->ino = ino;
+    e->accmode = accmode;
+    e->fd = fd;
+    e->refs = 1;
+    e->stale = 0;
+    e->prev = e->next = NULL;
+    if (track_fd(e) < 0) {
+        free(e);
+        return;
+    }
+    e->hnext = fc.buckets[h];
+    fc.buckets[h] = e;
+    ++fc.stats.entries;
+}
+
+int
+unpfs_fdcache_open(int dirfd, const char *name, int pathfd, int flags, mode_t mode)
+{
+    struct stat stbuf;
+    int fd, shared, victim, accmode = flags & O_ACCMODE;
+
+    if (!fc.budget || pathfd < 0 || (flags & ~FDCACHE_CACHEABLE) ||
+            fstat(pathfd, &stbuf) < 0 || !S_ISREG(stbuf.st_mode))
+        return openat(dirfd, name, flags, mode);
+
+    pthread_mutex_lock(&fc.lock);
+    fd = get(stbuf.st_dev, stbuf.st_ino, accmode);
+    if (fd >= 0)
+        ++fc.stats.hits;
+    else
+        ++fc.stats.misses;
+    pthread_mutex_unlock(&fc.lock);
+    if (fd >= 0)
+        return fd;
+
+    fd = openat(dirfd, name, flags, mode);
+    if (fd < 0)
+        return -1;
+
+    /* Another fid may have opened it meanwhile */
+    victim = -1;
+    pthread_mutex_lock(&fc.lock);
+    shared = get(stbuf.st_dev, stbuf.st_ino, accmode);
+    /* If it cannot be cached, its release closes it like any other */
+    if (shared < 0)
+        insert(stbuf.st_dev, stbuf.st_ino, accmode, fd, &victim);
+    pthread_mutex_unlock(&fc.lock);
+
+    if (victim >= 0)
+        close(victim);
+    if (shared >= 0) {
+        close(fd);
+        return shared;
+    }
+
+    return fd;
+}
+
+int
+unpfs_fdcache_close(int fd)
+{
+    struct fdentry *e = NULL;
+
+    if (fc.budget) {
+        pthread_mutex_lock(&fc.lock);
+        if ((size_t)fd < fc.nbyfd)
+            e = fc.byfd[fd];
+        if (e && --e->refs) {
+            e = NULL;
+            fd = -1;
+        } else if (e && !e->stale) {
+            lru_push(e);
+            e = NULL;
+            fd = -1;
+        } else if (e) {
+            fc.byfd[fd] = NULL;
+        }
+        pthread_mutex_unlock(&fc.lock);
+        free(e);
+    }
+
+    return fd < 0 ? 0 : close(fd);
+}
+
+void
+unpfs_fdcache_invalidate(int dirfd, const char *name)
+{
+    static const int accmodes[] = { O_RDONLY, O_WRONLY, O_RDWR };
+    int fds[sizeof accmodes / sizeof accmodes[0]];
+    unsigned int i, n = 0;
+    struct fdentry *e;
+    struct stat stbuf;
+
+    if (!fc.budget ||
+            fstatat(dirfd, name, &stbuf,
+                AT_SYMLINK_NOFOLLOW | (*name ? 0 : AT_EMPTY_PATH)) < 0 ||
+            !S_ISREG(stbuf.st_mode))
+        return;
+
+    pthread_mutex_lock(&fc.lock);
+    for (i = 0; i < sizeof accmodes / sizeof accmodes[0]; ++i) {
+        e = lookup(stbuf.st_dev, stbuf.st_ino, accmodes[i]);
+        if (!e)
+            continue;
+
+        if (e->refs) {
+            unhash(e);
+            e->stale = 1;
+        } else {
+            drop(e);
+            fds[n++] = e->fd;
+            free(e);
+        }
+    }
+    pthread_mutex_unlock(&fc.lock);
+
+    for (i = 0; i < n; ++i)
+        close(fds[i]);
+}
+
+void
+unpfs_fdcache_stats(struct unpfs_fdcache_stats *stats)
+{
+    pthread_mutex_lock(&fc.lock);
+    *stats = fc.stats;
+    pthread_mutex_unlock(&fc.lock);
+}
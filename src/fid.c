@@ -1,22 +1,93 @@
 
+#define _GNU_SOURCE     /* For O_PATH */
 #include <unpfs/fid.h>
 #include <unpfs/ops.h>
 #include <ixp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/* Fids come from slabs of FID_SLAB_SIZE, which are kept once allocated */
+enum {
+    FID_SLAB_SIZE = 128
+};
+
+union fid_slot {
+    struct unpfs_fid fid;
+    union fid_slot *next;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    union fid_slot *free;
+    struct unpfs_fid_stats stats;
+} slab = { PTHREAD_MUTEX_INITIALIZER, NULL, { 0, 0, 0 } };
+
+static struct unpfs_fid *
+fid_alloc(void)
+{
+    union fid_slot *slot;
+    int i;
+
+    pthread_mutex_lock(&slab.lock);
+
+    if (!slab.free) {
+        slot = ixp_emalloc(FID_SLAB_SIZE * sizeof *slot);
+        for (i = 0; i < FID_SLAB_SIZE - 1; ++i)
+            slot[i].next = &slot[i + 1];
+        slot[i].next = NULL;
+        slab.free = slot;
+        ++slab.stats.slabs;
+    }
+
+    slot = slab.free;
+    slab.free = slot->next;
+    ++slab.stats.allocs;
+    ++slab.stats.live;
+
+    pthread_mutex_unlock(&slab.lock);
+
+    memset(&slot->fid, 0, sizeof slot->fid);
+
+    return &slot->fid;
+}
+
+static void
+fid_free(struct unpfs_fid *fid)
+{
+    union fid_slot *slot = (union fid_slot *)fid;
+
+    pthread_mutex_lock(&slab.lock);
+    slot->next = slab.free;
+    slab.free = slot;
+    --slab.stats.live;
+    pthread_mutex_unlock(&slab.lock);
+}
+
+void
+unpfs_fid_stats(struct unpfs_fid_stats *stats)
+{
+    pthread_mutex_lock(&slab.lock);
+    *stats = slab.stats;
+    pthread_mutex_unlock(&slab.lock);
+}
 
 struct unpfs_fid *
 unpfs_fid_new(const char *path, uint8_t type)
 {
-    struct unpfs_fid *fid = zalloc(sizeof *fid);
+    struct unpfs_fid *fid = fid_alloc();
 
     fid->path = strdup(path);
     fid->real_path = get_real_path(path);
+    fid->dirfd = -1;
+    fid->pathfd = -1;
     fid->type = type;
     fid->priv = NULL;
 
     fid->handler =
         (type & P9_QTDIR ?
             &dir_handler :
-            &file_handler);
+            file_backend);
 
     return fid;
 }
@@ -24,10 +95,14 @@ unpfs_fid_new(const char *path, uint8_t type)
 struct unpfs_fid *
 unpfs_fid_clone(struct unpfs_fid *fid)
 {
-    struct unpfs_fid *newfid = zalloc(sizeof *fid);
+    struct unpfs_fid *newfid = fid_alloc();
 
     newfid->path = strdup(fid->path);
     newfid->real_path = strdup(fid->real_path);
+    newfid->dirfd = fid->dirfd < 0 ?
+        fid->dirfd : fcntl(fid->dirfd, F_DUPFD_CLOEXEC, 0);
+    newfid->pathfd = fid->pathfd < 0 ?
+        fid->pathfd : fcntl(fid->pathfd, F_DUPFD_CLOEXEC, 0);
     newfid->type = fid->type;
     newfid->handler = fid->handler;
     newfid->priv = fid->priv;
@@ -38,7 +113,44 @@ unpfs_fid_clone(struct unpfs_fid *fid)
 void
 unpfs_fid_destroy(struct unpfs_fid *fid)
 {
+    if (fid->dirfd >= 0)
+        close(fid->dirfd);
+    if (fid->pathfd >= 0)
+        close(fid->pathfd);
     zfree(&fid->path);
     zfree(&fid->real_path);
-    zfree((char **)&fid);
+    fid_free(fid);
+}
+
+const char *
+unpfs_fid_name(const struct unpfs_fid *fid)
+{
+    if (fid->dirfd == AT_FDCWD)
+        return fid->real_path;
+
+    return strrchr(fid->path, '/') + 1;
+}
+
+int
+unpfs_fid_stat(struct unpfs_fid *fid, struct stat *stbuf)
+{
+    if (fid->handler->stat)
+        return fid->handler->stat(fid, stbuf);
+
+    if (unpfs_fid_flush(fid) < 0)
+        return -1;
+
+    return fstat(fid->pathfd, stbuf);
+}
+
+int
+unpfs_fid_flush(struct unpfs_fid *fid)
+{
+    return fid->handler->flush ? fid->handler->flush(fid) : 0;
+}
+
+int
+unpfs_open_path(int dirfd, const char *name, int flags)
+{
+    return openat(dirfd, name, flags | O_PATH | O_CLOEXEC);
 }
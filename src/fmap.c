@@ -0,0 +1,355 @@
+#define _GNU_SOURCE     /* For madvise(2) */
+#include <unpfs/fmap.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+
+enum {
+    FMAP_BUCKETS = 256
+};
+
+/* refs counts both the fids sharing the mapping and the payloads in it */
+struct unpfs_fmap {
+    dev_t dev;
+    ino_t ino;
+    char *base;
+    size_t size;
+    unsigned int refs;
+    int retired;                /* Off the inode table, for a changed file */
+    struct unpfs_fmap *hnext;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct unpfs_fmap *buckets[FMAP_BUCKETS];
+    struct unpfs_fmap **sorted; /* Every mapping by address, for releases */
+    size_t nsorted;
+    size_t capacity;
+    struct unpfs_fmap_stats stats;
+} maps = { PTHREAD_MUTEX_INITIALIZER, { NULL }, NULL, 0, 0, { 0, 0, 0, 0 } };
+
+static struct unpfs_fmap **
+bucket(dev_t dev, ino_t ino)
+{
+    return &maps.buckets[((unsigned long)ino ^ (unsigned long)dev) % FMAP_BUCKETS];
+}
+
+/* maps.lock held; index of the first mapping at or above base */
+static size_t
+sorted_find(const char *base)
+{
+    size_t lo = 0, hi = maps.nsorted, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if ((uintptr_t)maps.sorted[mid]->base < (uintptr_t)base)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/* maps.lock held */
+static int
+sorted_insert(struct unpfs_fmap *map)
+{
+    struct unpfs_fmap **sorted;
+    size_t i, capacity;
+
+    if (maps.nsorted == maps.capacity) {
+        capacity = maps.capacity ? maps.capacity * 2 : 64;
+        sorted = realloc(maps.sorted, capacity * sizeof *sorted);
+        if (!sorted)
+            return -1;
+        maps.sorted = sorted;
+        maps.capacity = capacity;
+    }
+
+    i = sorted_find(map->base);
+    memmove(maps.sorted + i + 1, maps.sorted + i,
+        (maps.nsorted - i) * sizeof *maps.sorted);
+    maps.sorted[i] = map;
+    __atomic_store_n(&maps.nsorted, maps.nsorted + 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+/* maps.lock held; takes the map off the inode table */
+static void
+unhash(struct unpfs_fmap *map)
+{
+    struct unpfs_fmap **p = bucket(map->dev, map->ino);
+
+    if (map->retired)
+        return;
+
+    while (*p != map)
+        p = &(*p)->hnext;
+    *p = map->hnext;
+    map->retired = 1;
+}
+
+/* maps.lock held; for a file whose size no longer matches the mapping */
+static void
+retire(struct unpfs_fmap *map)
+{
+    if (!map->retired)
+        ++maps.stats.retired;
+    unhash(map);
+}
+
+/* maps.lock held; drops a reference, returning the map if it is to be unmapped */
+static struct unpfs_fmap *
+unref(struct unpfs_fmap *map)
+{
+    size_t i;
+
+    if (--map->refs)
+        return NULL;
+
+    unhash(map);
+
+    i = sorted_find(map->base);
+    memmove(maps.sorted + i, maps.sorted + i + 1,
+        (maps.nsorted - i - 1) * sizeof *maps.sorted);
+    __atomic_store_n(&maps.nsorted, maps.nsorted - 1, __ATOMIC_RELAXED);
+
+    --maps.stats.maps;
+    maps.stats.bytes -= map->size;
+
+    return map;
+}
+
+static void
+destroy(struct unpfs_fmap *map)
+{
+    if (map) {
+        munmap(map->base, map->size);
+        free(map);
+    }
+}
+
+/* maps.lock held */
+static struct unpfs_fmap *
+lookup(const struct stat *stbuf)
+{
+    struct unpfs_fmap *map = *bucket(stbuf->st_dev, stbuf->st_ino);
+
+    for (; map; map = map->hnext) {
+        if (map->ino != stbuf->st_ino || map->dev != stbuf->st_dev)
+            continue;
+
+        if (map->size == (size_t)stbuf->st_size) {
+            ++map->refs;
+            return map;
+        }
+
+        retire(map);
+        return NULL;
+    }
+
+    return NULL;
+}
+
+/*
+ * Faults the pages of a payload in on the reading thread, so that sending
+ * it from the server loop does not have to wait for the disk.  This is
+ * also what makes copying it safe: -1 with EFAULT if the file shrank
+ * meanwhile, where touching the pages would raise SIGBUS, and with
+ * EINVAL if the kernel cannot tell.
+ */
+static int
+prefault(char *base, uint64_t offset, size_t count)
+{
+#ifdef MADV_POPULATE_READ
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+
+    return madvise(base + start, count + (offset - start), MADV_POPULATE_READ);
+#else
+    errno = EINVAL;
+    return -1;
+#endif
+}
+
+struct unpfs_fmap *
+unpfs_fmap_get(int fd)
+{
+    struct unpfs_fmap *map, *shared, **p;
+    struct stat stbuf;
+    void *base;
+
+    if (fstat(fd, &stbuf) < 0)
+        return NULL;
+    if (!S_ISREG(stbuf.st_mode) || !stbuf.st_size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((uint64_t)stbuf.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&maps.lock);
+    shared = lookup(&stbuf);
+    pthread_mutex_unlock(&maps.lock);
+    if (shared)
+        return shared;
+
+    map = malloc(sizeof *map);
+    if (!map)
+        return NULL;
+
+    base = mmap(NULL, stbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(map);
+        return NULL;
+    }
+
+    map->dev = stbuf.st_dev;
+    map->ino = stbuf.st_ino;
+    map->base = base;
+    map->size = stbuf.st_size;
+    map->refs = 1;
+    map->retired = 0;
+
+    /* Another fid may have mapped it meanwhile */
+    pthread_mutex_lock(&maps.lock);
+    shared = lookup(&stbuf);
+    if (!shared && sorted_insert(map) < 0) {
+        pthread_mutex_unlock(&maps.lock);
+        destroy(map);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!shared) {
+        p = bucket(map->dev, map->ino);
+        map->hnext = *p;
+        *p = map;
+        ++maps.stats.maps;
+        maps.stats.bytes += map->size;
+    }
+    pthread_mutex_unlock(&maps.lock);
+
+    if (shared) {
+        destroy(map);
+        return shared;
+    }
+
+    return map;
+}
+
+void
+unpfs_fmap_put(struct unpfs_fmap *map)
+{
+    pthread_mutex_lock(&maps.lock);
+    map = unref(map);
+    pthread_mutex_unlock(&maps.lock);
+
+    destroy(map);
+}
+
+ssize_t
+unpfs_fmap_read(struct unpfs_fmap *map, int fd, char **data, size_t count,
+                uint64_t offset)
+{
+    struct stat stbuf;
+    int err;
+
+    /* Pages beyond a shrunk file's end would fault */
+    if (fstat(fd, &stbuf) < 0)
+        return -1;
+
+    pthread_mutex_lock(&maps.lock);
+    if ((size_t)stbuf.st_size != map->size || map->retired) {
+        retire(map);
+        pthread_mutex_unlock(&maps.lock);
+        errno = ESTALE;
+        return -1;
+    }
+
+    if (offset >= map->size) {
+        pthread_mutex_unlock(&maps.lock);
+        *data = NULL;
+        return 0;
+    }
+
+    if (count > map->size - offset)
+        count = map->size - offset;
+    ++map->refs;
+    ++maps.stats.reads;
+    pthread_mutex_unlock(&maps.lock);
+
+    if (prefault(map->base, offset, count) < 0) {
+        err = errno;
+        pthread_mutex_lock(&maps.lock);
+        if (err == EFAULT)
+            retire(map);
+        --maps.stats.reads;
+        map = unref(map);
+        pthread_mutex_unlock(&maps.lock);
+        destroy(map);
+        errno = ENODEV;
+        return -1;
+    }
+
+    *data = map->base + offset;
+
+    return count;
+}
+
+void
+unpfs_fmap_advise(struct unpfs_fmap *map, uint64_t offset, uint64_t length,
+                  int advice)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+
+    if (offset >= map->size)
+        return;
+    if (!length || offset + length > map->size)
+        length = map->size - offset;
+
+    posix_madvise(map->base + start, length + (offset - start), advice);
+}
+
+int
+unpfs_fmap_release(const char *data)
+{
+    struct unpfs_fmap *map = NULL, *unmapped = NULL;
+    size_t i;
+
+    /* Most payloads are pool buffers, and then there are no mappings */
+    if (!__atomic_load_n(&maps.nsorted, __ATOMIC_RELAXED))
+        return 0;
+
+    pthread_mutex_lock(&maps.lock);
+    i = sorted_find(data + 1);
+    if (i > 0) {
+        map = maps.sorted[i - 1];
+        if ((uintptr_t)data >= (uintptr_t)map->base + map->size)
+            map = NULL;
+    }
+    if (map)
+        unmapped = unref(map);
+    pthread_mutex_unlock(&maps.lock);
+
+    destroy(unmapped);
+
+    return map != NULL;
+}
+
+void
+unpfs_fmap_stats(struct unpfs_fmap_stats *stats)
+{
+    pthread_mutex_lock(&maps.lock);
+    *stats = maps.stats;
+    pthread_mutex_unlock(&maps.lock);
+}
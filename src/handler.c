@@ -1,81 +1,583 @@
+#define _DEFAULT_SOURCE     /* For syscall(2) */
 
 #include <unpfs/fid.h>
 #include <unpfs/posix.h>
 #include <unpfs/ops.h>
+#include <unpfs/buf.h>
+#include <unpfs/statpool.h>
+#include <unpfs/stats.h>
+#include <unpfs/fdcache.h>
+#include <unpfs/fmap.h>
+#include <unpfs/ccache.h>
+#include <unpfs/worker.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <dirent.h>
 #include <stdio.h>
+#include <pthread.h>
 
 /*
  * File operations
  */
 
+/*
+ * Readahead: a read starting where the previous one ended continues a
+ * stream.  From the second such read on, the pages of a window ahead of
+ * the reader are requested with POSIX_FADV_WILLNEED, and the window
+ * doubles each time the reader gets halfway into it, like the kernel's
+ * own readahead but spanning the round trips between Treads.  A run of
+ * reads elsewhere marks the file POSIX_FADV_RANDOM instead.
+ */
+enum {
+    RA_MIN_WINDOW = 128 * 1024,
+    RA_MAX_WINDOW = 8 * 1024 * 1024,
+    RA_RANDOM_RUN = 4
+};
+
+enum {
+    ADVICE_NORMAL,
+    ADVICE_SEQUENTIAL,
+    ADVICE_RANDOM
+};
+
+struct readahead {
+    pthread_mutex_t lock;
+    uint64_t next;          /* Where a sequential read would start */
+    uint64_t end;           /* End of the range already advised */
+    size_t window;
+    int sequential;         /* Whether the last read continued a stream */
+    unsigned int run;       /* Reads in a row like the last one */
+    int advice;
+};
+
+/*
+ * Write coalescing, with ctx.wbsize set: writes smaller than that which
+ * continue the buffered range are copied into a per-handle buffer.  It
+ * is written out when a write does not fit or does not follow on, after
+ * WB_DELAY_MS, and before anything that could see the file: reads,
+ * stat, wstat, fsync, remove and clunk.  The error of a deferred write
+ * is kept and returned once, by the next request on the fid.
+ */
+enum {
+    WB_DELAY_MS = 10
+};
+
+struct file_handle;
+
+struct writeback {
+    pthread_mutex_t lock;
+    char *buf;
+    size_t len;
+    uint64_t offset;
+    uint64_t deadline;      /* unpfs_stats_now() to write the buffer by */
+    int err;
+    void *work;             /* Flush handed to the worker pool by the timer */
+    pthread_cond_t flushed; /* Signalled once that is over */
+    /* On the dirty list, while len is not 0 */
+    struct file_handle *prev;
+    struct file_handle *next;
+};
+
+/*
+ * With ctx.mapsize set, files at least that big opened read-only are read
+ * from a mapping shared with other fids of the same file.  When the file
+ * changes size, the handle maps it afresh, or reads it with pread(2) if
+ * it is no longer big enough.
+ *
+ * With the content cache on, small files opened read-only are read from
+ * memory until it is invalidated, and files opened for writing keep it
+ * from caching them while open.
+ */
 struct file_handle {
     int fd;
+    struct readahead ra;
+    struct writeback wb;
+    pthread_mutex_t map_lock;
+    struct unpfs_fmap *map;
+    struct unpfs_ccache *contents;
+    int writing;
+    struct stat stbuf;      /* As opened, with the content cache on */
 };
 
+/*
+ * Handles with buffered data.  Lock order is a handle's wb.lock, then
+ * this; the timer only try-locks handles.
+ */
+static struct {
+    pthread_mutex_t lock;
+    struct file_handle *head;
+    int timer;
+} dirty = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static void
+readahead_update(struct file_handle *fh, size_t count, uint64_t offset)
+{
+    struct readahead *ra = &fh->ra;
+    uint64_t ahead = 0, length = 0;
+    int sequential, advice;
+
+    pthread_mutex_lock(&ra->lock);
+
+    sequential = offset == ra->next && offset;
+    if (sequential != ra->sequential) {
+        ra->sequential = sequential;
+        ra->run = 0;
+    }
+    ++ra->run;
+
+    if (sequential) {
+        advice = ADVICE_SEQUENTIAL;
+
+        if (!ra->window) {
+            ra->window = count * 4 > RA_MIN_WINDOW ? count * 4 : RA_MIN_WINDOW;
+            ra->end = offset + count;
+        }
+        if (offset + count + ra->window / 2 > ra->end) {
+            ahead = ra->end > offset + count ? ra->end : offset + count;
+            length = ra->window;
+            ra->end = ahead + length;
+            if (ra->window < RA_MAX_WINDOW)
+                ra->window *= 2;
+        }
+    } else {
+        ra->window = 0;
+        ra->end = 0;
+        advice = ra->run >= RA_RANDOM_RUN ? ADVICE_RANDOM : ra->advice;
+    }
+
+    ra->next = offset + count;
+    if (advice == ra->advice)
+        advice = -1;
+    else
+        ra->advice = advice;
+
+    pthread_mutex_unlock(&ra->lock);
+
+    if (advice == ADVICE_SEQUENTIAL)
+        posix_fadvise(fh->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    else if (advice == ADVICE_RANDOM)
+        posix_fadvise(fh->fd, 0, 0, POSIX_FADV_RANDOM);
+    if (length)
+        posix_fadvise(fh->fd, ahead, length, POSIX_FADV_WILLNEED);
+
+    /* Faults on a mapping follow its own advice, not the descriptor's */
+    if (fh->map && (advice == ADVICE_SEQUENTIAL || advice == ADVICE_RANDOM)) {
+        pthread_mutex_lock(&fh->map_lock);
+        if (fh->map)
+            unpfs_fmap_advise(fh->map, 0, 0, advice == ADVICE_SEQUENTIAL ?
+                POSIX_MADV_SEQUENTIAL : POSIX_MADV_RANDOM);
+        pthread_mutex_unlock(&fh->map_lock);
+    }
+}
+
+/* dirty.lock held */
+static void
+dirty_remove(struct file_handle *fh)
+{
+    if (fh->wb.prev)
+        fh->wb.prev->wb.next = fh->wb.next;
+    else
+        dirty.head = fh->wb.next;
+    if (fh->wb.next)
+        fh->wb.next->wb.prev = fh->wb.prev;
+    fh->wb.prev = fh->wb.next = NULL;
+}
+
+/* Writes the buffer out, leaving the dirty list to the caller; wb.lock held */
+static void
+wb_write_out(struct file_handle *fh)
+{
+    struct writeback *wb = &fh->wb;
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < wb->len) {
+        n = pwrite(fh->fd, wb->buf + done, wb->len - done, wb->offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (!wb->err)
+                wb->err = n < 0 ? errno : EIO;
+            break;
+        }
+        done += n;
+    }
+    wb->len = 0;
+}
+
+/* Writes the buffer out and takes the handle off the dirty list; wb.lock held */
+static void
+wb_flush(struct file_handle *fh)
+{
+    if (!fh->wb.len)
+        return;
+
+    wb_write_out(fh);
+
+    pthread_mutex_lock(&dirty.lock);
+    dirty_remove(fh);
+    pthread_mutex_unlock(&dirty.lock);
+}
+
+/* On a worker, for the timer */
+static void
+wb_run(void *arg)
+{
+    struct file_handle *fh = arg;
+
+    pthread_mutex_lock(&fh->wb.lock);
+    wb_flush(fh);
+    fh->wb.work = NULL;
+    pthread_cond_broadcast(&fh->wb.flushed);
+    pthread_mutex_unlock(&fh->wb.lock);
+}
+
+/*
+ * Runs on the server loop, every WB_DELAY_MS while there are dirty
+ * handles: libixp timers are not thread-safe, so unpfs_fid_writeback_poll()
+ * arms it there rather than the workers that buffer writes.  Expired
+ * handles are flushed by the worker pool, and only without one here.
+ */
+static void
+wb_timer(long id, void *aux)
+{
+    struct file_handle *fh, *next;
+    uint64_t now = unpfs_stats_now();
+
+    pthread_mutex_lock(&dirty.lock);
+    dirty.timer = 0;
+
+    for (fh = dirty.head; fh; fh = next) {
+        next = fh->wb.next;
+
+        /* A handle in use is flushed by its user or on the next round */
+        if (fh->wb.deadline > now || pthread_mutex_trylock(&fh->wb.lock))
+            continue;
+
+        /* It stays on the list until the worker has flushed it */
+        if (!fh->wb.work)
+            fh->wb.work = unpfs_worker_submit(wb_run, NULL, fh);
+        if (!fh->wb.work) {
+            /* Nothing else runs without workers, the list stays as is */
+            wb_write_out(fh);
+            dirty_remove(fh);
+        }
+        pthread_mutex_unlock(&fh->wb.lock);
+    }
+
+    if (dirty.head) {
+        dirty.timer = 1;
+        ixp_settimer(&ctx.server, WB_DELAY_MS, wb_timer, NULL);
+    }
+    pthread_mutex_unlock(&dirty.lock);
+}
+
+void
+unpfs_fid_writeback_poll(void)
+{
+    pthread_mutex_lock(&dirty.lock);
+    if (dirty.head && !dirty.timer) {
+        dirty.timer = 1;
+        ixp_settimer(&ctx.server, WB_DELAY_MS, wb_timer, NULL);
+    }
+    pthread_mutex_unlock(&dirty.lock);
+}
+
 static int
-file_open(struct unpfs_fid *fid, const char *path, int flags, mode_t mode)
+file_flush(struct unpfs_fid *fid)
 {
-    struct file_handle *fh = zalloc(sizeof *fh);
+    struct file_handle *fh = fid->priv;
+    int err;
+
+    if (!fh || !ctx.wbsize)
+        return 0;
+
+    pthread_mutex_lock(&fh->wb.lock);
+    wb_flush(fh);
+    err = fh->wb.err;
+    fh->wb.err = 0;
+    pthread_mutex_unlock(&fh->wb.lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Buffers a small write; 0 if it has to be written directly */
+static ssize_t
+wb_write(struct file_handle *fh, const void *buf, size_t count, uint64_t offset)
+{
+    struct writeback *wb = &fh->wb;
+    ssize_t ret = count;
+
+    pthread_mutex_lock(&wb->lock);
+
+    if (wb->len && (offset != wb->offset + wb->len || wb->len + count > ctx.wbsize))
+        wb_flush(fh);
+
+    if (wb->err) {
+        errno = wb->err;
+        wb->err = 0;
+        ret = -1;
+    } else if (!wb->buf && !(wb->buf = malloc(ctx.wbsize))) {
+        ret = 0;
+    } else {
+        if (!wb->len) {
+            wb->offset = offset;
+            wb->deadline = unpfs_stats_now() + (uint64_t)WB_DELAY_MS * 1000000;
+
+            pthread_mutex_lock(&dirty.lock);
+            wb->next = dirty.head;
+            if (dirty.head)
+                dirty.head->wb.prev = fh;
+            dirty.head = fh;
+            pthread_mutex_unlock(&dirty.lock);
+        }
+
+        memcpy(wb->buf + wb->len, buf, count);
+        wb->len += count;
+        if (wb->len == ctx.wbsize)
+            wb_flush(fh);
+    }
+
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret;
+}
+
+/* The shared mapping of the file if it is big enough, NULL otherwise */
+static struct unpfs_fmap *
+file_map(struct file_handle *fh)
+{
+    struct stat stbuf;
+
+    if (fstat(fh->fd, &stbuf) < 0 || !S_ISREG(stbuf.st_mode) ||
+            (uint64_t)stbuf.st_size < ctx.mapsize)
+        return NULL;
+
+    return unpfs_fmap_get(fh->fd);
+}
+
+/* Points *buf into the mapping; -1 with errno ENODEV if it cannot serve the read */
+static ssize_t
+map_read(struct file_handle *fh, char **buf, size_t count, uint64_t offset)
+{
+    ssize_t n = -1;
+
+    pthread_mutex_lock(&fh->map_lock);
+    if (fh->map) {
+        n = unpfs_fmap_read(fh->map, fh->fd, buf, count, offset);
+        if (n < 0 && errno == ESTALE) {
+            unpfs_fmap_put(fh->map);
+            fh->map = file_map(fh);
+            n = -1;
+            if (fh->map)
+                n = unpfs_fmap_read(fh->map, fh->fd, buf, count, offset);
+        }
+    }
+    if (!fh->map || (n < 0 && errno == ESTALE)) {
+        n = -1;
+        errno = ENODEV;
+    }
+    pthread_mutex_unlock(&fh->map_lock);
+
+    return n;
+}
+
+static int
+file_open(struct unpfs_fid *fid, int flags, mode_t mode)
+{
+    struct file_handle *fh = ixp_emallocz(sizeof *fh);
 
     fid->priv = fh;
-    fh->fd = open(fid->real_path, flags, mode);
+    pthread_mutex_init(&fh->ra.lock, NULL);
+    pthread_mutex_init(&fh->wb.lock, NULL);
+    pthread_cond_init(&fh->wb.flushed, NULL);
+    pthread_mutex_init(&fh->map_lock, NULL);
+    fh->fd = unpfs_fdcache_open(fid->dirfd, unpfs_fid_name(fid), fid->pathfd,
+        flags, mode);
+    if (fh->fd < 0)
+        return -1;
 
-    return fh->fd >= 0 ? 0 : -1;
+    if (unpfs_ccache_enabled() && fstat(fh->fd, &fh->stbuf) == 0) {
+        if ((flags & O_ACCMODE) == O_RDONLY) {
+            fh->contents = unpfs_ccache_get(fh->fd, &fh->stbuf);
+        } else {
+            unpfs_ccache_write_begin(&fh->stbuf);
+            fh->writing = 1;
+        }
+    }
+
+    if (ctx.mapsize && !fh->contents && (flags & O_ACCMODE) == O_RDONLY)
+        fh->map = file_map(fh);
+
+    return 0;
 }
 
 static ssize_t
 file_read(struct unpfs_fid *fid, char **buf, size_t count, uint64_t offset)
 {
     struct file_handle *fh = fid->priv;
+    ssize_t n;
 
-    *buf = ixp_emallocz(count);
-    if (!*buf) {
-        errno = ENOMEM;
+    if (file_flush(fid) < 0)
         return -1;
+
+    if (fh->contents) {
+        n = unpfs_ccache_read(fh->contents, buf, count, offset);
+        if (n >= 0 || errno != ENODEV)
+            return n;
+    }
+
+    readahead_update(fh, count, offset);
+
+    if (fh->map) {
+        n = map_read(fh, buf, count, offset);
+        if (n >= 0 || errno != ENODEV)
+            return n;
     }
 
-    if (lseek(fh->fd, offset, SEEK_SET) == (off_t)-1)
+    *buf = unpfs_buf_alloc(count);
+    if (!*buf) {
+        errno = ENOMEM;
         return -1;
+    }
 
-    return read(fh->fd, *buf, count);
+    return pread(fh->fd, *buf, count, offset);
 }
 
 static ssize_t
 file_write(struct unpfs_fid *fid, const void *buf, size_t count, uint64_t offset)
 {
     struct file_handle *fh = fid->priv;
+    ssize_t n;
 
-    if (lseek(fh->fd, offset, SEEK_SET) == (off_t)-1)
+    if (count && count < ctx.wbsize) {
+        n = wb_write(fh, buf, count, offset);
+        if (n)
+            return n;
+    } else if (file_flush(fid) < 0) {
         return -1;
+    }
 
-    return write(fh->fd, buf, count);
+    return pwrite(fh->fd, buf, count, offset);
 }
 
 static int
 file_close(struct unpfs_fid *fid)
 {
-    int fd;
+    int fd, err;
     struct file_handle *fh = fid->priv;
 
     if (!fh)
         return 0;
 
+    /* A flush the timer handed to a worker has to be over before fh is */
+    pthread_mutex_lock(&fh->wb.lock);
+    if (fh->wb.work && !unpfs_worker_cancel(fh->wb.work))
+        fh->wb.work = NULL;
+    while (fh->wb.work)
+        pthread_cond_wait(&fh->wb.flushed, &fh->wb.lock);
+    pthread_mutex_unlock(&fh->wb.lock);
+
+    err = file_flush(fid) < 0 ? errno : 0;
     fd = fh->fd;
 
+    if (fh->map)
+        unpfs_fmap_put(fh->map);
+    if (fh->contents)
+        unpfs_ccache_put(fh->contents);
+    if (fh->writing)
+        unpfs_ccache_write_end(&fh->stbuf);
+    pthread_mutex_destroy(&fh->ra.lock);
+    pthread_mutex_destroy(&fh->wb.lock);
+    pthread_cond_destroy(&fh->wb.flushed);
+    pthread_mutex_destroy(&fh->map_lock);
+    free(fh->wb.buf);
     zfree((char **)&fh);
+    fid->priv = NULL;
 
-    return close(fd);
+    if (unpfs_fdcache_close(fd) < 0)
+        return -1;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
 }
 
 static int
 file_remove(struct unpfs_fid *fid)
 {
-    return unlink(fid->real_path);
+    if (file_flush(fid) < 0)
+        return -1;
+
+    unpfs_fdcache_invalidate(fid->dirfd, unpfs_fid_name(fid));
+    unpfs_ccache_invalidate(fid->dirfd, unpfs_fid_name(fid));
+    return unlinkat(fid->dirfd, unpfs_fid_name(fid), 0);
+}
+
+static int
+file_aread(struct unpfs_fid *fid, char **buf, size_t count, uint64_t offset,
+           unpfs_io_done done, void *arg)
+{
+    struct file_handle *fh = fid->priv;
+    int buffered = 0;
+
+    /* Coalesced writes are flushed and reported on the synchronous path */
+    if (ctx.wbsize) {
+        pthread_mutex_lock(&fh->wb.lock);
+        buffered = fh->wb.len || fh->wb.err;
+        pthread_mutex_unlock(&fh->wb.lock);
+    }
+
+    /*
+     * and cached files need no I/O to be read.  Mapped files are read
+     * through the ring as well, since faulting their pages in would
+     * stall the loop.
+     */
+    if (buffered || fh->contents) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    readahead_update(fh, count, offset);
+
+    *buf = unpfs_buf_alloc(count);
+    if (!*buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (unpfs_uring_read(fh->fd, *buf, count, offset, done, arg) < 0) {
+        unpfs_buf_free(*buf);
+        *buf = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+file_awrite(struct unpfs_fid *fid, const void *buf, size_t count, uint64_t offset,
+            unpfs_io_done done, void *arg)
+{
+    struct file_handle *fh = fid->priv;
+
+    if (ctx.wbsize) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return unpfs_uring_write(fh->fd, buf, count, offset, done, arg);
 }
 
 const struct fid_handler file_handler = {
@@ -83,64 +585,361 @@ const struct fid_handler file_handler = {
     file_read,
     file_write,
     file_close,
-    file_remove
+    file_remove,
+    NULL,
+    NULL,
+    NULL,
+    file_flush
+};
+
+const struct fid_handler uring_file_handler = {
+    file_open,
+    file_read,
+    file_write,
+    file_close,
+    file_remove,
+    file_aread,
+    file_awrite,
+    NULL,
+    file_flush
 };
 
+const struct fid_handler *file_backend = &file_handler;
+
+int
+unpfs_fid_fd(struct unpfs_fid *fid)
+{
+    struct file_handle *fh = fid->priv;
+
+    /* Synthetic files keep something else in priv */
+    if ((fid->handler != &file_handler && fid->handler != &uring_file_handler) || !fh)
+        return -1;
+
+    return fh->fd;
+}
+
+void
+unpfs_fid_readahead(struct unpfs_fid *fid, size_t count, uint64_t offset)
+{
+    if (unpfs_fid_fd(fid) >= 0)
+        readahead_update(fid->priv, count, offset);
+}
+
 
 /*
  * Directory operations
+ *
+ * A directory read returns whole stat records, and 9P clients continue
+ * at the previous offset plus the previous count.  The handle remembers
+ * which 9P offset the next entry starts at, so sequential reads resume
+ * where they stopped and an entry that does not fit is kept for the
+ * next read.  Entries come from getdents64(2) in batches and are stat'd
+ * relative to the directory descriptor.
  */
+
+enum {
+    DIR_BATCH_SIZE = 32 * 1024,
+    DIR_STAT_BATCH = 256
+};
+
+struct dir_handle {
+    int fd;
+    uint64_t offset;        /* 9P offset of the entry at pos */
+    uint64_t cookie;        /* getdents offset of the entry at pos */
+    size_t pos, len;        /* Unconsumed part of batch */
+    int eof;
+    union {
+        char batch[DIR_BATCH_SIZE];
+        struct dirent align;    /* getdents64(2) records are 8-byte aligned */
+    } buf;
+};
+
 static int
-dir_open(struct unpfs_fid *fid, const char *path, int flags, mode_t mode)
+dir_open(struct unpfs_fid *fid, int flags, mode_t mode)
 {
+    struct dir_handle *dh;
+
     if (flags & O_CREAT) {
-        int ret = mkdir(path, mode);
+        int ret = mkdirat(fid->dirfd, unpfs_fid_name(fid), mode);
         if (ret < 0)
             return ret;
     }
 
-    fid->priv = opendir(fid->real_path);
+    dh = malloc(sizeof *dh);
+    if (!dh) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    dh->fd = openat(fid->dirfd, unpfs_fid_name(fid), O_RDONLY | O_DIRECTORY);
+    if (dh->fd < 0) {
+        free(dh);
+        return -1;
+    }
+    dh->offset = dh->cookie = 0;
+    dh->pos = dh->len = 0;
+    dh->eof = 0;
+    fid->priv = dh;
+
+    return 0;
+}
+
+static int
+dir_rewind(struct dir_handle *dh)
+{
+    if (lseek(dh->fd, 0, SEEK_SET) < 0)
+        return -1;
+
+    dh->offset = dh->cookie = 0;
+    dh->pos = dh->len = 0;
+    dh->eof = 0;
 
-    return fid->priv ? 0 : -1;
+    return 0;
+}
+
+/* The entry at the cursor, NULL at the end of the directory */
+static struct dirent *
+dir_peek(struct dir_handle *dh)
+{
+    long n;
+
+    if (dh->pos < dh->len)
+        return (struct dirent *)(dh->buf.batch + dh->pos);
+    if (dh->eof)
+        return NULL;
+
+    n = syscall(SYS_getdents64, dh->fd, dh->buf.batch, sizeof dh->buf.batch);
+    if (n <= 0) {
+        /* Errors end the listing early, as readdir(3) would */
+        dh->eof = 1;
+        return NULL;
+    }
+    dh->pos = 0;
+    dh->len = n;
+
+    return (struct dirent *)dh->buf.batch;
+}
+
+static void
+dir_advance(struct dir_handle *dh)
+{
+    struct dirent *d = (struct dirent *)(dh->buf.batch + dh->pos);
+
+    dh->cookie = d->d_off;
+    dh->pos += d->d_reclen;
+}
+
+/*
+ * Stat the entry at the cursor.  Returns 0 if it goes into the listing,
+ * 1 if it is skipped (.. and entries removed since getdents), -1 at end.
+ */
+static int
+dir_entry(struct dir_handle *dh, IxpStat *s, struct stat *stbuf)
+{
+    struct dirent *d = dir_peek(dh);
+
+    if (!d)
+        return -1;
+
+    /* 9P doesn't need ../ */
+    if (!strcmp(d->d_name, "..")
+        || fstatat(dh->fd, d->d_name, stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+        dir_advance(dh);
+        return 1;
+    }
+
+    stat_posix_to_9p(s, d->d_name, stbuf);
+
+    return 0;
+}
+
+/* Position the cursor at 9P offset, which must start an entry */
+static int
+dir_seek(struct dir_handle *dh, uint64_t offset)
+{
+    IxpStat s;
+    struct stat stbuf;
+    int ret;
+
+    if (offset < dh->offset && dir_rewind(dh) < 0)
+        return -1;
+
+    while (dh->offset < offset) {
+        ret = dir_entry(dh, &s, &stbuf);
+        if (ret < 0)
+            return 0;
+        if (ret > 0)
+            continue;
+        dh->offset += ixp_sizeof_stat(&s);
+        dir_advance(dh);
+    }
+
+    if (dh->offset != offset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* What the entry will take in a reply, which only its name decides */
+static size_t
+dir_stat_size(char *name)
+{
+    IxpStat s;
+    struct stat stbuf;
+
+    memset(&stbuf, 0, sizeof stbuf);
+    stat_posix_to_9p(&s, name, &stbuf);
+
+    return ixp_sizeof_stat(&s);
 }
 
 static ssize_t
 dir_read(struct unpfs_fid *fid, char **buf, size_t count, uint64_t offset)
 {
     ssize_t n = 0;
-    DIR *dirp = fid->priv;
-    char path[PATH_MAX];
-    char *statbuf = ixp_emallocz(count);
-    IxpMsg m = ixp_message(statbuf, count, MsgPack);
-    struct dirent entry, *result;
-
-    for (; readdir_r(dirp, &entry, &result) == 0 && result;) {
-        IxpStat s;
-        struct stat stbuf;
-
-        /* 9P doesn't need ../ */
-        if (!strcmp(entry.d_name, ".."))
-            continue;
+    struct dir_handle *dh = fid->priv;
+    struct unpfs_stat_req *reqs;
+    struct dirent *d;
+    char *statbuf;
+    IxpMsg m;
+    IxpStat s;
+    size_t i, k, pos, size, room;
+
+    if (offset != dh->offset && dir_seek(dh, offset) < 0)
+        return -1;
 
-        snprintf(path, sizeof path, "%s%s%s",
-            fid->real_path,
-            (!strcmp(fid->real_path, "/") ? "" : "/"),
-            entry.d_name);
+    statbuf = unpfs_buf_alloc(count);
+    reqs = malloc(DIR_STAT_BATCH * sizeof *reqs);
+    if (!statbuf || !reqs) {
+        unpfs_buf_free(statbuf);
+        free(reqs);
+        errno = ENOMEM;
+        return -1;
+    }
 
-        if (lstat(path, &stbuf) < 0)
+    m = ixp_message(statbuf, count, MsgPack);
+
+    /*
+     * Stat every entry of the batch that can still fit at once, then pack
+     * them in directory order.  Entries that fail to stat leave room for
+     * the next round.
+     */
+    while (dir_peek(dh)) {
+        room = count - n;
+
+        for (k = 0, pos = dh->pos; k < DIR_STAT_BATCH && pos < dh->len; pos += d->d_reclen) {
+            d = (struct dirent *)(dh->buf.batch + pos);
+
+            /* 9P doesn't need ../ */
+            if (!strcmp(d->d_name, ".."))
+                continue;
+
+            /* Left at the cursor for the next read */
+            size = dir_stat_size(d->d_name);
+            if (size > room)
+                break;
+            room -= size;
+            reqs[k++].name = d->d_name;
+        }
+
+        if (!k) {
+            dh->pos = pos;
+            if (pos < dh->len)
+                break;
             continue;
+        }
+
+        unpfs_statpool_run(dh->fd, reqs, k);
+
+        for (i = 0; i < k; dir_advance(dh)) {
+            d = (struct dirent *)(dh->buf.batch + dh->pos);
+            if (d->d_name != reqs[i].name)
+                continue;
+
+            if (!reqs[i].err) {
+                stat_posix_to_9p(&s, d->d_name, &reqs[i].st);
+                n += ixp_sizeof_stat(&s);
+                dh->offset += ixp_sizeof_stat(&s);
 
-        stat_posix_to_9p(&s, entry.d_name, &stbuf);
+                /* Pack the stat to the binary */
+                ixp_pstat(&m, &s);
+            }
+            ++i;
+        }
+    }
+
+    free(reqs);
+
+    /* Not even one entry fits; an empty reply would read as the end */
+    if (n == 0 && dir_peek(dh)) {
+        unpfs_buf_free(statbuf);
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    *buf = statbuf;
 
-        if (n + ixp_sizeof_stat(&s) > (ssize_t)count)
+    return n;
+}
+
+/*
+ * 9P2000.L directory entries: qid[13] offset[8] type[1] name[s], where
+ * offset is the getdents cookie to continue after the entry.  Nothing
+ * is stat'd; the qid carries the inode and whether it is a directory.
+ */
+ssize_t
+unpfs_dir_readdir(struct unpfs_fid *fid, char *buf, size_t count, uint64_t offset)
+{
+    struct dir_handle *dh = fid->priv;
+    struct dirent *d;
+    size_t n = 0, size;
+    IxpMsg m;
+    IxpQid qid;
+    uint64_t next;
+    uint8_t type;
+    char *name;
+
+    if (fid->handler != &dir_handler || !dh) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    if (offset != dh->cookie) {
+        if (lseek(dh->fd, offset, SEEK_SET) < 0)
+            return -1;
+        dh->cookie = offset;
+        dh->pos = dh->len = 0;
+        dh->eof = 0;
+    }
+
+    m = ixp_message(buf, count, MsgPack);
+    memset(&qid, 0, sizeof qid);
+
+    while ((d = dir_peek(dh))) {
+        size = 13 + 8 + 1 + 2 + strlen(d->d_name);
+        if (n + size > count)
             break;
-        n += ixp_sizeof_stat(&s);
 
-        /* Pack the stat to the binary */
-        ixp_pstat(&m, &s);
+        qid.type = d->d_type == DT_DIR ? P9_QTDIR : 0;
+        qid.path = d->d_ino;
+        next = d->d_off;
+        type = d->d_type;
+        name = d->d_name;
+
+        ixp_pqid(&m, &qid);
+        ixp_pu64(&m, &next);
+        ixp_pu8(&m, &type);
+        ixp_pstring(&m, &name);
+        n += size;
+        dir_advance(dh);
     }
 
-    *buf = m.data;
+    if (n == 0 && d) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
     return n;
 }
@@ -155,15 +954,23 @@ dir_write(struct unpfs_fid *fid, const void *buf, size_t count, uint64_t offset)
 static int
 dir_close(struct unpfs_fid *fid)
 {
-    DIR *dirp = fid->priv;
+    struct dir_handle *dh = fid->priv;
+    int ret;
+
+    if (!dh)
+        return 0;
+
+    ret = close(dh->fd);
+    free(dh);
+    fid->priv = NULL;
 
-    return closedir(dirp);
+    return ret;
 }
 
 static int
 dir_remove(struct unpfs_fid *fid)
 {
-    return rmdir(fid->real_path);
+    return unlinkat(fid->dirfd, unpfs_fid_name(fid), AT_REMOVEDIR);
 }
 
 
@@ -172,5 +979,9 @@ const struct fid_handler dir_handler = {
     dir_read,
     dir_write,
     dir_close,
-    dir_remove
+    dir_remove,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
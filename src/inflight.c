@@ -0,0 +1,157 @@
+#include <unpfs/inflight.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+
+enum {
+    INFLIGHT_BUCKETS = 1024
+};
+
+struct inflight {
+    const void *conn;
+    uint16_t tag;
+    Ixp9Req *req;
+    uint64_t start;
+    unpfs_cancel_fn cancel;
+    void *arg;
+    struct inflight *flushes;   /* Tflushes held for this request, in order */
+    struct inflight *fnext;
+    struct inflight *hnext;
+};
+
+/*
+ * Requests only: held Tflushes are on their owner's list alone, as those
+ * libixp sends for a hung up connection all have the tag IXP_NOTAG.
+ */
+static struct inflight *table[INFLIGHT_BUCKETS];
+
+static struct inflight **
+bucket(const void *conn, uint16_t tag)
+{
+    return &table[((uintptr_t)conn / sizeof (void *) ^ tag) % INFLIGHT_BUCKETS];
+}
+
+static struct inflight *
+lookup(const void *conn, uint16_t tag)
+{
+    struct inflight *e = *bucket(conn, tag);
+
+    while (e && (e->conn != conn || e->tag != tag))
+        e = e->hnext;
+
+    return e;
+}
+
+/* The request a Tflush of tag on conn is held for, NULL if there is none */
+static struct inflight *
+lookup_flush(const void *conn, uint16_t tag)
+{
+    struct inflight *e, *f;
+    unsigned int i;
+
+    for (i = 0; i < INFLIGHT_BUCKETS; ++i) {
+        for (e = table[i]; e; e = e->hnext) {
+            if (e->conn != conn)
+                continue;
+            for (f = e->flushes; f; f = f->fnext) {
+                if (f->tag == tag)
+                    return e;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static struct inflight *
+entry_new(Ixp9Req *r)
+{
+    struct inflight *e = zalloc(sizeof *e);
+
+    e->conn = r->conn;
+    e->tag = r->ifcall.hdr.tag;
+    e->req = r;
+
+    return e;
+}
+
+static void
+unlink_entry(struct inflight *e)
+{
+    struct inflight **p = bucket(e->conn, e->tag);
+
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+}
+
+void
+unpfs_inflight_begin(Ixp9Req *r, uint64_t start, unpfs_cancel_fn cancel, void *arg)
+{
+    struct inflight *e = entry_new(r), **p = bucket(e->conn, e->tag);
+
+    e->hnext = *p;
+    *p = e;
+    e->start = start;
+    e->cancel = cancel;
+    e->arg = arg;
+}
+
+Ixp9Req *
+unpfs_inflight_end(Ixp9Req *r, uint64_t *start)
+{
+    struct inflight *e = lookup(r->conn, r->ifcall.hdr.tag), *f, *next;
+    Ixp9Req *head = NULL, *last = NULL;
+
+    if (!e) {
+        unpfs_log(LOG_ERR, "%s: tag %u not in flight\n", __func__, r->ifcall.hdr.tag);
+        if (start)
+            *start = 0;
+        return NULL;
+    }
+
+    unlink_entry(e);
+    if (start)
+        *start = e->start;
+
+    for (f = e->flushes; f; f = next) {
+        next = f->fnext;
+
+        f->req->aux = NULL;
+        if (last)
+            last->aux = f->req;
+        else
+            head = f->req;
+        last = f->req;
+
+        zfree((char **)&f);
+    }
+    zfree((char **)&e);
+
+    return head;
+}
+
+int
+unpfs_inflight_flush(Ixp9Req *flush)
+{
+    struct inflight *e, *f, **last;
+
+    /* A Tflush of a held Tflush is answered right after it */
+    e = lookup(flush->conn, flush->ifcall.tflush.oldtag);
+    if (!e)
+        e = lookup_flush(flush->conn, flush->ifcall.tflush.oldtag);
+    if (!e)
+        return 0;
+
+    if (!e->flushes && e->cancel && !e->cancel(e->req, e->arg)) {
+        unlink_entry(e);
+        zfree((char **)&e);
+        return 0;
+    }
+
+    f = entry_new(flush);
+    for (last = &e->flushes; *last; last = &(*last)->fnext)
+        ;
+    *last = f;
+
+    return 1;
+}
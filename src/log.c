@@ -1,12 +1,58 @@
-
 #include <unpfs/common.h>
+#include <unpfs/stats.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Once unpfs_log_start() has run, messages go through a bounded ring
+ * that any thread may append to without locking.  A logger thread
+ * formats the records and writes them to stderr in batches.  When the
+ * ring is full the record is dropped and counted instead of waiting.
+ */
+enum {
+    LOG_RING_SIZE = 4096,           /* A power of two */
+    LOG_TEXT_SIZE = 192,
+    LOG_BATCH_SIZE = 64 * 1024,
+    LOG_IDLE_NS = 10 * 1000 * 1000
+};
+
+enum {
+    RECORD_TEXT,
+    RECORD_REQUEST
+};
+
+struct log_record {
+    unsigned long seq;
+    uint8_t kind;
+    uint8_t pri;
+    union {
+        char text[LOG_TEXT_SIZE];
+        struct {
+            uint8_t type;
+            uint16_t tag;
+            uint32_t fid;
+            uint32_t size;
+            int err;
+            unsigned long us;
+        } req;
+    } u;
+};
 
 static volatile sig_atomic_t unpfs_log_pri = 0;
 
+static struct {
+    struct log_record *ring;
+    unsigned long tail;             /* Next slot to claim */
+    unsigned long head;             /* Logger thread only */
+    unsigned long dropped;
+    int running;
+    pthread_t thread;
+} logger;
+
 int
 unpfs_log_level(int level)
 {
@@ -17,22 +63,229 @@ unpfs_log_level(int level)
     return old_level;
 }
 
+/* A slot to fill in and pass to commit(), NULL if the ring is full */
+static struct log_record *
+claim(void)
+{
+    unsigned long pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+    struct log_record *rec;
+    long diff;
+
+    for (;;) {
+        rec = &logger.ring[pos & (LOG_RING_SIZE - 1)];
+        diff = (long)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&logger.tail, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return rec;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void
+commit(struct log_record *rec)
+{
+    unsigned long pos = rec->seq;
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
 void
 unpfs_log(int pri, const char *fmt, ...)
 {
-    if (unpfs_log_pri <= pri) {
-        va_list ap;
+    struct log_record *rec;
+    va_list ap;
+    int n;
+
+    if (unpfs_log_pri > pri)
+        return;
 
-        va_start(ap, fmt);
+    va_start(ap, fmt);
 
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
         fprintf(stderr, "[%d] ", pri);
         vfprintf(stderr, fmt, ap);
+    } else if ((rec = claim())) {
+        rec->kind = RECORD_TEXT;
+        rec->pri = pri;
+        n = vsnprintf(rec->u.text, sizeof rec->u.text, fmt, ap);
+        if (n >= (int)sizeof rec->u.text)
+            rec->u.text[sizeof rec->u.text - 2] = '\n';
+        commit(rec);
+    }
+
+    va_end(ap);
+}
+
+/* Long output such as the statistics report, written out directly */
+void
+unpfs_log_text(int pri, const char *text)
+{
+    if (unpfs_log_pri <= pri)
+        fprintf(stderr, "[%d] %s", pri, text);
+}
+
+static size_t
+format_record(char *buf, size_t size, const struct log_record *rec)
+{
+    const char *name;
+    int n;
+
+    if (rec->kind == RECORD_TEXT)
+        return snprintf(buf, size, "[%d] %s", rec->pri, rec->u.text);
+
+    name = unpfs_stats_op_name(rec->u.req.type);
+    if (name)
+        n = snprintf(buf, size, "[%d] %s:", rec->pri, name);
+    else
+        n = snprintf(buf, size, "[%d] type%u:", rec->pri, rec->u.req.type);
+
+    n += snprintf(buf + n, size - n, " tag=%u fid=%u size=%lu",
+        rec->u.req.tag, (unsigned int)rec->u.req.fid,
+        (unsigned long)rec->u.req.size);
+    if (rec->u.req.err)
+        n += snprintf(buf + n, size - n, " err=%s", strerror(rec->u.req.err));
+    n += snprintf(buf + n, size - n, " %luus\n", rec->u.req.us);
+
+    return n;
+}
+
+void
+unpfs_log_request(uint8_t type, uint16_t tag, uint32_t fid, uint32_t size,
+                  int err, uint64_t start)
+{
+    struct log_record *rec, stack_rec;
+    char buf[LOG_TEXT_SIZE];
+
+    if (unpfs_log_pri > LOG_NOTICE)
+        return;
+
+    if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+        rec = &stack_rec;
+    else if (!(rec = claim()))
+        return;
+
+    rec->kind = RECORD_REQUEST;
+    rec->pri = LOG_NOTICE;
+    rec->u.req.type = type;
+    rec->u.req.tag = tag;
+    rec->u.req.fid = fid;
+    rec->u.req.size = size;
+    rec->u.req.err = err;
+    rec->u.req.us = (unpfs_stats_now() - start) / 1000;
 
-        va_end(ap);
+    if (rec == &stack_rec) {
+        format_record(buf, sizeof buf, rec);
+        fputs(buf, stderr);
+    } else {
+        commit(rec);
     }
 }
 
+/* Formats whatever the ring holds, 0 if it was empty */
+static size_t
+drain(char *buf)
+{
+    struct log_record *rec;
+    size_t n = 0, total = 0;
+    unsigned long dropped;
+
+    for (;;) {
+        rec = &logger.ring[logger.head & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != logger.head + 1)
+            break;
+
+        n += format_record(buf + n, LOG_BATCH_SIZE - n, rec);
+        __atomic_store_n(&rec->seq, logger.head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        ++logger.head;
+        ++total;
+
+        if (n > LOG_BATCH_SIZE - 2 * LOG_TEXT_SIZE) {
+            fwrite(buf, 1, n, stderr);
+            n = 0;
+        }
+    }
+
+    dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        n += snprintf(buf + n, LOG_BATCH_SIZE - n,
+            "[%d] log: dropped %lu records\n", LOG_WARNING, dropped);
+
+    if (n) {
+        fwrite(buf, 1, n, stderr);
+        fflush(stderr);
+    }
+
+    return total + dropped;
+}
+
+static void *
+logger_main(void *arg)
+{
+    struct timespec idle = { 0, LOG_IDLE_NS };
+    char *buf = arg;
+
+    while (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        if (!drain(buf))
+            nanosleep(&idle, NULL);
+    }
+    drain(buf);
+
+    return NULL;
+}
+
+int
+unpfs_log_start(void)
+{
+    static char buf[LOG_BATCH_SIZE];
+    unsigned long i;
+    int err;
+
+    logger.ring = calloc(LOG_RING_SIZE, sizeof *logger.ring);
+    if (!logger.ring) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (i = 0; i < LOG_RING_SIZE; ++i)
+        logger.ring[i].seq = i;
+
+    logger.running = 1;
+    err = pthread_create(&logger.thread, NULL, logger_main, buf);
+    if (err) {
+        logger.running = 0;
+        free(logger.ring);
+        logger.ring = NULL;
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Writes out what is left in the ring; logging is synchronous again */
+void
+unpfs_log_stop(void)
+{
+    if (!logger.ring)
+        return;
+
+    __atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+}
+
 void
 unpfs_log_dummy(int pri, const char *fmt, ...)
 {
 }
+
+void
+unpfs_log_request_dummy(uint8_t type, uint16_t tag, uint32_t fid,
+                        uint32_t size, int err, uint64_t start)
+{
+}
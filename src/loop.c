@@ -0,0 +1,291 @@
+#include <unpfs/loop.h>
+#include <unpfs/qos.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+enum {
+    LOOP_MAX_EVENTS = 256,
+    /* Messages read from one connection before others get a turn */
+    LOOP_BATCH = 32
+};
+
+/*
+ * Connections are looked up by fd.  Listeners and non-socket fds are
+ * level-triggered since their handlers consume one event per call;
+ * 9P connections are edge-triggered and read until drained.
+ */
+struct watch {
+    IxpConn *conn;
+    void (*close)(IxpConn *);
+    int edge;
+    int queued;
+    long hold;      /* Timer of a connection held for QoS, 0 if none */
+};
+
+/*
+ * Edge-triggered connections that still had data after LOOP_BATCH
+ * messages go on the backlog and are served again on the next turn.
+ */
+static struct {
+    IxpServer *server;
+    int epfd;
+    struct watch *watches;
+    int nwatches;
+    int *backlog;
+    int nbacklog;
+    int *spare;
+} loop;
+
+static struct watch *
+watch_get(int fd)
+{
+    if (fd >= loop.nwatches) {
+        int i, n = loop.nwatches ? loop.nwatches : 64;
+
+        while (n <= fd)
+            n *= 2;
+
+        loop.watches = ixp_erealloc(loop.watches, n * sizeof *loop.watches);
+        loop.backlog = ixp_erealloc(loop.backlog, n * sizeof *loop.backlog);
+        loop.spare = ixp_erealloc(loop.spare, n * sizeof *loop.spare);
+        for (i = loop.nwatches; i < n; ++i) {
+            loop.watches[i].conn = NULL;
+            loop.watches[i].close = NULL;
+            loop.watches[i].edge = 0;
+            loop.watches[i].queued = 0;
+            loop.watches[i].hold = 0;
+        }
+        loop.nwatches = n;
+    }
+
+    return &loop.watches[fd];
+}
+
+static void
+loop_close(IxpConn *c)
+{
+    struct watch *w = watch_get(c->fd);
+    void (*close_fn)(IxpConn *) = w->close;
+
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    if (w->edge && unpfs_qos_enabled())
+        unpfs_qos_close(c);
+    if (w->hold)
+        ixp_unsettimer(loop.server, w->hold);
+    w->conn = NULL;
+    w->close = NULL;
+    w->queued = 0;
+    w->hold = 0;
+
+    /* ixp_hangup() only shuts the socket down if there was no handler */
+    if (close_fn)
+        close_fn(c);
+    else
+        shutdown(c->fd, SHUT_RDWR);
+}
+
+static int
+is_stream_peer(int fd)
+{
+    int listening = 0;
+    socklen_t length = sizeof listening;
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) < 0)
+        return 0;
+
+    return !listening;
+}
+
+static int
+watch_add(IxpConn *c)
+{
+    struct epoll_event ev;
+    struct watch *w = watch_get(c->fd);
+
+    w->edge = is_stream_peer(c->fd);
+    ev.events = EPOLLIN | (w->edge ? EPOLLET : 0);
+    ev.data.fd = c->fd;
+
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        unpfs_log(LOG_ERR, "%s: epoll_ctl: fd=%d: %s\n",
+            __func__, c->fd, strerror(errno));
+        return -1;
+    }
+
+    w->conn = c;
+    w->close = c->close;
+    c->close = loop_close;
+
+    return 0;
+}
+
+/*
+ * ixp_listen() pushes new connections on the head of server->conn, so
+ * only the leading connections that are not watched yet need a look.
+ */
+static void
+watch_new_conns(IxpServer *server)
+{
+    IxpConn *c, *next;
+
+    for (c = server->conn; c; c = next) {
+        next = c->next;
+
+        if (c->fd < loop.nwatches && loop.watches[c->fd].conn == c)
+            break;
+
+        if (watch_add(c) < 0)
+            ixp_hangup(c);
+    }
+}
+
+/* Whether a read would not block; EOF counts so the handler sees it */
+static int
+is_readable(int fd)
+{
+    char b;
+    ssize_t n = recv(fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+}
+
+static void
+backlog_push(int fd)
+{
+    if (!loop.watches[fd].queued) {
+        loop.watches[fd].queued = 1;
+        loop.backlog[loop.nbacklog++] = fd;
+    }
+}
+
+static void
+hold_done(long id, void *aux)
+{
+    int fd = (int)(intptr_t)aux;
+
+    /* The connection may be gone, and its descriptor reused */
+    if (loop.watches[fd].hold != id)
+        return;
+
+    loop.watches[fd].hold = 0;
+    backlog_push(fd);
+}
+
+/* Whether the next message of fd is to wait for its client's allowance */
+static int
+hold(int fd)
+{
+    long ms;
+
+    if (!unpfs_qos_enabled() || !(ms = unpfs_qos_admit(loop.watches[fd].conn)))
+        return 0;
+
+    loop.watches[fd].hold =
+        ixp_settimer(loop.server, ms, hold_done, (void *)(intptr_t)fd);
+
+    return 1;
+}
+
+static void
+serve_edge(int fd, int check_first)
+{
+    int i = 0;
+    IxpConn *c = loop.watches[fd].conn;
+
+    if (check_first && !is_readable(fd))
+        return;
+
+    for (;;) {
+        if (hold(fd))
+            return;
+
+        c->read(c);
+
+        /* The handler may have hung the connection up */
+        if (loop.watches[fd].conn != c || !is_readable(fd))
+            return;
+
+        if (++i == LOOP_BATCH)
+            break;
+    }
+
+    /* Not drained yet: nothing more comes from epoll for it */
+    backlog_push(fd);
+}
+
+static void
+serve_fd(int fd, int from_backlog)
+{
+    struct watch *w = &loop.watches[fd];
+
+    /* A held connection is read again once its timer has fired */
+    if (!w->conn || w->hold)
+        return;
+
+    if (w->edge)
+        serve_edge(fd, from_backlog);
+    else if (!from_backlog)
+        w->conn->read(w->conn);
+}
+
+int
+unpfs_serverloop(IxpServer *server)
+{
+    int i, n, timeout, nready, *ready;
+    long next_timer;
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    loop.epfd = epoll_create(LOOP_MAX_EVENTS);
+    if (loop.epfd < 0) {
+        unpfs_log(LOG_ERR, "%s: epoll_create: %s\n", __func__, strerror(errno));
+        return 1;
+    }
+
+    loop.server = server;
+    server->running = 1;
+    ixp_thread->initmutex(&server->lk);
+    watch_new_conns(server);
+
+    while (server->running) {
+        /* Before the timers, so that any it sets are waited for */
+        if (server->preselect)
+            server->preselect(server);
+
+        if (!server->running)
+            break;
+
+        next_timer = ixp_nexttimer(server);
+
+        timeout = loop.nbacklog ? 0 : (next_timer > 0 ? (int)next_timer : -1);
+        n = epoll_wait(loop.epfd, events, LOOP_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            unpfs_log(LOG_ERR, "%s: epoll_wait: %s\n", __func__, strerror(errno));
+            return 1;
+        }
+
+        /* Take this turn's backlog; the next one fills the spare array */
+        ready = loop.backlog;
+        nready = loop.nbacklog;
+        loop.backlog = loop.spare;
+        loop.nbacklog = 0;
+        loop.spare = ready;
+
+        for (i = 0; i < n; ++i)
+            serve_fd(events[i].data.fd, 0);
+
+        for (i = 0; i < nready; ++i) {
+            loop.watches[ready[i]].queued = 0;
+            serve_fd(ready[i], 1);
+        }
+
+        watch_new_conns(server);
+    }
+
+    return 0;
+}
@@ -3,6 +3,16 @@
 #include <unpfs/fid.h>
 #include <unpfs/log.h>
 #include <unpfs/posix.h>
+#include <unpfs/worker.h>
+#include <unpfs/buf.h>
+#include <unpfs/splice.h>
+#include <unpfs/dcache.h>
+#include <unpfs/stats.h>
+#include <unpfs/sync.h>
+#include <unpfs/arena.h>
+#include <unpfs/fdcache.h>
+#include <unpfs/ccache.h>
+#include <unpfs/inflight.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -40,131 +50,412 @@ get_real_path(const char *path)
     return real_path;
 }
 
+char *
+unpfs_path_join(const char *dir, const char *name)
+{
+    const char *prefix = strcmp(dir, "/") ? dir : "";
+    size_t length = strlen(prefix) + 1 + strlen(name) + 1;
+    char *path = zalloc(length);
+
+    snprintf(path, length, "%s/%s", prefix, name);
+
+    return path;
+}
+
+void
+unpfs_discard_reply(Ixp9Req *r)
+{
+    switch (r->ifcall.hdr.type) {
+    case P9_TRead:
+        unpfs_buf_free(r->ofcall.rread.data);
+        r->ofcall.rread.data = NULL;
+        break;
+    case P9_TStat:
+        zfree((char **)&r->ofcall.rstat.stat);
+        break;
+    }
+}
+
+/*
+ * ixp_respond() free(3)s the Rread payload once it has sent it, so a pool
+ * buffer is handed over to it, and a mapping or a pipe is copied into a
+ * buffer of its own first.  Mapped pages were faulted in when they were
+ * read, which unpfs_fmap_read() fails rather than risk SIGBUS here.
+ */
 static void
-respond(Ixp9Req *r, int err)
+respond_read(Ixp9Req *r)
+{
+    char *data = r->ofcall.rread.data;
+    uint32_t count = r->ofcall.rread.count;
+    ssize_t n;
+
+    unpfs_stats_bytes(P9_TRead, count);
+
+    if (!count || !data) {
+        unpfs_buf_free(data);
+        r->ofcall.rread.data = NULL;
+        r->ofcall.rread.count = 0;
+    } else if (!unpfs_buf_detach(data)) {
+        r->ofcall.rread.data = ixp_emalloc(count);
+        if (unpfs_splice_is_pipe(data)) {
+            n = unpfs_splice_copy(data, r->ofcall.rread.data);
+            r->ofcall.rread.count = n < 0 ? 0 : n;
+        } else {
+            memcpy(r->ofcall.rread.data, data, count);
+        }
+        unpfs_buf_free(data);
+    }
+
+    ixp_respond(r, NULL);
+}
+
+void
+unpfs_respond(Ixp9Req *r, int err)
 {
     const char *msg = NULL;
     static char buf[ERRNO_MSG_BUF_LENGTH];
 
+    if (!err && r->ifcall.hdr.type == P9_TRead) {
+        respond_read(r);
+        return;
+    }
+
     if (err) {
+        unpfs_discard_reply(r);
+
         if (strerror_r(err, buf, sizeof buf) < 0)
             msg = "Input/output error";
         else
             msg = buf;
-
-        unpfs_log(LOG_ERR, "respond: type=%u tag=%u fid=%u: %s\n",
-            r->ifcall.hdr.type,
-            r->ifcall.hdr.tag,
-            r->ifcall.hdr.fid, msg);
     }
 
     ixp_respond(r, msg);
 }
 
+static void
+respond(Ixp9Req *r, int err, uint64_t start)
+{
+    uint8_t type = r->ifcall.hdr.type;
+    uint32_t size = 0;
+
+    if (!err && type == P9_TRead)
+        size = r->ofcall.rread.count;
+    else if (!err && type == P9_TWrite)
+        size = r->ofcall.rwrite.count;
+
+    unpfs_stats_record(type, err, start);
+    if (!err && type == P9_TWrite)
+        unpfs_stats_bytes(P9_TWrite, size);
+    unpfs_log_request(type, r->ifcall.hdr.tag, r->ifcall.hdr.fid, size, err, start);
+    unpfs_arena_reset();
+
+    /* Requests executed by a worker are answered by the server loop */
+    if (r->aux) {
+        unpfs_worker_done(r, err);
+        return;
+    }
+
+    unpfs_respond(r, err);
+}
+
 /*
- *
- * 9P2000 operations
- *
+ * Fid operations shared by the 9P2000 and 9P2000.L servers
  */
+struct unpfs_fid *
+unpfs_fid_root(struct stat *stbuf)
+{
+    struct unpfs_fid *fid;
+    int err, fd = unpfs_open_path(AT_FDCWD, ctx.root, O_DIRECTORY);
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, stbuf) < 0) {
+        err = errno;
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+
+    fid = unpfs_fid_new("/", P9_QTDIR);
+    fid->dirfd = AT_FDCWD;
+    fid->pathfd = fd;
+
+    return fid;
+}
 
 /*
- * Session Management
+ * Open the fid a walk of rel from the directory base arrives at: its
+ * parent directory, then the last name in that.
  */
-void
-unpfs_attach(Ixp9Req *r)
+static int
+walk_bind(struct unpfs_fid *fid, int base, char *rel)
 {
-    int ret = 0;
-    struct stat stbuf;
+    char *last = strrchr(rel, '/');
 
-    if (lstat(ctx.root, &stbuf) < 0) {
-        ret = errno;
+    if (!last) {
+        fid->dirfd = fcntl(base, F_DUPFD_CLOEXEC, 0);
+        last = rel;
     } else {
-        struct unpfs_fid *fid;
-
-        r->fid->qid.type = P9_QTDIR;
-        r->fid->qid.version = 0;
-        r->fid->qid.path = stbuf.st_ino;
-        r->ofcall.rattach.qid = r->fid->qid;
+        *last = '\0';
+        fid->dirfd = unpfs_open_path(base, rel, O_DIRECTORY);
+        *last++ = '/';
+    }
 
-        fid = unpfs_fid_new("/", r->fid->qid.type);
-        r->fid->aux = fid;
+    if (fid->dirfd < 0)
+        return -1;
 
-        unpfs_log(LOG_NOTICE, "%s: New 9P client: uname=%s aname=%s\n",
-            __func__, r->ifcall.tattach.uname, r->ifcall.tattach.aname);
-    }
+    fid->pathfd = unpfs_open_path(fid->dirfd, last, O_NOFOLLOW);
 
-    respond(r, ret);
+    return fid->pathfd >= 0 ? 0 : -1;
 }
 
-void
-unpfs_walk(Ixp9Req *r)
+int
+unpfs_fid_walk(struct unpfs_fid *fid, unsigned int nwname, char **wname,
+               IxpQid *wqid, struct unpfs_fid **newfid)
 {
     off_t offset;
-    int ret = 0, i = 0;
-    char *path = zalloc(PATH_MAX), *real_path = NULL;
-    struct unpfs_fid *fid = r->fid->aux;
+    unsigned int i = 0;
+    int ret, cacheable = 1, synthetic = 0;
+    char *path = unpfs_arena_alloc(PATH_MAX), *rel;
+
+    *newfid = NULL;
+    if (!path)
+        return 0;
 
     snprintf(path, PATH_MAX, "%s", (!strcmp(fid->path, "/") ? "" : fid->path));
 
-    for (offset = strlen(path); i < r->ifcall.twalk.nwname; ++i) {
+    /* Names are resolved from fid's directory, never from the root */
+    offset = strlen(path);
+    rel = path + offset + 1;
+
+    unpfs_dcache_sync();
+
+    for (; i < nwname; ++i) {
         struct stat stbuf;
         int count =
-            snprintf(path + offset, PATH_MAX - offset,
-                "/%s", r->ifcall.twalk.wname[i]);
+            snprintf(path + offset, PATH_MAX - offset, "/%s", wname[i]);
 
-        if (count < 0) {
-            ret = errno;
+        if (count < 0)
+            goto out;
+        if (count >= PATH_MAX - offset) {
+            errno = ENAMETOOLONG;
             goto out;
         }
 
         offset += count;
-        real_path = get_real_path(path);
 
-        if (lstat(real_path, &stbuf) < 0) {
-            ret = errno;
+        /* The statistics files shadow whatever the export has there */
+        ret = unpfs_stats_lookup(path, &stbuf);
+        synthetic = ret == 0;
+        if (ret > 0) {
+            errno = ret;
             goto out;
-        } else {
-            r->ofcall.rwalk.wqid[i].type = stbuf.st_mode & S_IFMT;
-            if (S_ISDIR(stbuf.st_mode))
-                r->ofcall.rwalk.wqid[i].type |= P9_QTDIR;
-            r->ofcall.rwalk.wqid[i].version = 0;
-            r->ofcall.rwalk.wqid[i].path = stbuf.st_ino;
-            zfree(&real_path);
         }
+        if (ret == 0) {
+            qid_posix_to_9p(&wqid[i], &stbuf);
+            continue;
+        }
+
+        /* Paths through .. have more than one name */
+        if (!strcmp(wname[i], ".."))
+            cacheable = 0;
+
+        ret = cacheable ? unpfs_dcache_lookup(path, &wqid[i]) : -1;
+        if (ret > 0) {
+            errno = ret;
+            goto out;
+        }
+        if (ret == 0)
+            continue;
+
+        if (fstatat(fid->pathfd, rel, &stbuf, AT_SYMLINK_NOFOLLOW) < 0) {
+            if (cacheable)
+                unpfs_dcache_insert(path, NULL, errno);
+            goto out;
+        }
+
+        qid_posix_to_9p(&wqid[i], &stbuf);
+        if (cacheable)
+            unpfs_dcache_insert(path, &wqid[i], 0);
+    }
+
+    if (!nwname) {
+        *newfid = unpfs_fid_clone(fid);
+    } else if (synthetic) {
+        *newfid = unpfs_stats_fid(path);
+    } else {
+        *newfid = unpfs_fid_new(path, wqid[i - 1].type);
+        if (walk_bind(*newfid, fid->pathfd, rel) < 0) {
+            ret = errno;
+            unpfs_fid_destroy(*newfid);
+            *newfid = NULL;
+            errno = ret;
+        }
+    }
+
+out:
+    return i;
+}
+
+int
+unpfs_fid_create(struct unpfs_fid *fid, const char *name, uint8_t type,
+                 int flags, mode_t mode, struct stat *stbuf)
+{
+    int ret, err;
+    struct unpfs_fid parent = *fid;
+    char *new_path = unpfs_path_join(fid->path, name);
+
+    /* The directory fid becomes the new file, created relative to it */
+    fid->path = new_path;
+    fid->real_path = get_real_path(new_path);
+    fid->dirfd = parent.pathfd;
+    fid->pathfd = -1;
+    fid->priv = NULL;
+    fid->type = type;
+    fid->handler =
+        (fid->type & P9_QTDIR ?
+            &dir_handler :
+            file_backend);
+
+    ret = fid->handler->open(fid, flags, mode);
+    unpfs_dcache_invalidate(new_path);
+    if (ret == 0) {
+        fid->pathfd = unpfs_open_path(fid->dirfd, name, O_NOFOLLOW);
+        if (fid->pathfd < 0 || fstat(fid->pathfd, stbuf) < 0)
+            ret = -1;
+    }
+
+    if (ret < 0) {
+        err = errno;
+        if (fid->priv)
+            fid->handler->close(fid);
+        if (fid->pathfd >= 0)
+            close(fid->pathfd);
+        zfree(&fid->path);
+        zfree(&fid->real_path);
+        *fid = parent;
+        errno = err;
+        return -1;
+    }
+
+    if (parent.dirfd >= 0)
+        close(parent.dirfd);
+    zfree(&parent.path);
+    zfree(&parent.real_path);
+
+    return 0;
+}
+
+/*
+ *
+ * 9P2000 operations
+ *
+ */
+
+/*
+ * Session Management
+ */
+void
+unpfs_attach(Ixp9Req *r)
+{
+    uint64_t start = unpfs_stats_now();
+    int ret = 0;
+    struct stat stbuf;
+    struct unpfs_fid *fid = unpfs_fid_root(&stbuf);
+
+    if (!fid) {
+        ret = errno;
+    } else {
+        qid_posix_to_9p(&r->fid->qid, &stbuf);
+        r->ofcall.rattach.qid = r->fid->qid;
+        r->fid->aux = fid;
+
+        unpfs_log(LOG_NOTICE, "%s: New 9P client: uname=%s aname=%s\n",
+            __func__, r->ifcall.tattach.uname, r->ifcall.tattach.aname);
     }
 
+    respond(r, ret, start);
+}
+
+void
+unpfs_walk(Ixp9Req *r)
+{
+    uint64_t start = unpfs_stats_now();
+    int ret = 0, n;
+    struct unpfs_fid *fid = r->fid->aux, *newfid = NULL;
+
     if (r->fid->fid == r->newfid->fid) {
         unpfs_log(LOG_INFO, "%s: fid and newfid equals: fid=%u newfid=%u\n",
             __func__, r->fid->fid, r->newfid->fid);
     }
 
-    r->newfid->aux = r->ifcall.twalk.nwname ?
-        unpfs_fid_new(path, r->ofcall.rwalk.wqid[i - 1].type) :
-        unpfs_fid_clone(fid);
+    n = unpfs_fid_walk(fid, r->ifcall.twalk.nwname, r->ifcall.twalk.wname,
+        r->ofcall.rwalk.wqid, &newfid);
+    if (!newfid) {
+        ret = errno;
+        goto out;
+    }
+
+    /* A fid walked onto itself is replaced */
+    if (r->newfid == r->fid)
+        unpfs_fid_destroy(fid);
+    r->newfid->aux = newfid;
 
     unpfs_log(LOG_INFO, "%s: newfid: fid=%u fid->path=%s fid->real_path=%s\n",
-        __func__,
-        r->newfid->fid,
-        ((struct unpfs_fid *)(r->newfid->aux))->path,
-        ((struct unpfs_fid *)(r->newfid->aux))->real_path);
+        __func__, r->newfid->fid, newfid->path, newfid->real_path);
 
-    r->ofcall.rwalk.nwqid = i;
+    r->ofcall.rwalk.nwqid = n;
 
 out:
-    zfree(&path);
-    zfree(&real_path);
-    respond(r, ret);
+    respond(r, ret, start);
+}
+
+/*
+ * Requests waiting for asynchronous I/O are kept in flight.  Flushing
+ * one cancels its I/O, but the Tflush is still answered only once the
+ * I/O has completed, since the buffers are in use until then.
+ */
+static int
+async_cancel(Ixp9Req *r, void *arg)
+{
+    unpfs_uring_cancel(r);
+
+    return 1;
+}
+
+static void
+async_begin(Ixp9Req *r, uint64_t start)
+{
+    unpfs_inflight_begin(r, start, async_cancel, NULL);
+}
+
+static void
+async_flushed(Ixp9Req *flush)
+{
+    Ixp9Req *next;
+
+    for (; flush; flush = next) {
+        next = flush->aux;
+        flush->aux = NULL;
+        unpfs_flush(flush);
+    }
 }
 
 void
 unpfs_flush(Ixp9Req *r)
 {
-    struct unpfs_fid *fid = r->fid->aux;
+    uint64_t start = unpfs_stats_now();
 
-    unpfs_log(LOG_INFO, "%s: fid=%u real_path=%s\n",
-        __func__, r->fid->fid, fid->real_path);
+    /* Tflush carries no fid */
+    unpfs_log(LOG_INFO, "%s: oldtag=%u\n",
+        __func__, r->ifcall.tflush.oldtag);
+
+    /* Answered once the flushed request has ended, unless cancelled now */
+    if (unpfs_inflight_flush(r))
+        return;
 
-    respond(r, 0);
+    respond(r, 0, start);
 }
 
 
@@ -174,80 +465,132 @@ unpfs_flush(Ixp9Req *r)
 void
 unpfs_open(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     int flags = 0;
+    struct stat stbuf;
     struct unpfs_fid *fid = r->fid->aux;
 
-    unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s\n",
-        __func__, r->fid->fid, fid->real_path);
-
     flags = open_mode_9p_to_posix(r->ifcall.topen.mode);
 
-    ret = fid->handler->open(fid, NULL, flags, 0);
-    if (ret < 0)
+    ret = fid->handler->open(fid, flags, 0);
+    if (ret < 0) {
         ret = errno;
+    } else if (unpfs_fid_stat(fid, &stbuf) == 0) {
+        /* The version may have moved on since the walk */
+        qid_posix_to_9p(&r->fid->qid, &stbuf);
+        r->ofcall.ropen.qid = r->fid->qid;
+    }
+    r->ofcall.ropen.iounit = UNPFS_IOUNIT;
 
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 void
 unpfs_create(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     struct stat stbuf;
     struct unpfs_fid *fid = r->fid->aux;
-    char *new_real_path = zalloc(PATH_MAX);
     mode_t mode = perm_9p_to_posix(r->ifcall.tcreate.perm);
     int flags = open_mode_9p_to_posix(r->ifcall.topen.mode) | O_CREAT;
 
     unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s\n",
         __func__, r->fid->fid, fid->real_path);
 
-    snprintf(new_real_path, PATH_MAX, "%s/%s",
-        (!strcmp(fid->real_path, "/") ? "" : fid->real_path),
-        r->ifcall.tcreate.name);
-
-    zfree(&fid->path);
-    zfree(&fid->real_path);
-    fid->path = strdup(new_real_path + strlen(ctx.root));
-    fid->real_path = strdup(new_real_path);
-    fid->type = (r->ifcall.tcreate.perm & P9_DMDIR ? P9_QTDIR : P9_QTFILE);
-    fid->handler =
-        (fid->type & P9_QTDIR ?
-            &dir_handler :
-            &file_handler);
-
-    ret = fid->handler->open(fid, new_real_path, flags, mode);
+    ret = unpfs_fid_create(fid, r->ifcall.tcreate.name,
+        (r->ifcall.tcreate.perm & P9_DMDIR ? P9_QTDIR : P9_QTFILE),
+        flags, mode, &stbuf);
     if (ret < 0) {
         ret = errno;
         goto out;
     }
 
-    if (lstat(new_real_path, &stbuf) < 0) {
-        ret = errno;
+    qid_posix_to_9p(&r->fid->qid, &stbuf);
+    r->ofcall.rcreate.qid = r->fid->qid;
+    r->ofcall.rcreate.iounit = UNPFS_IOUNIT;
+
+out:
+    respond(r, ret, start);
+}
+
+static void
+read_done(void *arg, ssize_t count)
+{
+    Ixp9Req *r = arg, *flush;
+    uint64_t start;
+
+    flush = unpfs_inflight_end(r, &start);
+
+    if (flush) {
+        unpfs_discard_reply(r);
+        async_flushed(flush);
+    } else if (count < 0) {
+        respond(r, -count, start);
     } else {
-        r->fid->qid.type = fid->type;
-        r->fid->qid.version = 0;
-        r->fid->qid.path = stbuf.st_ino;
+        r->ofcall.rread.count = count;
+        respond(r, 0, start);
     }
+}
 
-out:
-    zfree(&new_real_path);
-    respond(r, ret);
+static void
+write_done(void *arg, ssize_t count)
+{
+    Ixp9Req *r = arg, *flush;
+    uint64_t start;
+
+    flush = unpfs_inflight_end(r, &start);
+
+    if (flush) {
+        async_flushed(flush);
+    } else if (count < 0) {
+        respond(r, -count, start);
+    } else {
+        r->ofcall.rwrite.count = count;
+        respond(r, 0, start);
+    }
 }
 
 void
 unpfs_read(Ixp9Req *r)
 {
-    int ret = 0;
+    uint64_t start = unpfs_stats_now();
+    int fd, ret = 0;
     ssize_t count;
     struct unpfs_fid *fid = r->fid->aux;
 
-    unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s count=%d offset=%lu\n",
-        __func__, r->fid->fid,
-        fid->real_path,
-        r->ifcall.twrite.count,
-        r->ifcall.twrite.offset);
+    /* Never more than fits the negotiated message size */
+    if (r->ifcall.tread.count > UNPFS_IOUNIT)
+        r->ifcall.tread.count = UNPFS_IOUNIT;
+
+    /* Asynchronous I/O is only started from the server loop */
+    if (fid->handler->aread && !r->aux) {
+        async_begin(r, start);
+        if (fid->handler->aread(fid, &r->ofcall.rread.data,
+                r->ifcall.tread.count, r->ifcall.tread.offset, read_done, r) == 0)
+            return;
+        unpfs_inflight_end(r, NULL);
+    }
+
+    /*
+     * The file is spliced into a pipe here, which libixp's copy of the
+     * Rread is read from; files that cannot be spliced are read as usual
+     */
+    if (ctx.zerocopy && (fd = unpfs_fid_fd(fid)) >= 0) {
+        if (unpfs_fid_flush(fid) < 0) {
+            respond(r, errno, start);
+            return;
+        }
+        count = unpfs_splice_fill(fd, r->ifcall.tread.offset,
+            r->ifcall.tread.count, &r->ofcall.rread.data);
+        if (count >= 0) {
+            unpfs_fid_readahead(fid, r->ifcall.tread.count, r->ifcall.tread.offset);
+            r->ofcall.rread.count = count;
+            respond(r, 0, start);
+            return;
+        }
+    }
 
     count = fid->handler->read(
         fid,
@@ -261,21 +604,24 @@ unpfs_read(Ixp9Req *r)
     else
         r->ofcall.rread.count = count;
 
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 void
 unpfs_write(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     ssize_t count;
     struct unpfs_fid *fid = r->fid->aux;
 
-    unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s count=%d offset=%lu\n",
-        __func__, r->fid->fid,
-        fid->real_path,
-        r->ifcall.twrite.count,
-        r->ifcall.twrite.offset);
+    if (fid->handler->awrite && !r->aux) {
+        async_begin(r, start);
+        if (fid->handler->awrite(fid, r->ifcall.twrite.data,
+                r->ifcall.twrite.count, r->ifcall.twrite.offset, write_done, r) == 0)
+            return;
+        unpfs_inflight_end(r, NULL);
+    }
 
     count = fid->handler->write(
         fid,
@@ -289,12 +635,13 @@ unpfs_write(Ixp9Req *r)
     else
         r->ofcall.rwrite.count = count;
 
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 void
 unpfs_remove(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     struct unpfs_fid *fid = r->fid->aux;
 
@@ -304,23 +651,24 @@ unpfs_remove(Ixp9Req *r)
     ret = fid->handler->remove(fid);
     if (ret < 0)
         ret = errno;
+    else
+        unpfs_dcache_invalidate(fid->path);
 
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 void
 unpfs_clunk(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     struct unpfs_fid *fid = r->fid->aux;
+    int ret = 0;
 
-    if (fid && fid->handler) {
-        unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s\n",
-            __func__, r->fid->fid, fid->real_path);
-
-        fid->handler->close(fid);
-    }
+    /* The fid is gone either way, but a failed deferred write is reported */
+    if (fid && fid->handler && fid->handler->close(fid) < 0)
+        ret = errno;
 
-    respond(r, 0);
+    respond(r, ret, start);
 }
 
 
@@ -330,6 +678,7 @@ unpfs_clunk(Ixp9Req *r)
 void
 unpfs_stat(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     struct stat stbuf;
     struct unpfs_fid *fid = r->fid->aux;
@@ -338,10 +687,7 @@ unpfs_stat(Ixp9Req *r)
     struct IxpStat s;
     char *buf, *name = strdup(fid->path);
 
-    unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s\n",
-        __func__, r->fid->fid, fid->real_path);
-
-    if (!name || lstat(fid->real_path, &stbuf) < 0) {
+    if (!name || unpfs_fid_stat(fid, &stbuf) < 0) {
         ret = errno;
         goto out;
     }
@@ -360,15 +706,15 @@ unpfs_stat(Ixp9Req *r)
     r->ofcall.rstat.stat = (uint8_t *)m.data;
 
 out:
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 static int
 unpfs_rename(struct unpfs_fid *fid, IxpStat *stat)
 {
     int ret = 0, count;
-    char new_real_path[PATH_MAX];
-    char *real_parent = NULL;
+    char new_real_path[PATH_MAX], new_path[PATH_MAX];
+    char *real_parent = NULL, *parent = NULL, *dir;
 
     /* No need to name */
     if (!strlen(stat->name))
@@ -393,14 +739,32 @@ unpfs_rename(struct unpfs_fid *fid, IxpStat *stat)
     if (!strcmp(fid->real_path, new_real_path))
         goto out;
 
-    if (rename(fid->real_path, new_real_path) < 0) {
+    unpfs_fdcache_invalidate(fid->dirfd,
+        fid->dirfd == AT_FDCWD ? new_real_path : stat->name);
+    if (renameat(fid->dirfd, unpfs_fid_name(fid), fid->dirfd,
+            fid->dirfd == AT_FDCWD ? new_real_path : stat->name) < 0) {
         ret = -1;
         goto out;
     }
 
+    /* The old name and whatever was replaced at the new one */
+    unpfs_dcache_invalidate(fid->path);
+    zfree(&fid->real_path);
     fid->real_path = strdup(new_real_path);
 
+    if (!(parent = strdup(fid->path)))
+        goto out;
+    dir = dirname(parent);
+    count = snprintf(new_path, sizeof new_path, "%s/%s",
+        (!strcmp(dir, "/") ? "" : dir), stat->name);
+    if (count > 0) {
+        zfree(&fid->path);
+        fid->path = strdup(new_path);
+        unpfs_dcache_invalidate(new_path);
+    }
+
 out:
+    zfree(&parent);
     zfree(&real_parent);
     return ret;
 }
@@ -408,7 +772,7 @@ out:
 static int 
 unpfs_utimes(struct unpfs_fid *fid, IxpStat *stat)
 {
-    struct timeval times[2];
+    struct timespec times[2];
 
     if (stat->atime == UINT32_MAX || stat->mtime == UINT32_MAX)
         return 0;
@@ -418,14 +782,31 @@ unpfs_utimes(struct unpfs_fid *fid, IxpStat *stat)
     times[0].tv_sec = stat->atime;
     times[1].tv_sec = stat->mtime;
 
-    return utimes(fid->real_path, times);
+    return utimensat(fid->dirfd, unpfs_fid_name(fid), times, 0);
 }
 
 static int
 unpfs_truncate(struct unpfs_fid *fid, IxpStat *stat)
 {
-    return stat->length == UINT64_MAX ?
-        0 : truncate(fid->real_path, stat->length);
+    int fd, ret;
+
+    if (stat->length == UINT64_MAX)
+        return 0;
+
+    fd = openat(fid->dirfd, unpfs_fid_name(fid), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ret = ftruncate(fd, stat->length);
+    if (ret < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return ret;
+    }
+    unpfs_ccache_invalidate(fid->dirfd, unpfs_fid_name(fid));
+
+    return close(fd);
 }
 
 static int
@@ -445,6 +826,7 @@ stat_is_sync_request(const struct IxpStat *stat)
 void
 unpfs_wstat(Ixp9Req *r)
 {
+    uint64_t start = unpfs_stats_now();
     int ret = 0;
     struct stat stbuf;
     struct unpfs_fid *fid = r->fid->aux;
@@ -453,9 +835,14 @@ unpfs_wstat(Ixp9Req *r)
     unpfs_log(LOG_NOTICE, "%s: fid=%u real_path=%s stat->name=%s\n",
         __func__, r->fid->fid, fid->real_path, stat->name);
 
+    if (unpfs_fid_flush(fid) < 0) {
+        ret = errno;
+        goto out;
+    }
+
     if (stat_is_sync_request(stat)) {
-        unpfs_log(LOG_INFO, "%s: syncing...\n", __func__);
-        sync();
+        if (unpfs_sync_fid(fid, 0) < 0)
+            ret = errno;
         goto out;
     }
 
@@ -464,7 +851,7 @@ unpfs_wstat(Ixp9Req *r)
         goto out;
     }
 
-    if (lstat(fid->real_path, &stbuf) < 0) {
+    if (unpfs_fid_stat(fid, &stbuf) < 0) {
         ret = errno;
         goto out;
     }
@@ -479,8 +866,10 @@ unpfs_wstat(Ixp9Req *r)
         goto out;
     }
 
+    unpfs_dcache_invalidate(fid->path);
+
 out:
-    respond(r, ret);
+    respond(r, ret, start);
 }
 
 void
@@ -1,22 +1,40 @@
 
 #include <unpfs/posix.h>
+#include <unpfs/dotl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 
+/* Changes whenever the data or the inode does, to nanosecond resolution */
+static uint32_t
+qid_version(const struct stat *buf)
+{
+    uint64_t m = (uint64_t)buf->st_mtim.tv_sec * 1000000000 + buf->st_mtim.tv_nsec;
+    uint64_t c = (uint64_t)buf->st_ctim.tv_sec * 1000000000 + buf->st_ctim.tv_nsec;
+    uint64_t v = m ^ (c * 0x9e3779b9);
+
+    return (uint32_t)(v ^ (v >> 32));
+}
+
+void
+qid_posix_to_9p(IxpQid *qid, const struct stat *buf)
+{
+    qid->type = buf->st_mode & S_IFMT;
+    if (S_ISDIR(buf->st_mode))
+        qid->type |= P9_QTDIR;
+    qid->path = buf->st_ino;
+    qid->version = qid_version(buf);
+}
+
 void
 stat_posix_to_9p(IxpStat *stat, char *name, struct stat *buf)
 {
     stat->type = 0;
     stat->dev = 0;
-    stat->qid.type = buf->st_mode & S_IFMT;
-    stat->qid.path = buf->st_ino;
-    stat->qid.version = 0;
+    qid_posix_to_9p(&stat->qid, buf);
     stat->mode = buf->st_mode & 0777;
-    if (S_ISDIR(buf->st_mode)) {
+    if (S_ISDIR(buf->st_mode))
         stat->mode |= P9_DMDIR;
-        stat->qid.type |= P9_QTDIR;
-    }
     stat->atime = buf->st_atime;
     stat->mtime = buf->st_mtime;
     stat->length = buf->st_size;
@@ -59,3 +77,26 @@ open_mode_9p_to_posix(uint8_t mode_9p)
 
     return mode_posix;
 }
+
+int
+open_flags_dotl_to_posix(uint32_t flags)
+{
+    unsigned int i = 0;
+    int flags_posix = 0;
+    static const unsigned long flag_map[][2] = {
+        {DOTL_O_WRONLY, O_WRONLY}, {DOTL_O_RDWR, O_RDWR},
+        {DOTL_O_CREAT, O_CREAT}, {DOTL_O_EXCL, O_EXCL},
+        {DOTL_O_TRUNC, O_TRUNC}, {DOTL_O_APPEND, O_APPEND},
+        {DOTL_O_DSYNC, O_DSYNC}, {DOTL_O_DIRECTORY, O_DIRECTORY},
+        {DOTL_O_NOFOLLOW, O_NOFOLLOW}, {DOTL_O_SYNC, O_SYNC}
+    };
+    size_t map_size = (sizeof flag_map) / (sizeof flag_map[0]);
+
+    /* The client's O_NONBLOCK, O_DIRECT and the like stay on its side */
+    for (; i < map_size; ++i) {
+        if (flags & flag_map[i][0])
+            flags_posix |= flag_map[i][1];
+    }
+
+    return flags_posix;
+}
@@ -0,0 +1,299 @@
+#include <unpfs/qos.h>
+#include <unpfs/dotl.h>
+#include <unpfs/stats.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+enum {
+    QOS_CLIENT_BUCKETS = 256,
+    /* size[4] type[1] tag[2] fid[4] offset[8] count[4] of Tread and Treaddir */
+    QOS_PEEK_SIZE = 23,
+    /* Enough of a Tattach for the user name */
+    QOS_ATTACH_PEEK_SIZE = 4 + 1 + 2 + 4 + 4 + 2 + 256
+};
+
+/* Tokens may go below zero; the client is then held until they are back */
+struct bucket {
+    double level;
+    double rate;
+};
+
+/* user is NULL for a client that is a connection of its own */
+struct client {
+    char *user;
+    unsigned int refs;
+    uint64_t refilled;
+    struct bucket ops, bytes, meta;
+    struct client *hnext;
+};
+
+struct qconn {
+    IxpConn *conn;
+    struct client *client;
+};
+
+static struct {
+    struct unpfs_qos_config config;
+    int enabled;
+    /* Server loop only */
+    struct qconn *conns;            /* By descriptor */
+    int nconns;
+    struct client *users[QOS_CLIENT_BUCKETS];
+    struct unpfs_qos_stats stats;
+} qos;
+
+static unsigned int
+user_hash(const char *user)
+{
+    unsigned int h = 5381;
+
+    while (*user)
+        h = h * 33 + (unsigned char)*user++;
+
+    return h % QOS_CLIENT_BUCKETS;
+}
+
+/* NULL if out of memory */
+static struct client *
+client_new(const char *user)
+{
+    struct client *cl = zalloc(sizeof *cl);
+
+    if (user && !(cl->user = strdup(user))) {
+        zfree((char **)&cl);
+        return NULL;
+    }
+    cl->refs = 1;
+    cl->refilled = unpfs_stats_now();
+    cl->ops.rate = cl->ops.level = qos.config.ops;
+    cl->bytes.rate = cl->bytes.level = qos.config.bytes;
+    cl->meta.rate = cl->meta.level = qos.config.meta_ops;
+    __atomic_add_fetch(&qos.stats.clients, 1, __ATOMIC_RELAXED);
+
+    return cl;
+}
+
+static void
+client_put(struct client *cl)
+{
+    struct client **p;
+
+    if (--cl->refs)
+        return;
+
+    if (cl->user) {
+        for (p = &qos.users[user_hash(cl->user)]; *p != cl; p = &(*p)->hnext)
+            ;
+        *p = cl->hnext;
+        free(cl->user);
+    }
+    __atomic_sub_fetch(&qos.stats.clients, 1, __ATOMIC_RELAXED);
+    zfree((char **)&cl);
+}
+
+static struct client *
+client_of_user(const char *user)
+{
+    struct client **head = &qos.users[user_hash(user)], *cl = *head;
+
+    for (; cl; cl = cl->hnext) {
+        if (!strcmp(cl->user, user)) {
+            ++cl->refs;
+            return cl;
+        }
+    }
+
+    cl = client_new(user);
+    if (!cl)
+        return NULL;
+    cl->hnext = *head;
+    *head = cl;
+
+    return cl;
+}
+
+static struct qconn *
+qconn_get(IxpConn *c)
+{
+    struct qconn *qc;
+
+    if (c->fd >= qos.nconns) {
+        int i, n = qos.nconns ? qos.nconns : 64;
+
+        while (n <= c->fd)
+            n *= 2;
+        qos.conns = ixp_erealloc(qos.conns, n * sizeof *qos.conns);
+        for (i = qos.nconns; i < n; ++i) {
+            qos.conns[i].conn = NULL;
+            qos.conns[i].client = NULL;
+        }
+        qos.nconns = n;
+    }
+
+    qc = &qos.conns[c->fd];
+    if (qc->conn != c) {
+        if (qc->client)
+            client_put(qc->client);
+        qc->conn = c;
+        qc->client = client_new(NULL);
+    }
+
+    return qc;
+}
+
+/* Charges the connection to the user its Tattach names from now on */
+static void
+attach(struct qconn *qc)
+{
+    char buf[QOS_ATTACH_PEEK_SIZE + 1];
+    struct client *cl;
+    uint16_t length = 0;
+    IxpMsg m;
+    ssize_t n;
+
+    n = recv(qc->conn->fd, buf, QOS_ATTACH_PEEK_SIZE, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 17)
+        return;
+
+    m = ixp_message(buf + 15, n - 15, MsgUnpack);
+    ixp_pu16(&m, &length);
+    if (m.pos + length > m.end)
+        return;
+    m.pos[length] = '\0';
+
+    if (qc->client->user && !strcmp(qc->client->user, m.pos))
+        return;
+
+    cl = client_of_user(m.pos);
+    if (!cl) {
+        unpfs_log(LOG_WARNING, "%s: out of memory\n", __func__);
+        return;
+    }
+    client_put(qc->client);
+    qc->client = cl;
+}
+
+static void
+refill(struct bucket *b, double seconds)
+{
+    b->level += b->rate * seconds;
+    if (b->level > b->rate)
+        b->level = b->rate;
+}
+
+/* Milliseconds until b is out of debt */
+static long
+wait_ms(const struct bucket *b)
+{
+    if (!b->rate || b->level >= 0)
+        return 0;
+
+    return (long)(-b->level * 1000 / b->rate) + 1;
+}
+
+static void
+take(struct bucket *b, double tokens)
+{
+    if (b->rate)
+        b->level -= tokens;
+}
+
+void
+unpfs_qos_init(const struct unpfs_qos_config *config)
+{
+    qos.config = *config;
+    qos.enabled = config->ops || config->bytes || config->meta_ops;
+}
+
+int
+unpfs_qos_enabled(void)
+{
+    return qos.enabled;
+}
+
+long
+unpfs_qos_admit(IxpConn *c)
+{
+    char buf[QOS_PEEK_SIZE];
+    struct qconn *qc;
+    struct client *cl;
+    uint32_t size = 0, count = 0;
+    uint8_t type = 0;
+    uint64_t now;
+    long ms;
+    IxpMsg m;
+    ssize_t n;
+
+    /* Whatever is not a whole header is left for the read to deal with */
+    n = recv(c->fd, buf, sizeof buf, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 5)
+        return 0;
+
+    m = ixp_message(buf, n, MsgUnpack);
+    ixp_pu32(&m, &size);
+    ixp_pu8(&m, &type);
+
+    qc = qconn_get(c);
+    if (type == P9_TAttach && qos.config.by_user)
+        attach(qc);
+    cl = qc->client;
+
+    now = unpfs_stats_now();
+    refill(&cl->ops, (now - cl->refilled) / 1e9);
+    refill(&cl->bytes, (now - cl->refilled) / 1e9);
+    refill(&cl->meta, (now - cl->refilled) / 1e9);
+    cl->refilled = now;
+
+    switch (type) {
+    case P9_TRead:
+    case DOTL_TREADDIR:
+    case P9_TWrite:
+        ms = wait_ms(&cl->ops);
+        if (wait_ms(&cl->bytes) > ms)
+            ms = wait_ms(&cl->bytes);
+        if (ms)
+            break;
+
+        if (type == P9_TWrite) {
+            count = size > QOS_PEEK_SIZE ? size - QOS_PEEK_SIZE : 0;
+        } else if (n == QOS_PEEK_SIZE) {
+            m.pos += 2 + 4 + 8;
+            ixp_pu32(&m, &count);
+        }
+        take(&cl->ops, 1);
+        take(&cl->bytes, count);
+        break;
+    default:
+        ms = wait_ms(&cl->meta);
+        if (!ms)
+            take(&cl->meta, 1);
+        break;
+    }
+
+    __atomic_add_fetch(ms ? &qos.stats.held : &qos.stats.admitted, 1, __ATOMIC_RELAXED);
+
+    return ms;
+}
+
+void
+unpfs_qos_close(IxpConn *c)
+{
+    struct qconn *qc = c->fd < qos.nconns ? &qos.conns[c->fd] : NULL;
+
+    if (!qc || qc->conn != c)
+        return;
+
+    client_put(qc->client);
+    qc->conn = NULL;
+    qc->client = NULL;
+}
+
+void
+unpfs_qos_stats(struct unpfs_qos_stats *stats)
+{
+    stats->clients = __atomic_load_n(&qos.stats.clients, __ATOMIC_RELAXED);
+    stats->admitted = __atomic_load_n(&qos.stats.admitted, __ATOMIC_RELAXED);
+    stats->held = __atomic_load_n(&qos.stats.held, __ATOMIC_RELAXED);
+}
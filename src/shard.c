@@ -0,0 +1,226 @@
+#define _GNU_SOURCE     /* For sched_setaffinity(2) and CPU_SET(3) */
+#include <unpfs/shard.h>
+#include <unpfs/stats.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+enum {
+    SHARD_MIN_UPTIME = 1    /* Seconds; a shard dying sooner restarts after that */
+};
+
+struct shard {
+    pid_t pid;              /* 0 while waiting to be restarted */
+    time_t started;
+    time_t restart_at;
+};
+
+int
+unpfs_shard_announce(const char *address)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host, *port;
+    int fd = -1, on = 1, err;
+
+    if (strncmp(address, "tcp!", 4)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    host = strdup(address + 4);
+    if (!host)
+        return -1;
+    port = strchr(host, '!');
+    if (!port) {
+        free(host);
+        errno = EINVAL;
+        return -1;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    err = getaddrinfo(strcmp(host, "*") ? host : NULL, port, &hints, &res);
+    free(host);
+    if (err) {
+        unpfs_log(LOG_ERR, "%s: %s: %s\n", __func__, address, gai_strerror(err));
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == 0
+            && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) == 0
+            && bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+            && listen(fd, SOMAXCONN) == 0)
+            break;
+
+        err = errno;
+        close(fd);
+        errno = err;
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+/* Restricts the calling process to the shard-th CPU it may run on */
+static int
+pin_cpu(unsigned int shard)
+{
+    cpu_set_t allowed, set;
+    int cpu, n;
+
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0)
+        return -1;
+
+    n = shard % CPU_COUNT(&allowed);
+    for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed) && n-- == 0)
+            break;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof set, &set);
+}
+
+static int
+start(struct shard *shards, unsigned int i, int pin, const sigset_t *mask,
+      int (*serve)(unsigned int, void *), void *arg)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        unpfs_log(LOG_ERR, "%s: shard %u: fork: %s\n", __func__, i, strerror(errno));
+        return -1;
+    }
+
+    if (pid == 0) {
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        if (pin && pin_cpu(i) < 0)
+            unpfs_log(LOG_WARNING, "%s: shard %u: sched_setaffinity: %s\n",
+                __func__, i, strerror(errno));
+        unpfs_stats_use_slot(i);
+        exit(serve(i, arg));
+    }
+
+    shards[i].pid = pid;
+    shards[i].started = time(NULL);
+
+    return 0;
+}
+
+/* Notes the shards that exited, to be restarted */
+static void
+reap(struct shard *shards, unsigned int nshards)
+{
+    unsigned int i;
+    pid_t pid;
+    int status;
+    time_t now = time(NULL);
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < nshards && shards[i].pid != pid; ++i)
+            ;
+        if (i == nshards)
+            continue;
+
+        if (WIFSIGNALED(status))
+            unpfs_log(LOG_WARNING, "%s: shard %u (pid %d) killed by signal %d\n",
+                __func__, i, (int)pid, WTERMSIG(status));
+        else
+            unpfs_log(LOG_WARNING, "%s: shard %u (pid %d) exited with %d\n",
+                __func__, i, (int)pid, WEXITSTATUS(status));
+
+        shards[i].pid = 0;
+        shards[i].restart_at = now;
+        if (now - shards[i].started < SHARD_MIN_UPTIME)
+            shards[i].restart_at = now + SHARD_MIN_UPTIME;
+    }
+}
+
+int
+unpfs_shard_run(unsigned int nshards, int pin,
+                int (*serve)(unsigned int shard, void *arg), void *arg)
+{
+    struct shard *shards;
+    struct timespec timeout = { SHARD_MIN_UPTIME, 0 };
+    sigset_t set, old;
+    unsigned int i;
+    int stop = 0, ret = 0, pending;
+
+    if (unpfs_stats_share(nshards) < 0)
+        return -1;
+
+    shards = calloc(nshards, sizeof *shards);
+    if (!shards)
+        return -1;
+
+    /* Signals are taken synchronously, so none is missed between waits */
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    for (i = 0; i < nshards && !stop; ++i) {
+        if (start(shards, i, pin, &old, serve, arg) < 0)
+            stop = ret = -1;
+    }
+
+    while (!stop) {
+        pending = 0;
+        for (i = 0; i < nshards; ++i) {
+            if (!shards[i].pid && shards[i].restart_at <= time(NULL))
+                start(shards, i, pin, &old, serve, arg);
+            if (!shards[i].pid)
+                pending = 1;
+        }
+
+        /* Wakes up in time to restart shards that died young */
+        switch (pending ? sigtimedwait(&set, NULL, &timeout) : sigwaitinfo(&set, NULL)) {
+        case SIGCHLD:
+            reap(shards, nshards);
+            break;
+        case SIGUSR1:
+            unpfs_stats_log();
+            break;
+        case SIGHUP:
+        case SIGINT:
+        case SIGTERM:
+            stop = 1;
+            break;
+        }
+    }
+
+    for (i = 0; i < nshards; ++i) {
+        if (shards[i].pid > 0)
+            kill(shards[i].pid, SIGTERM);
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    free(shards);
+
+    return ret;
+}
@@ -0,0 +1,199 @@
+#define _GNU_SOURCE     /* For splice(2) */
+#include <unpfs/splice.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+enum {
+    SPLICE_PIPE_SIZE = 1024 * 1024,
+    SPLICE_PIPES = 64           /* Zero-copy replies on their way at most */
+};
+
+/* The address of a pipe is the payload token standing for its contents */
+struct spipe {
+    int fd[2];
+    size_t size;                /* 0 until it is opened */
+    size_t filled;              /* Bytes in it that are not sent yet */
+    struct spipe *next;         /* On the free list */
+};
+
+/* pipes[nused] onwards have never been used */
+static struct {
+    pthread_mutex_t lock;
+    struct spipe pipes[SPLICE_PIPES];
+    unsigned int nused;
+    struct spipe *free;
+} sp = { PTHREAD_MUTEX_INITIALIZER, { { { 0, 0 }, 0, 0, NULL } }, 0, NULL };
+
+static struct spipe *
+pipe_get(void)
+{
+    struct spipe *p = NULL;
+
+    pthread_mutex_lock(&sp.lock);
+    if (sp.free) {
+        p = sp.free;
+        sp.free = p->next;
+    } else if (sp.nused < SPLICE_PIPES) {
+        p = &sp.pipes[sp.nused++];
+    }
+    pthread_mutex_unlock(&sp.lock);
+
+    return p;
+}
+
+static int
+pipe_open(struct spipe *p)
+{
+    int size;
+
+    if (p->size)
+        return 0;
+
+    if (pipe2(p->fd, O_CLOEXEC) < 0)
+        return -1;
+
+    /* Larger pipes need privileges past /proc/sys/fs/pipe-max-size */
+    size = fcntl(p->fd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    if (size < 0)
+        size = fcntl(p->fd[1], F_GETPIPE_SZ);
+    p->size = size > 0 ? (size_t)size : 65536;
+
+    return 0;
+}
+
+/* Whatever is left in a pipe is lost with it */
+static void
+pipe_put(struct spipe *p)
+{
+    if (p->filled) {
+        close(p->fd[0]);
+        close(p->fd[1]);
+        p->size = 0;
+        p->filled = 0;
+    }
+
+    pthread_mutex_lock(&sp.lock);
+    p->next = sp.free;
+    sp.free = p;
+    pthread_mutex_unlock(&sp.lock);
+}
+
+static struct spipe *
+pipe_of(const char *data)
+{
+    uintptr_t p = (uintptr_t)data, base = (uintptr_t)sp.pipes;
+
+    if (p < base || p >= base + sizeof sp.pipes)
+        return NULL;
+
+    return &sp.pipes[(p - base) / sizeof *sp.pipes];
+}
+
+ssize_t
+unpfs_splice_fill(int fd, uint64_t offset, size_t count, char **data)
+{
+    struct spipe *p;
+    ssize_t n;
+    loff_t off = offset;
+
+    if (fd < 0 || !(p = pipe_get()))
+        return -1;
+
+    if (pipe_open(p) < 0) {
+        pipe_put(p);
+        return -1;
+    }
+
+    /* A short Rread is fine, so one pipeful at most */
+    if (count > p->size)
+        count = p->size;
+
+    n = splice(fd, &off, p->fd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0) {
+        unpfs_log(LOG_INFO, "%s: splice: fd=%d: %s\n", __func__, fd, strerror(errno));
+        pipe_put(p);
+        return -1;
+    }
+
+    p->filled = n;
+    *data = (char *)p;
+
+    return n;
+}
+
+int
+unpfs_splice_is_pipe(const char *data)
+{
+    return pipe_of(data) != NULL;
+}
+
+int
+unpfs_splice_send(int sock, const void *header, size_t length, char *data)
+{
+    struct spipe *p = pipe_of(data);
+    ssize_t m;
+
+    while (length > 0) {
+        m = send(sock, header, length, MSG_MORE | MSG_NOSIGNAL);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m < 0)
+            goto fail;
+        header = (const char *)header + m;
+        length -= m;
+    }
+
+    while (p->filled > 0) {
+        m = splice(p->fd[0], NULL, sock, NULL, p->filled, SPLICE_F_MOVE);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            goto fail;
+        p->filled -= m;
+    }
+
+    return 0;
+
+fail:
+    unpfs_log(LOG_ERR, "%s: sock=%d: %s\n", __func__, sock,
+        m < 0 ? strerror(errno) : "short splice");
+    return -1;
+}
+
+ssize_t
+unpfs_splice_copy(char *data, char *buf)
+{
+    struct spipe *p = pipe_of(data);
+    size_t done = 0;
+    ssize_t m;
+
+    while (p->filled > 0) {
+        m = read(p->fd[0], buf + done, p->filled);
+        if (m < 0 && errno == EINTR)
+            continue;
+        if (m <= 0)
+            return -1;
+        done += m;
+        p->filled -= m;
+    }
+
+    return done;
+}
+
+int
+unpfs_splice_release(char *data)
+{
+    struct spipe *p = pipe_of(data);
+
+    if (!p)
+        return 0;
+
+    pipe_put(p);
+
+    return 1;
+}
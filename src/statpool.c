@@ -0,0 +1,217 @@
+#define _GNU_SOURCE     /* For statx(2) */
+#include <unpfs/statpool.h>
+#include <unpfs/log.h>
+#include <ixp.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+enum {
+    /* Smaller batches are not worth waking anyone up for */
+    STATPOOL_MIN_BATCH = 16,
+    STATPOOL_CHUNK = 8
+};
+
+/* Entries are claimed in chunks by the pool and the submitter alike */
+struct batch {
+    int dirfd;
+    struct unpfs_stat_req *reqs;
+    size_t n, next, left;
+    struct batch *link;
+};
+
+static struct {
+    unsigned int nthreads;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    struct batch *batches;      /* With unclaimed entries */
+    int stopping;
+} pool;
+
+#ifdef STATX_BASIC_STATS
+static int use_statx = 1;
+
+static int
+stat_statx(int dirfd, struct unpfs_stat_req *req)
+{
+    struct statx stx;
+    const unsigned int mask =
+        STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE |
+        STATX_ATIME | STATX_MTIME | STATX_CTIME;
+
+    if (statx(dirfd, req->name, AT_SYMLINK_NOFOLLOW, mask, &stx) < 0)
+        return -1;
+
+    memset(&req->st, 0, sizeof req->st);
+    req->st.st_mode = stx.stx_mode;
+    req->st.st_ino = stx.stx_ino;
+    req->st.st_size = stx.stx_size;
+    req->st.st_atim.tv_sec = stx.stx_atime.tv_sec;
+    req->st.st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    req->st.st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    req->st.st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    req->st.st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    req->st.st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+
+    return 0;
+}
+#endif
+
+static void
+stat_one(int dirfd, struct unpfs_stat_req *req)
+{
+    req->err = 0;
+
+#ifdef STATX_BASIC_STATS
+    if (use_statx) {
+        if (stat_statx(dirfd, req) == 0)
+            return;
+        if (errno != ENOSYS) {
+            req->err = errno;
+            return;
+        }
+        use_statx = 0;
+    }
+#endif
+
+    if (fstatat(dirfd, req->name, &req->st, AT_SYMLINK_NOFOLLOW) < 0)
+        req->err = errno;
+}
+
+static void
+batch_unlink(struct batch *b)
+{
+    struct batch **p = &pool.batches;
+
+    while (*p && *p != b)
+        p = &(*p)->link;
+    if (*p)
+        *p = b->link;
+}
+
+/* Called and returns with pool.lock held */
+static void
+batch_work(struct batch *b)
+{
+    size_t i, start, end;
+
+    while (b->next < b->n) {
+        start = b->next;
+        end = start + STATPOOL_CHUNK < b->n ? start + STATPOOL_CHUNK : b->n;
+        b->next = end;
+        if (end == b->n)
+            batch_unlink(b);
+
+        pthread_mutex_unlock(&pool.lock);
+        for (i = start; i < end; ++i)
+            stat_one(b->dirfd, &b->reqs[i]);
+        pthread_mutex_lock(&pool.lock);
+
+        b->left -= end - start;
+    }
+}
+
+static void *
+statpool_main(void *arg)
+{
+    pthread_mutex_lock(&pool.lock);
+
+    for (;;) {
+        while (!pool.batches && !pool.stopping)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        if (pool.stopping)
+            break;
+        batch_work(pool.batches);
+        pthread_cond_broadcast(&pool.done);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+int
+unpfs_statpool_start(unsigned int nthreads)
+{
+    unsigned int i;
+
+    if (!nthreads)
+        return 0;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.done, NULL);
+
+    pool.threads = ixp_emallocz(nthreads * sizeof *pool.threads);
+
+    for (i = 0; i < nthreads; ++i) {
+        int err = pthread_create(&pool.threads[i], NULL, statpool_main, NULL);
+        if (err) {
+            unpfs_log(LOG_ERR, "%s: pthread_create: %s\n",
+                __func__, strerror(err));
+            break;
+        }
+    }
+
+    pool.nthreads = i;
+    if (!pool.nthreads) {
+        zfree((char **)&pool.threads);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    unpfs_log(LOG_INFO, "%s: %u stat threads started\n", __func__, pool.nthreads);
+
+    return 0;
+}
+
+void
+unpfs_statpool_stop(void)
+{
+    unsigned int i;
+
+    if (!pool.nthreads)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.nthreads; ++i)
+        pthread_join(pool.threads[i], NULL);
+
+    pool.nthreads = 0;
+    zfree((char **)&pool.threads);
+}
+
+void
+unpfs_statpool_run(int dirfd, struct unpfs_stat_req *reqs, size_t n)
+{
+    struct batch b;
+    size_t i;
+
+    if (!pool.nthreads || n < STATPOOL_MIN_BATCH) {
+        for (i = 0; i < n; ++i)
+            stat_one(dirfd, &reqs[i]);
+        return;
+    }
+
+    b.dirfd = dirfd;
+    b.reqs = reqs;
+    b.n = b.left = n;
+    b.next = 0;
+
+    pthread_mutex_lock(&pool.lock);
+
+    b.link = pool.batches;
+    pool.batches = &b;
+    pthread_cond_broadcast(&pool.work);
+
+    /* Take a share rather than sit idle */
+    batch_work(&b);
+    while (b.left)
+        pthread_cond_wait(&pool.done, &pool.lock);
+
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,509 @@
+#define _DEFAULT_SOURCE     /* For MAP_ANONYMOUS */
+#include <unpfs/stats.h>
+#include <unpfs/fid.h>
+#include <unpfs/buf.h>
+#include <unpfs/dcache.h>
+#include <unpfs/arena.h>
+#include <unpfs/fdcache.h>
+#include <unpfs/fmap.h>
+#include <unpfs/ccache.h>
+#include <unpfs/qos.h>
+#include <unpfs/dotl.h>
+#include <unpfs/log.h>
+#include <ixp.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+enum {
+    STATS_BUCKETS = 32,             /* Bucket b counts latencies below 2^b us */
+    STATS_REPORT_SIZE = 64 * 1024,
+    STATS_TYPES = 256
+};
+
+struct op_stats {
+    pthread_mutex_t lock;
+    unsigned long count;
+    unsigned long errors;
+    unsigned long bytes;
+    unsigned long max_us;
+    unsigned long hist[STATS_BUCKETS];
+};
+
+static struct op_stats local_stats[STATS_TYPES];
+static struct op_stats *stats = local_stats;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+/* With shards, one slot of counters each in memory they all share */
+static struct op_stats *slots;
+static unsigned int nslots;
+
+static void
+stats_init(void)
+{
+    int i;
+
+    for (i = 0; i < STATS_TYPES; ++i)
+        pthread_mutex_init(&local_stats[i].lock, NULL);
+}
+
+/* A shard may die holding the lock of its slot, and be restarted */
+static void
+stats_lock(struct op_stats *s)
+{
+    if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&s->lock);
+}
+
+int
+unpfs_stats_share(unsigned int n)
+{
+    pthread_mutexattr_t attr;
+    unsigned int i;
+
+    slots = mmap(NULL, (size_t)n * STATS_TYPES * sizeof *slots,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        slots = NULL;
+        return -1;
+    }
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < n * STATS_TYPES; ++i)
+        pthread_mutex_init(&slots[i].lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    nslots = n;
+
+    return 0;
+}
+
+void
+unpfs_stats_use_slot(unsigned int slot)
+{
+    stats = slots + (size_t)slot * STATS_TYPES;
+}
+
+/* The counters of type, summed over the shards if there are any */
+static void
+stats_get(int type, struct op_stats *s)
+{
+    struct op_stats *slot;
+    unsigned int i, b;
+
+    if (!slots) {
+        stats_lock(&stats[type]);
+        *s = stats[type];
+        pthread_mutex_unlock(&stats[type].lock);
+        return;
+    }
+
+    memset(s, 0, sizeof *s);
+    for (i = 0; i < nslots; ++i) {
+        slot = &slots[(size_t)i * STATS_TYPES + type];
+        stats_lock(slot);
+        s->count += slot->count;
+        s->errors += slot->errors;
+        s->bytes += slot->bytes;
+        if (slot->max_us > s->max_us)
+            s->max_us = slot->max_us;
+        for (b = 0; b < STATS_BUCKETS; ++b)
+            s->hist[b] += slot->hist[b];
+        pthread_mutex_unlock(&slot->lock);
+    }
+}
+
+const char *
+unpfs_stats_op_name(uint8_t type)
+{
+    switch (type) {
+    case P9_TVersion:       return "version";
+    case P9_TAuth:          return "auth";
+    case P9_TAttach:        return "attach";
+    case P9_TFlush:         return "flush";
+    case P9_TWalk:          return "walk";
+    case P9_TOpen:          return "open";
+    case P9_TCreate:        return "create";
+    case P9_TRead:          return "read";
+    case P9_TWrite:         return "write";
+    case P9_TClunk:         return "clunk";
+    case P9_TRemove:        return "remove";
+    case P9_TStat:          return "stat";
+    case P9_TWStat:         return "wstat";
+    case DOTL_TSTATFS:      return "statfs";
+    case DOTL_TLOPEN:       return "lopen";
+    case DOTL_TLCREATE:     return "lcreate";
+    case DOTL_TSYMLINK:     return "symlink";
+    case DOTL_TMKNOD:       return "mknod";
+    case DOTL_TRENAME:      return "rename";
+    case DOTL_TREADLINK:    return "readlink";
+    case DOTL_TGETATTR:     return "getattr";
+    case DOTL_TSETATTR:     return "setattr";
+    case DOTL_TXATTRWALK:   return "xattrwalk";
+    case DOTL_TXATTRCREATE: return "xattrcreate";
+    case DOTL_TREADDIR:     return "readdir";
+    case DOTL_TFSYNC:       return "fsync";
+    case DOTL_TLOCK:        return "lock";
+    case DOTL_TGETLOCK:     return "getlock";
+    case DOTL_TLINK:        return "link";
+    case DOTL_TMKDIR:       return "mkdir";
+    case DOTL_TRENAMEAT:    return "renameat";
+    case DOTL_TUNLINKAT:    return "unlinkat";
+    default:                return NULL;
+    }
+}
+
+uint64_t
+unpfs_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+unpfs_stats_record(uint8_t type, int err, uint64_t start)
+{
+    struct op_stats *s = &stats[type];
+    unsigned long us = (unpfs_stats_now() - start) / 1000;
+    unsigned int b = 0;
+
+    while (b < STATS_BUCKETS - 1 && us >= 1UL << b)
+        ++b;
+
+    pthread_once(&stats_once, stats_init);
+    stats_lock(s);
+    ++s->count;
+    if (err)
+        ++s->errors;
+    if (us > s->max_us)
+        s->max_us = us;
+    ++s->hist[b];
+    pthread_mutex_unlock(&s->lock);
+}
+
+void
+unpfs_stats_bytes(uint8_t type, size_t bytes)
+{
+    struct op_stats *s = &stats[type];
+
+    pthread_once(&stats_once, stats_init);
+    stats_lock(s);
+    s->bytes += bytes;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Upper bound of the bucket the q-th fraction of latencies falls in */
+static unsigned long
+percentile(const struct op_stats *s, double q)
+{
+    unsigned long seen = 0, rank = (unsigned long)(s->count * q);
+    unsigned int b;
+
+    if (rank >= s->count)
+        rank = s->count - 1;
+
+    for (b = 0; b < STATS_BUCKETS; ++b) {
+        seen += s->hist[b];
+        if (seen > rank)
+            break;
+    }
+
+    return b < STATS_BUCKETS - 1 ? 1UL << b : s->max_us;
+}
+
+static size_t
+report_op(char *buf, size_t size, uint8_t type, const struct op_stats *s)
+{
+    const char *name = unpfs_stats_op_name(type);
+    char unknown[16];
+    size_t n;
+    unsigned int b;
+
+    if (!name) {
+        snprintf(unknown, sizeof unknown, "type%u", type);
+        name = unknown;
+    }
+
+    n = snprintf(buf, size, "%-12s %10lu %8lu %14lu %8lu %8lu %8lu ",
+        name, s->count, s->errors, s->bytes,
+        percentile(s, 0.5), percentile(s, 0.99), s->max_us);
+
+    for (b = 0; b < STATS_BUCKETS && n < size; ++b) {
+        if (s->hist[b])
+            n += snprintf(buf + n, size - n, " <%lu:%lu", 1UL << b, s->hist[b]);
+    }
+    if (n < size)
+        n += snprintf(buf + n, size - n, "\n");
+
+    return n;
+}
+
+/* The state of this process's caches and pools */
+static size_t
+report_caches(char *buf, size_t size)
+{
+    struct unpfs_buf_stats buf_stats;
+    struct unpfs_dcache_stats dcache_stats;
+    struct unpfs_fid_stats fid_stats;
+    struct unpfs_arena_stats arena_stats;
+    struct unpfs_fdcache_stats fdcache_stats;
+    struct unpfs_fmap_stats fmap_stats;
+    struct unpfs_ccache_stats ccache_stats;
+    struct unpfs_qos_stats qos_stats;
+    size_t n = 0;
+
+    unpfs_buf_stats(&buf_stats);
+    unpfs_dcache_stats(&dcache_stats);
+    unpfs_fid_stats(&fid_stats);
+    unpfs_arena_stats(&arena_stats);
+    unpfs_fdcache_stats(&fdcache_stats);
+    unpfs_fmap_stats(&fmap_stats);
+    unpfs_ccache_stats(&ccache_stats);
+    unpfs_qos_stats(&qos_stats);
+
+    n += snprintf(buf + n, size - n,
+        "buffers: hits=%lu misses=%lu cached=%lu cached_bytes=%lu\n"
+        "dentries: hits=%lu negative_hits=%lu misses=%lu entries=%lu\n",
+        buf_stats.hits, buf_stats.misses,
+        buf_stats.cached, buf_stats.cached_bytes,
+        dcache_stats.hits, dcache_stats.negative_hits,
+        dcache_stats.misses, dcache_stats.entries);
+    if (n < size)
+        n += snprintf(buf + n, size - n,
+            "fids: live=%lu slabs=%lu allocs=%lu\n"
+            "arenas: allocs=%lu bytes=%lu overflows=%lu threads=%lu\n",
+            fid_stats.live, fid_stats.slabs, fid_stats.allocs,
+            arena_stats.allocs, arena_stats.bytes,
+            arena_stats.overflows, arena_stats.arenas);
+    if (n < size)
+        n += snprintf(buf + n, size - n,
+            "fds: hits=%lu misses=%lu evictions=%lu entries=%lu idle=%lu\n"
+            "maps: maps=%lu bytes=%lu reads=%lu retired=%lu\n",
+            fdcache_stats.hits, fdcache_stats.misses, fdcache_stats.evictions,
+            fdcache_stats.entries, fdcache_stats.idle,
+            fmap_stats.maps, fmap_stats.bytes,
+            fmap_stats.reads, fmap_stats.retired);
+    if (n < size)
+        n += snprintf(buf + n, size - n,
+            "contents: hits=%lu misses=%lu evictions=%lu entries=%lu bytes=%lu\n"
+            "qos: clients=%lu admitted=%lu held=%lu\n",
+            ccache_stats.hits, ccache_stats.misses, ccache_stats.evictions,
+            ccache_stats.entries, ccache_stats.bytes,
+            qos_stats.clients, qos_stats.admitted, qos_stats.held);
+
+    return n;
+}
+
+char *
+unpfs_stats_report(size_t *length)
+{
+    struct op_stats s;
+    char *buf = malloc(STATS_REPORT_SIZE);
+    size_t n, size = STATS_REPORT_SIZE;
+    int type;
+
+    if (!buf)
+        return NULL;
+
+    pthread_once(&stats_once, stats_init);
+
+    n = snprintf(buf, size, "%-12s %10s %8s %14s %8s %8s %8s  %s\n",
+        "op", "count", "errors", "bytes", "p50us", "p99us", "maxus",
+        "histogram (<us:count)");
+
+    for (type = 0; type < STATS_TYPES && n < size; ++type) {
+        stats_get(type, &s);
+        if (s.count)
+            n += report_op(buf + n, size - n, type, &s);
+    }
+
+    /* The supervisor of shards serves nothing, so has no caches to speak of */
+    if (n < size && (!slots || stats != local_stats))
+        n += report_caches(buf + n, size - n);
+
+    *length = n < size ? n : size - 1;
+
+    return buf;
+}
+
+void
+unpfs_stats_log(void)
+{
+    size_t length;
+    char *report = unpfs_stats_report(&length);
+
+    if (report)
+        unpfs_log_text(LOG_NOTICE, report);
+    free(report);
+}
+
+
+/*
+ * The synthetic files: a read-only directory holding the report, which
+ * is taken when the file is opened
+ */
+
+static void
+stats_lookup_dir(struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof *stbuf);
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_ino = (ino_t)-2;
+    stbuf->st_nlink = 2;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+}
+
+int
+unpfs_stats_lookup(const char *path, struct stat *stbuf)
+{
+    size_t length = strlen(UNPFS_STATS_DIR);
+    char *report;
+
+    if (strncmp(path, UNPFS_STATS_DIR, length)
+        || (path[length] != '\0' && path[length] != '/'))
+        return -1;
+
+    stats_lookup_dir(stbuf);
+    if (!strcmp(path, UNPFS_STATS_DIR))
+        return 0;
+    if (strcmp(path, UNPFS_STATS_PATH))
+        return ENOENT;
+
+    /* Reports the size the file would have if opened now */
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_ino = (ino_t)-3;
+    stbuf->st_nlink = 1;
+    report = unpfs_stats_report(&length);
+    stbuf->st_size = report ? length : 0;
+    free(report);
+
+    return 0;
+}
+
+struct stats_snapshot {
+    char *text;
+    size_t length;
+};
+
+static int
+stats_open(struct unpfs_fid *fid, int flags, mode_t mode)
+{
+    struct stats_snapshot *snap;
+
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) {
+        errno = EACCES;
+        return -1;
+    }
+
+    snap = malloc(sizeof *snap);
+    if (!snap) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (fid->type & P9_QTDIR) {
+        snap->text = NULL;
+        snap->length = 0;
+    } else if (!(snap->text = unpfs_stats_report(&snap->length))) {
+        free(snap);
+        errno = ENOMEM;
+        return -1;
+    }
+    fid->priv = snap;
+
+    return 0;
+}
+
+static ssize_t
+stats_read(struct unpfs_fid *fid, char **buf, size_t count, uint64_t offset)
+{
+    struct stats_snapshot *snap = fid->priv;
+
+    *buf = unpfs_buf_alloc(count);
+    if (!*buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (offset >= snap->length)
+        return 0;
+    if (count > snap->length - offset)
+        count = snap->length - offset;
+    memcpy(*buf, snap->text + offset, count);
+
+    return count;
+}
+
+static ssize_t
+stats_write(struct unpfs_fid *fid, const void *buf, size_t count, uint64_t offset)
+{
+    errno = EACCES;
+    return -1;
+}
+
+static int
+stats_close(struct unpfs_fid *fid)
+{
+    struct stats_snapshot *snap = fid->priv;
+
+    if (snap) {
+        free(snap->text);
+        free(snap);
+        fid->priv = NULL;
+    }
+
+    return 0;
+}
+
+static int
+stats_remove(struct unpfs_fid *fid)
+{
+    errno = EACCES;
+    return -1;
+}
+
+static int
+stats_stat(struct unpfs_fid *fid, struct stat *stbuf)
+{
+    int ret = unpfs_stats_lookup(fid->path, stbuf);
+
+    if (ret) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    return 0;
+}
+
+static const struct fid_handler stats_handler = {
+    stats_open,
+    stats_read,
+    stats_write,
+    stats_close,
+    stats_remove,
+    NULL,
+    NULL,
+    stats_stat,
+    NULL
+};
+
+struct unpfs_fid *
+unpfs_stats_fid(const char *path)
+{
+    struct unpfs_fid *fid = unpfs_fid_new(path,
+        strcmp(path, UNPFS_STATS_DIR) ? P9_QTFILE : P9_QTDIR);
+
+    fid->handler = &stats_handler;
+
+    return fid;
+}
@@ -0,0 +1,158 @@
+#define _GNU_SOURCE     /* For syncfs(2) */
+#include <unpfs/sync.h>
+#include <unpfs/fid.h>
+#include <unpfs/ops.h>
+#include <unpfs/log.h>
+#include <ixp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+/* The syncs that queued up behind a running one, committed together */
+struct batch {
+    int fd;             /* Of the first file queued, to syncfs(2) */
+    int done;
+    int err;
+    unsigned int refs;
+};
+
+/* One per filesystem, never freed: an export spans only a few */
+struct group {
+    dev_t dev;
+    int busy;
+    struct batch *next;
+    struct group *link;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct group *groups;
+} sync_groups = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL };
+
+/* sync_groups.lock held */
+static struct group *
+group_get(dev_t dev)
+{
+    struct group *g;
+
+    for (g = sync_groups.groups; g; g = g->link) {
+        if (g->dev == dev)
+            return g;
+    }
+
+    g = ixp_emallocz(sizeof *g);
+    g->dev = dev;
+    g->link = sync_groups.groups;
+    sync_groups.groups = g;
+
+    return g;
+}
+
+static int
+sync_alone(struct group *g, int fd, int datasync)
+{
+    int err;
+
+    g->busy = 1;
+    pthread_mutex_unlock(&sync_groups.lock);
+
+    err = (datasync ? fdatasync(fd) : fsync(fd)) < 0 ? errno : 0;
+
+    pthread_mutex_lock(&sync_groups.lock);
+    g->busy = 0;
+    pthread_cond_broadcast(&sync_groups.cond);
+
+    return err;
+}
+
+/* Queues behind the running sync; the first to see it finish commits for all */
+static int
+sync_batched(struct group *g, int fd)
+{
+    struct batch *b = g->next;
+    int err;
+
+    if (!b) {
+        b = ixp_emallocz(sizeof *b);
+        b->fd = fd;
+        g->next = b;
+    }
+    ++b->refs;
+
+    while (!b->done) {
+        if (!g->busy && g->next == b) {
+            g->busy = 1;
+            g->next = NULL;
+            pthread_mutex_unlock(&sync_groups.lock);
+
+            /* Each waiter's file is still open: it waits for this */
+            b->err = syncfs(b->fd) < 0 ? errno : 0;
+
+            pthread_mutex_lock(&sync_groups.lock);
+            b->done = 1;
+            g->busy = 0;
+            pthread_cond_broadcast(&sync_groups.cond);
+            break;
+        }
+        pthread_cond_wait(&sync_groups.cond, &sync_groups.lock);
+    }
+
+    err = b->err;
+    if (--b->refs == 0)
+        free(b);
+
+    return err;
+}
+
+static int
+sync_fd(int fd, int datasync)
+{
+    struct group *g;
+    struct stat st;
+    int err;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    pthread_mutex_lock(&sync_groups.lock);
+    g = group_get(st.st_dev);
+    if (g->busy || g->next)
+        err = sync_batched(g, fd);
+    else
+        err = sync_alone(g, fd, datasync);
+    pthread_mutex_unlock(&sync_groups.lock);
+
+    if (err) {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+unpfs_sync_fid(struct unpfs_fid *fid, int datasync)
+{
+    int ret, err, fd = unpfs_fid_fd(fid);
+
+    if (fd >= 0)
+        return sync_fd(fd, datasync);
+
+    /* O_PATH descriptors cannot be synced: open the file, or the export */
+    fd = openat(fid->dirfd, unpfs_fid_name(fid),
+        O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        fd = open(ctx.root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    ret = sync_fd(fd, datasync);
+    err = errno;
+    close(fd);
+    errno = err;
+
+    return ret;
+}
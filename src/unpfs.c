@@ -1,22 +1,74 @@
 
 #include <unpfs/ops.h>
+#include <unpfs/fid.h>
 #include <unpfs/log.h>
+#include <unpfs/worker.h>
+#include <unpfs/loop.h>
+#include <unpfs/uring.h>
+#include <unpfs/buf.h>
+#include <unpfs/dcache.h>
+#include <unpfs/fdcache.h>
+#include <unpfs/ccache.h>
+#include <unpfs/statpool.h>
+#include <unpfs/dotl.h>
+#include <unpfs/stats.h>
+#include <unpfs/shard.h>
+#include <unpfs/qos.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
 
 static struct Ixp9Srv srv;
 static volatile sig_atomic_t running = 1;
 static volatile sig_atomic_t signal_num = 0;
+static volatile sig_atomic_t dump_stats = 0;
 
 static void
 usage(const char *program)
 {
-    printf("Usage: %s proto!addr[!port] ROOT\n"
-            "Examples: %s unix!mysrv /\n"
-            "          %s tcp!localhost!564 /var/www/\n",
-            program, program, program);
+    printf("Usage: %s [-w WORKERS] [-b BACKEND] [-z] [-d ENTRIES] [-t THREADS] [-m MSIZE]\n"
+            "       [-c BYTES] [-f FDS] [-M BYTES] [-k BYTES [-K BYTES]]\n"
+            "       [-s SHARDS [-p]]\n"
+            "       [-I OPS] [-B BYTES] [-A OPS] [-u]\n"
+            "       proto!addr[!port] ROOT\n",
+            program);
+    printf("Options:\n"
+            "    -w WORKERS  Execute requests on WORKERS threads (default: 0)\n"
+            "    -b BACKEND  File I/O backend: sync or uring (default: sync)\n"
+            "                uring serves requests run on the server loop and\n"
+            "                falls back to sync if io_uring is unavailable\n"
+            "    -z          Splice regular file reads into 9P2000.L connections\n");
+    printf("    -d ENTRIES  Cache up to ENTRIES walked names, 0 disables\n"
+            "                (default: 65536)\n"
+            "    -t THREADS  Stat large directory listings on THREADS threads\n"
+            "                (default: 4, 0 stats them inline)\n"
+            "    -m MSIZE    Largest message size to negotiate with 9P2000.L\n"
+            "                clients, up to 16 MiB (default: 524288)\n");
+    printf("    -c BYTES    Coalesce contiguous writes smaller than BYTES per\n"
+            "                fid, written out within 10 ms (default: 0, off)\n"
+            "    -f FDS      Share open files between fids and keep up to FDS\n"
+            "                of them open for reuse, 0 disables (default: 1024)\n"
+            "    -M BYTES    Serve reads of files of at least BYTES opened\n"
+            "                read-only from shared mappings (default: 0, off)\n");
+    printf("    -k BYTES    Keep up to BYTES of small files in memory, read\n"
+            "                from there while unchanged (default: 0, off)\n"
+            "    -K BYTES    Largest file to keep in memory (default: 65536)\n");
+    printf("    -s SHARDS   Serve tcp!addr!port from SHARDS processes sharing\n"
+            "                the port with SO_REUSEPORT, restarted if they die\n"
+            "    -p          Pin each shard to a CPU of its own\n");
+    printf("    -I OPS      Limit each client to OPS reads and writes per second\n"
+            "    -B BYTES    Limit each client to BYTES read or written per second\n"
+            "    -A OPS      Limit each client to OPS other requests per second\n"
+            "                (default: 0, no limit, for all three)\n"
+            "    -u          Clients are attach user names, not connections\n"
+            "Statistics are readable at ROOT" UNPFS_STATS_PATH " by clients and\n"
+            "logged on SIGUSR1.\n");
+    printf("Examples: %s unix!mysrv /\n"
+            "          %s -w 32 tcp!localhost!564 /var/www/\n",
+            program, program);
 }
 
 static void
@@ -66,21 +118,248 @@ signal_handler(int signum)
         running = 0;
         signal_num = signum;
         break;
+    case SIGUSR1:
+        dump_stats = 1;
+        break;
     }
 }
 
+/* Allow as many connections as the hard limit permits */
+static void
+raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == rl.rlim_max)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        unpfs_log(LOG_WARNING, "setrlimit: %s\n", strerror(errno));
+}
+
 static void
 unpfs_preselect(IxpServer *server)
 {
     server->running = running;
+    unpfs_fid_writeback_poll();
+
+    if (dump_stats) {
+        dump_stats = 0;
+        unpfs_stats_log();
+    }
+}
+
+static unsigned long
+parse_count(const char *program, const char *arg, long max)
+{
+    char *end;
+    long n = strtol(arg, &end, 10);
+
+    if (*arg == '\0' || *end != '\0' || n < 0 || n > max) {
+        usage(program);
+        exit(EXIT_FAILURE);
+    }
+
+    return (unsigned long)n;
+}
+
+struct options {
+    unsigned int workers;
+    unsigned int stat_threads;
+    unsigned long dentries;
+    unsigned long fds;
+    unsigned long contents;
+    unsigned long content_max;
+    unsigned int shards;
+    int pin;
+    const char *address;
+    const char *backend;
+    struct unpfs_qos_config qos;
+};
+
+/* Sets up a server on the options and runs it until a signal stops it */
+static int
+serve(unsigned int shard, void *arg)
+{
+    struct options *o = arg;
+    int ret;
+    struct unpfs_dcache_stats dcache_stats;
+    struct unpfs_buf_stats buf_stats;
+
+    if (unpfs_log_start() < 0)
+        unpfs_log(LOG_WARNING, "log thread unavailable (%s), logging inline\n",
+            strerror(errno));
+
+    if (o->shards) {
+        ctx.fd = unpfs_shard_announce(o->address);
+        if (ctx.fd < 0)
+            fatal("unpfs_shard_announce: %s: %s\n", o->address, strerror(errno));
+    } else {
+        ctx.fd = ixp_announce(o->address);
+        if (ctx.fd < 0)
+            fatal("ixp_announce: %s\n", ixp_errbuf());
+    }
+
+    ctx.conn = ixp_listen(&ctx.server, ctx.fd, &srv, unpfs_serve9conn, NULL);
+    if (!ctx.conn)
+        fatal("ixp_listen: %s\n", ixp_errbuf());
+
+    if (o->workers && unpfs_worker_start(&ctx.server, &srv, o->workers) < 0)
+        fatal("unpfs_worker_start: %s\n", strerror(errno));
+
+    if (unpfs_statpool_start(o->stat_threads) < 0) {
+        unpfs_log(LOG_WARNING, "stat threads unavailable (%s)\n", strerror(errno));
+        o->stat_threads = 0;
+    }
+
+    if (!strcmp(o->backend, "uring")) {
+        if (unpfs_uring_init(&ctx.server, 256) == 0) {
+            file_backend = &uring_file_handler;
+        } else {
+            unpfs_log(LOG_WARNING, "io_uring unavailable (%s), using sync\n",
+                strerror(errno));
+            o->backend = "sync";
+        }
+    }
+
+    if (unpfs_dcache_init(ctx.root, o->dentries) < 0) {
+        unpfs_log(LOG_WARNING, "dentry cache unavailable (%s)\n", strerror(errno));
+        o->dentries = 0;
+    }
+
+    unpfs_fdcache_init(o->fds);
+    unpfs_ccache_init(o->contents, o->content_max);
+    unpfs_qos_init(&o->qos);
+
+    register_signal_handler(SIGHUP, signal_handler);
+    register_signal_handler(SIGINT, signal_handler);
+    register_signal_handler(SIGTERM, signal_handler);
+    register_signal_handler(SIGUSR1, signal_handler);
+
+    ctx.server.preselect = unpfs_preselect;
+
+    unpfs_log(LOG_NOTICE,
+            "Ready to accept 9P clients\n"
+            "    Trans   : %s\n"
+            "    Root    : %s\n"
+            "    Shard   : %u of %u (pid %d)\n"
+            "    Workers : %u (%u stat)\n"
+            "    Backend : %s%s\n"
+            "    Dentries: %lu\n"
+            "    Msize   : %u (9P2000: %d)\n"
+            "    Coalesce: %lu\n"
+            "    Open fds: %lu\n"
+            "    Map     : %lu\n"
+            "    Contents: %lu (files up to %lu)\n"
+            "    QoS     : ops=%lu bytes=%lu other=%lu per %s\n",
+            o->address, ctx.root, shard, o->shards ? o->shards : 1, (int)getpid(),
+            o->workers, o->stat_threads, o->backend,
+            ctx.zerocopy ? " (zero-copy reads)" : "", o->dentries,
+            (unsigned int)ctx.msize, IXP_MAX_MSG, (unsigned long)ctx.wbsize, o->fds,
+            (unsigned long)ctx.mapsize, o->contents, o->content_max, o->qos.ops, o->qos.bytes, o->qos.meta_ops,
+            o->qos.by_user ? "user" : "connection");
+
+    /* Server main loop */
+    ret = unpfs_serverloop(&ctx.server);
+
+    unpfs_worker_stop();
+    unpfs_statpool_stop();
+    ixp_server_close(&ctx.server);
+    unpfs_log(LOG_INFO, "\n[*] Server caught signal: %d\n", signal_num);
+
+    unpfs_buf_stats(&buf_stats);
+    unpfs_log(LOG_INFO, "[*] Buffer pool: hits=%lu misses=%lu cached=%lu (%lu bytes)\n",
+        buf_stats.hits, buf_stats.misses,
+        buf_stats.cached, buf_stats.cached_bytes);
+
+    unpfs_dcache_stats(&dcache_stats);
+    unpfs_log(LOG_INFO, "[*] Dentry cache: hits=%lu negative_hits=%lu misses=%lu entries=%lu\n",
+        dcache_stats.hits, dcache_stats.negative_hits,
+        dcache_stats.misses, dcache_stats.entries);
+
+    unpfs_log_stop();
+
+    return ret;
 }
 
 int
 main(int argc, char **argv)
 {
-    int ret;
+    int fd, opt;
+    struct options o = { 0, 4, 65536, 1024, 0, 65536, 0, 0, NULL, "sync",
+                         { 0, 0, 0, 0 } };
+
+    ctx.msize = 512 * 1024;
 
-    if (argc < 3) {
+    while ((opt = getopt(argc, argv, "w:b:zd:t:m:c:f:M:k:K:s:pI:B:A:u")) != -1) {
+        switch (opt) {
+        case 'w':
+            o.workers = parse_count(argv[0], optarg, 4096);
+            break;
+        case 'b':
+            o.backend = optarg;
+            if (strcmp(o.backend, "sync") && strcmp(o.backend, "uring")) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z':
+            ctx.zerocopy = 1;
+            break;
+        case 't':
+            o.stat_threads = parse_count(argv[0], optarg, 256);
+            break;
+        case 'd':
+            o.dentries = parse_count(argv[0], optarg, 16 * 1024 * 1024);
+            break;
+        case 'm':
+            ctx.msize = parse_count(argv[0], optarg, 16 * 1024 * 1024);
+            if (ctx.msize < IXP_MAX_MSG) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            ctx.wbsize = parse_count(argv[0], optarg, 16 * 1024 * 1024);
+            break;
+        case 'f':
+            o.fds = parse_count(argv[0], optarg, 1024 * 1024);
+            break;
+        case 'M':
+            ctx.mapsize = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 'k':
+            o.contents = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 'K':
+            o.content_max = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 's':
+            o.shards = parse_count(argv[0], optarg, 1024);
+            break;
+        case 'p':
+            o.pin = 1;
+            break;
+        case 'I':
+            o.qos.ops = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 'B':
+            o.qos.bytes = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 'A':
+            o.qos.meta_ops = parse_count(argv[0], optarg, LONG_MAX);
+            break;
+        case 'u':
+            o.qos.by_user = 1;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2) {
         usage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -98,32 +377,23 @@ main(int argc, char **argv)
     srv.wstat   = unpfs_wstat;
     srv.freefid = unpfs_freefid;
 
-    ctx.fd = ixp_announce(argv[1]);
-    if (ctx.fd < 0)
-        fatal("ixp_announce: %s\n", ixp_errbuf());
-
-    ctx.root = remove_terminal_slash(argv[2]);
-    ctx.conn = ixp_listen(&ctx.server, ctx.fd, &srv, ixp_serve9conn, NULL);
-    if (!ctx.conn)
-        fatal("ixp_listen: %s\n", ixp_errbuf());
-
-    register_signal_handler(SIGHUP, signal_handler);
-    register_signal_handler(SIGINT, signal_handler);
-    register_signal_handler(SIGTERM, signal_handler);
+    raise_nofile_limit();
 
-    ctx.server.preselect = unpfs_preselect;
+    o.address = argv[optind];
+    ctx.root = remove_terminal_slash(argv[optind + 1]);
 
-    unpfs_log(LOG_NOTICE,
-            "Ready to accept 9P clients\n"
-            "    Trans : %s\n"
-            "    Root  : %s\n",
-            argv[1], ctx.root);
+    if (!o.shards)
+        return serve(0, &o);
 
-    /* Server main loop */
-    ret = ixp_serverloop(&ctx.server);
+    /* Fail here rather than in every shard if the address cannot be shared */
+    fd = unpfs_shard_announce(o.address);
+    if (fd < 0)
+        fatal("unpfs_shard_announce: %s: %s\n", o.address, strerror(errno));
+    close(fd);
 
-    ixp_server_close(&ctx.server);
-    unpfs_log(LOG_INFO, "\n[*] Server caught signal: %d\n", signal_num);
+    unpfs_log(LOG_NOTICE, "Supervising %u shards (pid %d)\n", o.shards, (int)getpid());
+    if (unpfs_shard_run(o.shards, o.pin, serve, &o) < 0)
+        fatal("unpfs_shard_run: %s\n", strerror(errno));
 
-    return ret;
+    return EXIT_SUCCESS;
 }
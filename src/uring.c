@@ -0,0 +1,279 @@
+#define _DEFAULT_SOURCE     /* For syscall(2) */
+#include <unpfs/uring.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+/* Cancellations complete with user_data 0, and with nothing to call */
+struct uring_op {
+    unpfs_io_done done;
+    void *arg;
+    struct uring_op *prev, *next;
+};
+
+static struct {
+    int active;
+    int can_cancel;
+    struct uring_op *ops;       /* Submitted and not yet completed */
+    int fd;
+    int efd;
+    unsigned int inflight;
+    unsigned int max_inflight;
+    /* Submission queue */
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    /* Completion queue */
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring;
+
+static int
+uring_supports(int opcode)
+{
+    int ret;
+    size_t size = sizeof (struct io_uring_probe) +
+        256 * sizeof (struct io_uring_probe_op);
+    struct io_uring_probe *probe = ixp_emallocz(size);
+
+    ret = syscall(__NR_io_uring_register, ring.fd,
+        IORING_REGISTER_PROBE, probe, 256) == 0 &&
+        opcode <= probe->last_op &&
+        probe->ops[opcode].flags & IO_URING_OP_SUPPORTED;
+
+    free(probe);
+
+    return ret;
+}
+
+/* Hand every queued entry to the kernel */
+static void
+uring_enter(void)
+{
+    unsigned int pending =
+        *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    if (pending && syscall(__NR_io_uring_enter, ring.fd, pending, 0, 0, NULL, 0) < 0)
+        unpfs_log(LOG_ERR, "%s: io_uring_enter: %s\n", __func__, strerror(errno));
+}
+
+static void
+uring_reap(IxpConn *c)
+{
+    uint64_t n;
+    unsigned int head = *ring.cq_head;
+
+    if (read(ring.efd, &n, sizeof n) < 0 && errno != EAGAIN)
+        unpfs_log(LOG_ERR, "%s: read: %s\n", __func__, strerror(errno));
+
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+        ssize_t res = cqe->res;
+
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+        --ring.inflight;
+        if (!op)
+            continue;
+
+        if (op->prev)
+            op->prev->next = op->next;
+        else
+            ring.ops = op->next;
+        if (op->next)
+            op->next->prev = op->prev;
+
+        op->done(op->arg, res);
+        zfree((char **)&op);
+    }
+
+    /* Entries a full queue held back */
+    uring_enter();
+}
+
+/* A cleared entry to fill in and pass to uring_push(), NULL if the ring is full */
+static struct io_uring_sqe *
+uring_sqe(void)
+{
+    unsigned int tail = *ring.sq_tail;
+    struct io_uring_sqe *sqe;
+
+    if (!ring.active || ring.inflight >= ring.max_inflight ||
+            tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    sqe = &ring.sqes[tail & *ring.sq_mask];
+    memset(sqe, 0, sizeof *sqe);
+
+    return sqe;
+}
+
+static void
+uring_push(void)
+{
+    unsigned int tail = *ring.sq_tail, index = tail & *ring.sq_mask;
+
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++ring.inflight;
+
+    uring_enter();
+}
+
+static int
+uring_submit(uint8_t opcode, int fd, const void *buf, size_t count,
+             uint64_t offset, unpfs_io_done done, void *arg)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    struct uring_op *op;
+
+    if (!sqe)
+        return -1;
+
+    op = zalloc(sizeof *op);
+    op->done = done;
+    op->arg = arg;
+    op->prev = NULL;
+    op->next = ring.ops;
+    if (ring.ops)
+        ring.ops->prev = op;
+    ring.ops = op;
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = count;
+    sqe->off = offset;
+    sqe->user_data = (uintptr_t)op;
+    uring_push();
+
+    return 0;
+}
+
+void
+unpfs_uring_cancel(void *arg)
+{
+    struct io_uring_sqe *sqe;
+    struct uring_op *op = ring.ops;
+
+    if (!ring.can_cancel)
+        return;
+
+    for (; op && op->arg != arg; op = op->next)
+        ;
+    if (!op || !(sqe = uring_sqe()))
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)op;
+    sqe->user_data = 0;
+    uring_push();
+}
+
+int
+unpfs_uring_read(int fd, void *buf, size_t count, uint64_t offset,
+                 unpfs_io_done done, void *arg)
+{
+    return uring_submit(IORING_OP_READ, fd, buf, count, offset, done, arg);
+}
+
+int
+unpfs_uring_write(int fd, const void *buf, size_t count, uint64_t offset,
+                  unpfs_io_done done, void *arg)
+{
+    return uring_submit(IORING_OP_WRITE, fd, buf, count, offset, done, arg);
+}
+
+int
+unpfs_uring_init(IxpServer *server, unsigned int entries)
+{
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    char *sq = MAP_FAILED, *cq;
+    int err;
+
+    memset(&p, 0, sizeof p);
+    ring.efd = -1;
+    ring.sqes = MAP_FAILED;
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+            !uring_supports(IORING_OP_READ) ||
+            !uring_supports(IORING_OP_WRITE)) {
+        close(ring.fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+    if (cq_size > sq_size)
+        sq_size = cq_size;
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    cq = sq;
+
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof (struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+        goto fail;
+
+    ring.sq_head  = (unsigned int *)(sq + p.sq_off.head);
+    ring.sq_tail  = (unsigned int *)(sq + p.sq_off.tail);
+    ring.sq_mask  = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.cq_head  = (unsigned int *)(cq + p.cq_off.head);
+    ring.cq_tail  = (unsigned int *)(cq + p.cq_off.tail);
+    ring.cq_mask  = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring.cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    /* Never more in flight than the completion queue holds */
+    ring.max_inflight = p.cq_entries;
+
+    ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring.efd < 0)
+        goto fail;
+
+    if (syscall(__NR_io_uring_register, ring.fd,
+            IORING_REGISTER_EVENTFD, &ring.efd, 1) < 0)
+        goto fail;
+
+    if (!ixp_listen(server, ring.efd, NULL, uring_reap, NULL)) {
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    ring.active = 1;
+    ring.can_cancel = uring_supports(IORING_OP_ASYNC_CANCEL);
+    unpfs_log(LOG_INFO, "%s: io_uring ready: sq=%u cq=%u\n",
+        __func__, p.sq_entries, p.cq_entries);
+
+    return 0;
+
+fail:
+    err = errno;
+    if (ring.efd >= 0)
+        close(ring.efd);
+    if (ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, p.sq_entries * sizeof (struct io_uring_sqe));
+    if (sq != MAP_FAILED)
+        munmap(sq, sq_size);
+    ring.sqes = NULL;
+    ring.efd = -1;
+    close(ring.fd);
+    errno = err;
+    return -1;
+}
@@ -0,0 +1,450 @@
+#include <unpfs/worker.h>
+#include <unpfs/ops.h>
+#include <unpfs/fid.h>
+#include <unpfs/inflight.h>
+#include <unpfs/log.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/*
+ * Every request handed to the pool becomes a job.  Jobs are kept in
+ * arrival order on the pending list, which only the server loop touches.
+ * A job that conflicts with an earlier one on the same fid is parked
+ * until the earlier one has been answered; the rest go to the run queue.
+ * A Tflush drops a job that has not started yet.  Work submitted for the
+ * other dialect skips the pending list and is ordered by its submitter.
+ */
+enum {
+    JOB_PARKED,
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE
+};
+
+typedef void (*unpfs_op)(Ixp9Req *);
+
+struct job {
+    Ixp9Req *req;
+    unpfs_op op;
+    void (*run)(void *);        /* Instead of req and op */
+    void (*done)(void *);
+    void *arg;
+    int exclusive;
+    int state;
+    int err;
+    struct job *prev;
+    struct job *next;
+    struct job *link;   /* run queue or completion queue */
+};
+
+static struct {
+    Ixp9Srv ops;
+    pthread_t *threads;
+    unsigned int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stopping;
+    int pipefd[2];
+    /* Protected by lock */
+    struct job *runq_head, *runq_tail;
+    struct job *doneq_head, *doneq_tail;
+    /* Server loop only */
+    struct job *pending_head, *pending_tail;
+} pool;
+
+static IxpFid *
+job_newfid(const struct job *job)
+{
+    return job->req->ifcall.hdr.type == P9_TWalk ? job->req->newfid : NULL;
+}
+
+static int
+jobs_conflict(const struct job *a, const struct job *b)
+{
+    IxpFid *anew = job_newfid(a), *bnew = job_newfid(b);
+
+    if (a->req->fid == b->req->fid && (a->exclusive || b->exclusive))
+        return 1;
+    if (anew && (anew == b->req->fid || anew == bnew))
+        return 1;
+    if (bnew && bnew == a->req->fid)
+        return 1;
+
+    return 0;
+}
+
+static int
+job_can_start(const struct job *job)
+{
+    const struct job *p = pool.pending_head;
+
+    for (; p && p != job; p = p->next) {
+        if (jobs_conflict(p, job))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void
+pending_unlink(struct job *job)
+{
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        pool.pending_head = job->next;
+
+    if (job->next)
+        job->next->prev = job->prev;
+    else
+        pool.pending_tail = job->prev;
+}
+
+static void
+runq_push(struct job *job)
+{
+    pthread_mutex_lock(&pool.lock);
+    job->state = JOB_QUEUED;
+    job->link = NULL;
+    if (pool.runq_tail)
+        pool.runq_tail->link = job;
+    else
+        pool.runq_head = job;
+    pool.runq_tail = job;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Takes job off the run queue if no worker has yet; its state before */
+static int
+runq_remove(struct job *job)
+{
+    struct job **p = &pool.runq_head, *prev = NULL;
+    int state;
+
+    pthread_mutex_lock(&pool.lock);
+    state = job->state;
+    if (state == JOB_QUEUED) {
+        for (; *p != job; prev = *p, p = &(*p)->link)
+            ;
+        *p = job->link;
+        if (pool.runq_tail == job)
+            pool.runq_tail = prev;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return state;
+}
+
+static void
+job_start(struct job *job)
+{
+    if (!pool.nthreads) {
+        /* The pool is gone, run it right here */
+        pending_unlink(job);
+        unpfs_inflight_end(job->req, NULL);
+        job->op(job->req);
+        zfree((char **)&job);
+        return;
+    }
+
+    runq_push(job);
+}
+
+static void
+pending_kick(void)
+{
+    struct job *job = pool.pending_head, *next;
+
+    for (; job; job = next) {
+        next = job->next;
+        if (job->state == JOB_PARKED && job_can_start(job))
+            job_start(job);
+    }
+}
+
+static void
+job_finish(struct job *job)
+{
+    Ixp9Req *r = job->req, *flush, *next;
+
+    if (job->run) {
+        if (job->done)
+            job->done(job->arg);
+        zfree((char **)&job);
+        return;
+    }
+
+    flush = unpfs_inflight_end(r, NULL);
+    pending_unlink(job);
+    r->aux = NULL;
+
+    if (!flush) {
+        unpfs_respond(r, job->err);
+    } else {
+        /* The first Rflush answers the flushed request with an error */
+        unpfs_discard_reply(r);
+        for (; flush; flush = next) {
+            next = flush->aux;
+            flush->aux = NULL;
+            pool.ops.flush(flush);
+        }
+    }
+
+    zfree((char **)&job);
+}
+
+static void
+worker_drain(IxpConn *c)
+{
+    char buf[64];
+    struct job *job, *next;
+
+    while (read(pool.pipefd[0], buf, sizeof buf) > 0)
+        ;
+
+    pthread_mutex_lock(&pool.lock);
+    job = pool.doneq_head;
+    pool.doneq_head = pool.doneq_tail = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (; job; job = next) {
+        next = job->link;
+        job_finish(job);
+    }
+
+    pending_kick();
+}
+
+static void *
+worker_main(void *arg)
+{
+    struct job *job;
+    int notify;
+
+    for (;;) {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.runq_head && !pool.stopping)
+            pthread_cond_wait(&pool.cond, &pool.lock);
+
+        job = pool.runq_head;
+        if (!job) {
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+
+        pool.runq_head = job->link;
+        if (!pool.runq_head)
+            pool.runq_tail = NULL;
+        job->state = JOB_RUNNING;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (job->run) {
+            job->run(job->arg);
+        } else {
+            job->req->aux = job;
+            job->op(job->req);
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        job->state = JOB_DONE;
+        job->link = NULL;
+        notify = !pool.doneq_head;
+        if (pool.doneq_tail)
+            pool.doneq_tail->link = job;
+        else
+            pool.doneq_head = job;
+        pool.doneq_tail = job;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (notify && write(pool.pipefd[1], "", 1) < 0 && errno != EAGAIN)
+            unpfs_log(LOG_ERR, "%s: write: %s\n", __func__, strerror(errno));
+    }
+
+    return NULL;
+}
+
+/* Drops the job unless a worker has already taken it */
+static int
+worker_cancel(Ixp9Req *r, void *arg)
+{
+    struct job *job = arg;
+    int state = runq_remove(job);
+
+    if (state == JOB_RUNNING || state == JOB_DONE)
+        return 1;
+
+    pending_unlink(job);
+    zfree((char **)&job);
+    pending_kick();
+
+    return 0;
+}
+
+static void
+worker_dispatch(Ixp9Req *r)
+{
+    struct job *job = zalloc(sizeof *job);
+
+    job->req = r;
+    job->exclusive = 1;
+    job->state = JOB_PARKED;
+    job->err = 0;
+    job->link = NULL;
+
+    switch (r->ifcall.hdr.type) {
+    case P9_TAttach: job->op = pool.ops.attach; break;
+    case P9_TClunk:  job->op = pool.ops.clunk;  break;
+    case P9_TCreate: job->op = pool.ops.create; break;
+    case P9_TOpen:   job->op = pool.ops.open;   break;
+    case P9_TRemove: job->op = pool.ops.remove; break;
+    case P9_TWStat:  job->op = pool.ops.wstat;  break;
+    case P9_TRead:   job->op = pool.ops.read;   job->exclusive = 0; break;
+    case P9_TWrite:  job->op = pool.ops.write;  job->exclusive = 0; break;
+    case P9_TStat:   job->op = pool.ops.stat;   job->exclusive = 0; break;
+    case P9_TWalk:   job->op = pool.ops.walk;   job->exclusive = 0; break;
+    default:
+        zfree((char **)&job);
+        unpfs_respond(r, ENOSYS);
+        return;
+    }
+
+    /* A directory fid shares one DIR stream */
+    if (r->ifcall.hdr.type == P9_TRead &&
+            ((struct unpfs_fid *)r->fid->aux)->type & P9_QTDIR)
+        job->exclusive = 1;
+
+    job->next = NULL;
+    job->prev = pool.pending_tail;
+    if (pool.pending_tail)
+        pool.pending_tail->next = job;
+    else
+        pool.pending_head = job;
+    pool.pending_tail = job;
+
+    unpfs_inflight_begin(r, 0, worker_cancel, job);
+    if (job_can_start(job))
+        job_start(job);
+}
+
+int
+unpfs_worker_start(IxpServer *server, Ixp9Srv *srv, unsigned int nthreads)
+{
+    unsigned int i;
+
+    if (pipe(pool.pipefd) < 0)
+        return -1;
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    fcntl(pool.pipefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool.pipefd[1], F_SETFL, O_NONBLOCK);
+    fcntl(pool.pipefd[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pool.pipefd[1], F_SETFD, FD_CLOEXEC);
+
+    if (!ixp_listen(server, pool.pipefd[0], NULL, worker_drain, NULL)) {
+        close(pool.pipefd[0]);
+        close(pool.pipefd[1]);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pool.ops = *srv;
+    pool.threads = ixp_emallocz(nthreads * sizeof *pool.threads);
+
+    for (i = 0; i < nthreads; ++i) {
+        int err = pthread_create(&pool.threads[i], NULL, worker_main, NULL);
+        if (err) {
+            unpfs_log(LOG_ERR, "%s: pthread_create: %s\n",
+                __func__, strerror(err));
+            break;
+        }
+    }
+
+    pool.nthreads = i;
+    if (!pool.nthreads) {
+        zfree((char **)&pool.threads);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    srv->attach = worker_dispatch;
+    srv->clunk  = worker_dispatch;
+    srv->create = worker_dispatch;
+    srv->open   = worker_dispatch;
+    srv->read   = worker_dispatch;
+    srv->remove = worker_dispatch;
+    srv->stat   = worker_dispatch;
+    srv->walk   = worker_dispatch;
+    srv->write  = worker_dispatch;
+    srv->wstat  = worker_dispatch;
+
+    unpfs_log(LOG_INFO, "%s: %u workers started\n", __func__, pool.nthreads);
+
+    return 0;
+}
+
+void
+unpfs_worker_stop(void)
+{
+    unsigned int i;
+
+    if (!pool.nthreads)
+        return;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.nthreads; ++i)
+        pthread_join(pool.threads[i], NULL);
+
+    /* From now on requests are executed by the server loop itself */
+    pool.nthreads = 0;
+    zfree((char **)&pool.threads);
+    close(pool.pipefd[1]);
+
+    worker_drain(NULL);
+}
+
+void *
+unpfs_worker_submit(void (*run)(void *), void (*done)(void *), void *arg)
+{
+    struct job *job;
+
+    if (!pool.nthreads)
+        return NULL;
+
+    job = zalloc(sizeof *job);
+    job->run = run;
+    job->done = done;
+    job->arg = arg;
+    runq_push(job);
+
+    return job;
+}
+
+int
+unpfs_worker_cancel(void *work)
+{
+    struct job *job = work;
+
+    if (runq_remove(job) != JOB_QUEUED)
+        return 1;
+
+    zfree((char **)&job);
+
+    return 0;
+}
+
+void
+unpfs_worker_done(Ixp9Req *r, int err)
+{
+    struct job *job = r->aux;
+
+    job->err = err;
+}